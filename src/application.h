@@ -1,15 +1,28 @@
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <thread>
+#include <vector>
 #include "imgui.h"
 
 // Raytracer
 #include "raytracer/rtweekend.h"
 
 #include "raytracer/camera.h"
+#include "raytracer/environment.h"
+#include "raytracer/g_buffer.h"
+#include "raytracer/hash.h"
 #include "raytracer/hittable.h"
 #include "raytracer/hittable_list.h"
 #include "raytracer/material.h"
+#include "raytracer/scene.h"
+#include "raytracer/scenes.h"
 #include "raytracer/sphere.h"
+#include "raytracer/texture.h"
+#include "raytracer/texture_cache.h"
 
 /*
 Issues and current ideas 
@@ -17,8 +30,9 @@ Right now we really have too main issues to sort out.
     Making sure we don't block the UI during a render.
     AND
     Showing a Preview while it's rendering.
-Image - We need to find a way to upload a image from RAM to the GPU
-    via vulkan API.
+Image - The interactive preview goes up through uploadPreview, which
+    main.cpp implements with the vulkan API. Final renders are still only
+    written to disk.
 Threading - Creating Two threads. One for dealing with the renders jobs
     and the other for dealing with rendering the UI.
     https://stackoverflow.com/questions/15752659/thread-pooling-in-c11
@@ -29,28 +43,74 @@ class Application
         bool renderInProgress = false;
         // System Config
         bool useThreading = false;
+        int maxThreads = 0;
+        bool numaAware = false;
         // ImagePlane Config
         double aspectRatio = 16.0 / 9.0;
         int imagePlaneWidth = 1200;
         // Samples Config
         int samplesPerPixel = 500;
+        double timeBudget = 0;
         int maxDepth = 50;
+        // Denoise Config
+        bool denoise = false;
+        int denoiseIterations = 5;
+        // Irradiance Cache Config
+        bool useIrradianceCache = false;
+        double irradianceCacheTolerance = 0.3;
+        // Path Guiding Config
+        bool pathGuiding = false;
+        // Look-Dev Config
+        bool lookDev = false;
+        // Render Cache Config
+        bool useRenderCache = false;
+        int seed = 0;
+        // Live Preview Config
+        bool livePreview = false;
+        char previewName[64] = "/raytracer-preview";
+        // Re-renders coarse to fine on every change, shown in the Preview window
+        bool interactivePreview = false;
+        // Scene Config, 0 spheres is the classic 22x22 grid
+        int sphereCount = 0;
+        int sceneSeed = 0;
+        // acceleratorKind of the spheres, auto picks by count and spread
+        int accelerator = 0;
+        // Out-of-core spheres, paged in from a file under this budget
+        bool outOfCore = false;
+        int geometryBudgetMB = 1024;
+        // Texture Config
+        char groundTexture[256] = "";
+        // Environment Config
+        char environmentPath[256] = "";
+        float environmentIntensity = 1.0f;
         // Camera Transformation
         double cameraFov = 20;
-        int cameraLookFrom[3];
-        int cameraLookAt[3];
-        int cameraViewUp[3];
+        int cameraLookFrom[3] = {13, 2, 3};
+        int cameraLookAt[3] = {0, 0, 0};
+        int cameraViewUp[3] = {0, 1, 0};
         // Camera Lens
-        float cameraDefocusAngle;
-        float cameraFocusDistance;
+        float cameraDefocusAngle = 0.6f;
+        float cameraFocusDistance = 10.0f;
         // Export 
-        char filename[128];
+        char filename[128] = "output.exr";
+
+        // Set by the host: copies width x height RGBA8 pixels to the GPU and
+        // returns the texture to draw them with. Without it the Preview
+        // window has nothing to show.
+        std::function<ImTextureID(const uint8_t* rgba, int width, int height)> uploadPreview;
+
+        ~Application()
+        {
+            stopPreview();
+        }
 
         void renderUI()
         {
             ImGui::Begin("raytracing");
             ImGui::SeparatorText("System");
             ImGui::Checkbox(": Use Threading", &useThreading);
+            ImGui::InputInt(": Max Threads (0 = all)", &maxThreads);
+            ImGui::Checkbox(": NUMA Aware", &numaAware);
 
             ImGui::SeparatorText("ImagePlane");
             ImGui::InputDouble(": Aspect Ratio", &aspectRatio, 0.01f, 1.0f, "%.8f");
@@ -58,105 +118,349 @@ class Application
             
             ImGui::SeparatorText("Samples");
             ImGui::InputInt(": Samples Per Pixel", &samplesPerPixel);
+            ImGui::InputDouble(": Time Budget (s, 0 = off)", &timeBudget, 1.0f, 10.0f, "%.1f");
             ImGui::InputInt(": Max Depth", &maxDepth);
 
+            ImGui::SeparatorText("Denoise");
+            ImGui::Checkbox(": Denoise", &denoise);
+            ImGui::InputInt(": Denoise Iterations", &denoiseIterations);
+
+            ImGui::SeparatorText("Irradiance Cache");
+            ImGui::Checkbox(": Use Irradiance Cache", &useIrradianceCache);
+            ImGui::InputDouble(": Cache Tolerance", &irradianceCacheTolerance, 0.01f, 0.1f, "%.3f");
+
+            ImGui::SeparatorText("Path Guiding");
+            ImGui::Checkbox(": Guide Diffuse Bounces", &pathGuiding);
+
+            ImGui::SeparatorText("Look-Dev");
+            ImGui::Checkbox(": Reuse Camera Hits", &lookDev);
+
+            ImGui::SeparatorText("Render Cache");
+            ImGui::Checkbox(": Reuse Previous Samples", &useRenderCache);
+            ImGui::InputInt(": Seed", &seed);
+
+            ImGui::SeparatorText("Live Preview");
+#ifdef __linux__
+            ImGui::Checkbox(": Stream to Shared Memory", &livePreview);
+            ImGui::InputText(": Segment Name", previewName, IM_ARRAYSIZE(previewName));
+#endif
+            ImGui::Checkbox(": Interactive Preview", &interactivePreview);
+
+            ImGui::SeparatorText("Scene");
+            ImGui::InputInt(": Sphere Count (0 = classic)", &sphereCount, 1000, 1000000);
+            ImGui::InputInt(": Scene Seed", &sceneSeed);
+            const char* accelerators[] = {"Auto", "List", "BVH", "Grid"};
+            ImGui::Combo(": Accelerator", &accelerator, accelerators, IM_ARRAYSIZE(accelerators));
+            ImGui::Checkbox(": Out of Core", &outOfCore);
+            ImGui::InputInt(": Geometry Budget (MB)", &geometryBudgetMB);
+
+            ImGui::SeparatorText("Textures");
+            ImGui::InputText(": Ground Texture (tiled EXR)", groundTexture, IM_ARRAYSIZE(groundTexture));
+
+            ImGui::SeparatorText("Environment");
+            ImGui::InputText(": Environment (lat-long EXR)", environmentPath, IM_ARRAYSIZE(environmentPath));
+            ImGui::InputFloat(": Environment Intensity", &environmentIntensity, 0.1f, 1.0f, "%.3f");
+
             ImGui::SeparatorText("Camera Transformations");
-            int cameraLookFrom[3] = {13, 2, 3};
-            int cameraLookAt[3] = {0, 0, 0};
-            int cameraViewUp[3] = {0, 1, 0};
             ImGui::InputDouble(": Camera FOV", &cameraFov, 0.01f, 1.0f, "%.8f");
             ImGui::InputInt3(": Camera Look From", cameraLookFrom);
             ImGui::InputInt3(": Camera Look At", cameraLookAt);
             ImGui::InputInt3(": Camera View Up", cameraViewUp);
             
             ImGui::SeparatorText("Camera Lens");
-            float cameraDefocusAngle = 0.6f;
-            float cameraFocusDistance = 10.0f;
             ImGui::InputFloat(": Camera Defocus Angle", &cameraDefocusAngle, 0.01f, 1.0f, "%.3f");
             ImGui::InputFloat(": Camera Focus Distance", &cameraFocusDistance, 0.01f, 1.0f, "%.3f");
             
             
             ImGui::SeparatorText("Export");
-            char filename[128] = "output.exr";
-            ImGui::InputText(": Filename", filename, IM_ARRAYSIZE(filename));
+            ImGui::InputText(": Filename (.exr, .png, .ppm)", filename, IM_ARRAYSIZE(filename));
             if (ImGui::Button("Start Render!"))
             {
                 startRayTracer();
             }
             ImGui::End();
             ImGui::ShowDemoWindow();
+            updatePreview();
+            drawPreview();
         }
     private:
-        void startRayTracer()
+        // Shared by every render, so texture tiles read once stay resident.
+        textureCache textures;
+        // Kept between renders, building its distribution is not free.
+        std::shared_ptr<environmentMap> environment;
+        // Camera hits of the last render, for look-dev. Renders and previews
+        // never run at once, so they share it.
+        std::shared_ptr<gBuffer> lookDevHits;
+
+        // The interactive preview renders on its own thread and is cancelled
+        // and restarted whenever a setting changes. Its scene is only rebuilt
+        // when a scene setting changes, so camera and lens edits restart
+        // straight away. Only the preview thread touches previewWorld while
+        // it runs.
+        std::thread previewWorker;
+        std::atomic<bool> previewCancel{false};
+        std::unique_ptr<camera> previewCamera;
+        std::unique_ptr<scene> previewWorld;
+        uint64_t previewKey = 0;
+        uint64_t previewSceneKey = 0;
+        // The UI thread reads previewCamera's frames in place and uploads a
+        // frame once, when it is newer than the one on screen.
+        previewReader previewFrames;
+        uint64_t previewShown = 0;
+        std::vector<uint8_t> previewPixels;
+        ImTextureID previewTexture = ImTextureID();
+        int previewWidth = 0, previewHeight = 0;
+
+        uint64_t sceneKey() const
         {
-            if(!renderInProgress)
+            hasher h;
+            h.add(sphereCount);
+            h.add(sceneSeed);
+            h.add(accelerator);
+            h.add(outOfCore);
+            h.add(geometryBudgetMB);
+            h.add(std::string(groundTexture));
+            return h.digest();
+        }
+
+        uint64_t settingsKey() const
+        {
+            hasher h;
+            h.add(sceneKey());
+            h.add(maxThreads);
+            h.add(aspectRatio);
+            h.add(imagePlaneWidth);
+            h.add(samplesPerPixel);
+            h.add(maxDepth);
+            h.add(useIrradianceCache);
+            h.add(irradianceCacheTolerance);
+            h.add(pathGuiding);
+            h.add(lookDev);
+            h.add(seed);
+            h.add(std::string(environmentPath));
+            h.add(environmentIntensity);
+            h.add(cameraFov);
+            h.add(cameraLookFrom);
+            h.add(cameraLookAt);
+            h.add(cameraViewUp);
+            h.add(cameraDefocusAngle);
+            h.add(cameraFocusDistance);
+            return h.digest();
+        }
+
+        void updatePreview()
+        {
+            if (!interactivePreview || renderInProgress)
             {
-                renderInProgress = true;
-                std::cout << "Render Started..." << std::endl;
+                stopPreview();
+                return;
+            }
+            uint64_t key = settingsKey();
+            if (previewCamera && key == previewKey)
+            {
+                return;
+            }
+            stopPreview();
+            previewKey = key;
 
-                hittable_list world;
-                auto groundMaterial = make_shared<diffuse>(color(0.5,0.5,0.5));
-                world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, groundMaterial));
+            if (!previewWorld || sceneKey() != previewSceneKey)
+            {
+                previewWorld = std::make_unique<scene>();
+                buildScene(*previewWorld);
+                previewSceneKey = sceneKey();
+            }
 
-                for (int a = -11; a < 11; a++)
-                {
-                    for (int b = -11; b < 11; b++)
+            previewCamera = std::make_unique<camera>();
+            configureCamera(*previewCamera);
+            previewCamera->previewInProcess = true;
+            previewCamera->cancel = &previewCancel;
+            previewCamera->logProgress = false;
+            previewCancel = false;
+            previewWorker = std::thread([cam = previewCamera.get(), world = previewWorld.get()]{
+                cam->progressiveRender(*world);
+            });
+        }
+
+        void stopPreview()
+        {
+            previewFrames.close();
+            previewShown = 0;
+            if (previewWorker.joinable())
+            {
+                previewCancel = true;
+                previewWorker.join();
+            }
+            previewCamera.reset();
+        }
+
+        // The last frame stays up while a restarted preview gets its first one out.
+        void drawPreview()
+        {
+            if (!interactivePreview)
+            {
+                return;
+            }
+            if (previewCamera && !previewFrames.isOpen())
+            {
+                previewFrames.attach(previewCamera->previewStream());
+            }
+            if (uploadPreview && previewFrames.isOpen() && previewFrames.published() != previewShown)
+            {
+                uint64_t published = previewFrames.published();
+                int width = 0, height = 0;
+                bool intact = previewFrames.read([&](const previewView& view){
+                    width = view.width;
+                    height = view.height;
+                    size_t count = size_t(width) * height;
+                    previewPixels.resize(count * 4);
+                    uint8_t* pixels = previewPixels.data();
+                    floatToSrgb8(view.r, view.g, view.b, pixels, count);
+                    // RGB to RGBA in place, back to front so nothing is overwritten before it is moved.
+                    for (size_t i = count; i-- > 0;)
                     {
-                        auto chooseMat = randomDouble();
-                        point3 center(a + 0.9*randomDouble(), 0.2, b + 0.9*randomDouble());
-                        if ((center - point3(4, 0.2, 0)).length() > 0.9)
-                        {
-                            shared_ptr<material> sphereMaterial;
-
-                            if (chooseMat < 0.8)
-                            {
-                                auto albedo = color::random() * color::random();
-                                sphereMaterial = make_shared<diffuse>(albedo);
-                                world.add(make_shared<sphere>(center, 0.2, sphereMaterial));
-                            } else if (chooseMat < 0.95){
-                                auto albedo = color::random();
-                                auto fuzz = randomDouble(0, 0.5);
-                                sphereMaterial = make_shared<metal>(albedo, fuzz);
-                                world.add(make_shared<sphere>(center, 0.2, sphereMaterial));
-                            } else {
-                                sphereMaterial = make_shared<glass>(1.5);
-                                world.add(make_shared<sphere>(center, 0.2, sphereMaterial));
-                            }
-                        }
+                        pixels[i * 4 + 3] = 255;
+                        pixels[i * 4 + 2] = pixels[i * 3 + 2];
+                        pixels[i * 4 + 1] = pixels[i * 3 + 1];
+                        pixels[i * 4 + 0] = pixels[i * 3 + 0];
                     }
+                });
+                if (intact)
+                {
+                    previewTexture = uploadPreview(previewPixels.data(), width, height);
+                    previewWidth = width;
+                    previewHeight = height;
+                    previewShown = published;
+                }
+            }
+
+            ImGui::Begin("Preview");
+            if (previewTexture)
+            {
+                // Fills the window's width.
+                ImVec2 room = ImGui::GetContentRegionAvail();
+                ImGui::Image(previewTexture, ImVec2(room.x, room.x * previewHeight / previewWidth));
+            } else {
+                ImGui::Text(uploadPreview ? "Waiting for the first frame..." : "This host can't upload images.");
+            }
+            ImGui::End();
+        }
+
+        // Everything the UI sets on a camera, for final renders and previews alike.
+        void configureCamera(camera& cam)
+        {
+            cam.aspectRatio = aspectRatio;
+            cam.imagePlaneWidth = imagePlaneWidth;
+            cam.samplesPerPixel = samplesPerPixel;
+            cam.timeBudget = timeBudget;
+            cam.maxDepth = maxDepth;
+            cam.denoise = denoise;
+            cam.denoiseIterations = denoiseIterations;
+            cam.useIrradianceCache = useIrradianceCache;
+            cam.irradianceCacheTolerance = irradianceCacheTolerance;
+            cam.pathGuiding = pathGuiding;
+            if (lookDev && !lookDevHits)
+            {
+                lookDevHits = std::make_shared<gBuffer>();
+            }
+            cam.lookDev = lookDev ? lookDevHits : nullptr;
+            cam.useRenderCache = useRenderCache;
+            cam.seed = seed;
+            cam.previewName = livePreview ? previewName : "";
+            cam.environment = loadEnvironment();
+
+            cam.maxConcurrency = maxThreads;
+
+            cam.viewFov = cameraFov;
+            cam.lookFrom = point3(cameraLookFrom[0], cameraLookFrom[1], cameraLookFrom[2]);
+            cam.lookAt = point3(cameraLookAt[0], cameraLookAt[1], cameraLookAt[2]);
+            cam.vUp = vec3(cameraViewUp[0],cameraViewUp[1],cameraViewUp[2]);
+
+            cam.defocusAngle = cameraDefocusAngle;
+            cam.focusDist = cameraFocusDistance;
+            cam.outputPath = filename;
+        }
+
+        std::shared_ptr<const environmentMap> loadEnvironment()
+        {
+            if (!environmentPath[0])
+            {
+                return nullptr;
+            }
+            if (!environment || environment->source() != environmentPath)
+            {
+                environment = std::make_shared<environmentMap>();
+                if (!environment->load(environmentPath))
+                {
+                    environment.reset();
+                    return nullptr;
                 }
+            }
+            environment->intensity = environmentIntensity;
+            return environment;
+        }
 
-                auto material1 = make_shared<glass>(1.5);
-                world.add(make_shared<sphere>(point3(0,1,0), 1.0, material1));
+        void buildScene(scene& world)
+        {
+            TRACE_ZONE("scene build");
+            const texture* ground = groundTexture[0] ? world.make<imageTexture>(textures, groundTexture) : nullptr;
+            if (sphereCount > 0 && outOfCore)
+            {
+                // Written once per count and seed, later renders reuse the file.
+                std::string path = "sphereField-" + std::to_string(sphereCount) + "-" + std::to_string(sceneSeed) + ".rtspheres";
+                std::error_code error;
+                if (!std::filesystem::exists(path, error) && !writeSphereFieldFile(path, size_t(sphereCount), uint64_t(sceneSeed)))
+                {
+                    return;
+                }
+                buildPagedSphereField(world, path, size_t(sphereCount), uint64_t(sceneSeed),
+                    size_t(std::max(geometryBudgetMB, 1)) << 20, ground);
+            } else if (sphereCount > 0) {
+                buildSphereField(world, size_t(sphereCount), uint64_t(sceneSeed), ground, acceleratorKind(accelerator));
+            } else {
+                buildRandomSpheres(world, uint64_t(sceneSeed), ground);
+            }
+        }
 
-                auto material2 = make_shared<diffuse>(color(0.4, 0.2, 0.1));
-                world.add(make_shared<sphere>(point3(-4,1,0), 1.0, material2));
+        void startRayTracer()
+        {
+            if(!renderInProgress)
+            {
+                stopPreview();
+                renderInProgress = true;
+                std::cout << "Render Started..." << std::endl;
 
-                auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-                world.add(make_shared<sphere>(point3(4,1,0), 1.0, material3));
+                auto buildStart = std::chrono::steady_clock::now();
+                scene world;
+                buildScene(world);
+                std::chrono::duration<double, std::milli> buildTime = std::chrono::steady_clock::now() - buildStart;
+                std::cout << "Scene built: " << world.size() << " objects, " << world.bytesUsed()
+                          << " bytes in " << buildTime.count() << "ms" << std::endl;
 
                 camera cam;
-                cam.aspectRatio = aspectRatio;
-                cam.imagePlaneWidth = imagePlaneWidth;
-                cam.samplesPerPixel = samplesPerPixel;
-                cam.maxDepth = maxDepth;
-                
-                cam.viewFov = cameraFov;
-                cam.lookFrom = point3(cameraLookFrom[0], cameraLookFrom[1], cameraLookFrom[2]);
-                cam.lookAt = point3(cameraLookAt[0], cameraLookAt[1], cameraLookAt[2]);
-                cam.vUp = vec3(cameraViewUp[0],cameraViewUp[1],cameraViewUp[2]);
-
-                cam.defocusAngle = cameraDefocusAngle;
-                cam.focusDist = cameraFocusDistance;
+                configureCamera(cam);
+                cam.numaAware = numaAware;
+                if (numaAware)
+                {
+                    cam.sceneFactory = [this]{
+                        auto nodeWorld = std::make_unique<scene>();
+                        buildScene(*nodeWorld);
+                        return std::unique_ptr<hittable>(std::move(nodeWorld));
+                    };
+                }
 
                 if (useThreading)
                 {
                     cam.parallelRender(world);
                 } else {
-                    std::thread renderJob(cam.render(), world);
                     cam.render(world);
                 };
+                if (groundTexture[0])
+                {
+                    std::cout << "Texture cache: " << textures.describe() << std::endl;
+                }
+                // Only in RAYTRACING_ENABLE_TRACING builds, otherwise a no-op.
+                trace::writeChromeTrace("trace.json");
                 renderInProgress = false;
             }
         };
-};W
+};
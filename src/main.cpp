@@ -20,6 +20,7 @@
 #include "imgui_impl_vulkan.h"
 #include <stdio.h>          // printf, fprintf
 #include <stdlib.h>         // abort
+#include <string.h>         // memcpy
 #define GLFW_INCLUDE_NONE
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
@@ -57,6 +58,25 @@ static ImGui_ImplVulkanH_Window g_MainWindowData;
 static int                      g_MinImageCount = 2;
 static bool                     g_SwapChainRebuild = false;
 
+// The interactive preview, see Application::uploadPreview.
+// Recreated when the frame size changes, otherwise overwritten in place.
+struct PreviewTexture
+{
+    int                 Width = 0;
+    int                 Height = 0;
+    VkImage             Image = VK_NULL_HANDLE;
+    VkDeviceMemory      ImageMemory = VK_NULL_HANDLE;
+    VkImageView         ImageView = VK_NULL_HANDLE;
+    VkSampler           Sampler = VK_NULL_HANDLE;
+    VkDescriptorSet     DescriptorSet = VK_NULL_HANDLE;
+    VkBuffer            UploadBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory      UploadMemory = VK_NULL_HANDLE;
+    void*               UploadMapped = nullptr;
+    VkCommandPool       CommandPool = VK_NULL_HANDLE;
+    VkCommandBuffer     CommandBuffer = VK_NULL_HANDLE;
+};
+static PreviewTexture           g_PreviewTexture;
+
 static void glfw_error_callback(int error, const char* description)
 {
     fprintf(stderr, "GLFW Error %d: %s\n", error, description);
@@ -231,17 +251,16 @@ static void SetupVulkan(ImVector<const char*> instance_extensions)
     }
 
     // Create Descriptor Pool
-    // The example only requires a single combined image sampler descriptor for the font image and only uses one descriptor set (for that)
-    // If you wish to load e.g. additional textures you may need to alter pools sizes.
+    // One combined image sampler descriptor set for the font image and one for the preview texture.
     {
         VkDescriptorPoolSize pool_sizes[] =
         {
-            { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1 },
+            { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2 },
         };
         VkDescriptorPoolCreateInfo pool_info = {};
         pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
         pool_info.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
-        pool_info.maxSets = 1;
+        pool_info.maxSets = 2;
         pool_info.poolSizeCount = (uint32_t)IM_ARRAYSIZE(pool_sizes);
         pool_info.pPoolSizes = pool_sizes;
         err = vkCreateDescriptorPool(g_Device, &pool_info, g_Allocator, &g_DescriptorPool);
@@ -302,6 +321,197 @@ static void CleanupVulkanWindow()
     ImGui_ImplVulkanH_DestroyWindow(g_Instance, g_Device, &g_MainWindowData, g_Allocator);
 }
 
+static uint32_t FindMemoryType(uint32_t type_bits, VkMemoryPropertyFlags properties)
+{
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    vkGetPhysicalDeviceMemoryProperties(g_PhysicalDevice, &memory_properties);
+    for (uint32_t i = 0; i < memory_properties.memoryTypeCount; i++)
+        if ((type_bits & (1u << i)) && (memory_properties.memoryTypes[i].propertyFlags & properties) == properties)
+            return i;
+    fprintf(stderr, "[vulkan] No memory type for the preview texture\n");
+    abort();
+}
+
+static void DestroyPreviewTexture(PreviewTexture* tex)
+{
+    if (tex->DescriptorSet != VK_NULL_HANDLE)
+        ImGui_ImplVulkan_RemoveTexture(tex->DescriptorSet);
+    vkDestroyCommandPool(g_Device, tex->CommandPool, g_Allocator);
+    vkDestroyBuffer(g_Device, tex->UploadBuffer, g_Allocator);
+    vkFreeMemory(g_Device, tex->UploadMemory, g_Allocator);
+    vkDestroySampler(g_Device, tex->Sampler, g_Allocator);
+    vkDestroyImageView(g_Device, tex->ImageView, g_Allocator);
+    vkDestroyImage(g_Device, tex->Image, g_Allocator);
+    vkFreeMemory(g_Device, tex->ImageMemory, g_Allocator);
+    *tex = PreviewTexture();
+}
+
+static void CreatePreviewTexture(PreviewTexture* tex, int width, int height)
+{
+    VkResult err;
+    tex->Width = width;
+    tex->Height = height;
+    VkDeviceSize upload_size = (VkDeviceSize)width * height * 4;
+
+    // Sampled as is: the pixels are already sRGB encoded, like the rest of the UI.
+    {
+        VkImageCreateInfo info = {};
+        info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        info.imageType = VK_IMAGE_TYPE_2D;
+        info.format = VK_FORMAT_R8G8B8A8_UNORM;
+        info.extent.width = width;
+        info.extent.height = height;
+        info.extent.depth = 1;
+        info.mipLevels = 1;
+        info.arrayLayers = 1;
+        info.samples = VK_SAMPLE_COUNT_1_BIT;
+        info.tiling = VK_IMAGE_TILING_OPTIMAL;
+        info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        err = vkCreateImage(g_Device, &info, g_Allocator, &tex->Image);
+        check_vk_result(err);
+        VkMemoryRequirements req;
+        vkGetImageMemoryRequirements(g_Device, tex->Image, &req);
+        VkMemoryAllocateInfo alloc_info = {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        alloc_info.allocationSize = req.size;
+        alloc_info.memoryTypeIndex = FindMemoryType(req.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        err = vkAllocateMemory(g_Device, &alloc_info, g_Allocator, &tex->ImageMemory);
+        check_vk_result(err);
+        err = vkBindImageMemory(g_Device, tex->Image, tex->ImageMemory, 0);
+        check_vk_result(err);
+    }
+    {
+        VkImageViewCreateInfo info = {};
+        info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        info.image = tex->Image;
+        info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        info.format = VK_FORMAT_R8G8B8A8_UNORM;
+        info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        info.subresourceRange.levelCount = 1;
+        info.subresourceRange.layerCount = 1;
+        err = vkCreateImageView(g_Device, &info, g_Allocator, &tex->ImageView);
+        check_vk_result(err);
+    }
+    {
+        VkSamplerCreateInfo info = {};
+        info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        info.magFilter = VK_FILTER_LINEAR;
+        info.minFilter = VK_FILTER_LINEAR;
+        info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+        info.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        info.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        info.minLod = -1000;
+        info.maxLod = 1000;
+        info.maxAnisotropy = 1.0f;
+        err = vkCreateSampler(g_Device, &info, g_Allocator, &tex->Sampler);
+        check_vk_result(err);
+    }
+    tex->DescriptorSet = ImGui_ImplVulkan_AddTexture(tex->Sampler, tex->ImageView, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    // Staging buffer, mapped for as long as the texture lives
+    {
+        VkBufferCreateInfo info = {};
+        info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        info.size = upload_size;
+        info.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+        info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        err = vkCreateBuffer(g_Device, &info, g_Allocator, &tex->UploadBuffer);
+        check_vk_result(err);
+        VkMemoryRequirements req;
+        vkGetBufferMemoryRequirements(g_Device, tex->UploadBuffer, &req);
+        VkMemoryAllocateInfo alloc_info = {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        alloc_info.allocationSize = req.size;
+        alloc_info.memoryTypeIndex = FindMemoryType(req.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        err = vkAllocateMemory(g_Device, &alloc_info, g_Allocator, &tex->UploadMemory);
+        check_vk_result(err);
+        err = vkBindBufferMemory(g_Device, tex->UploadBuffer, tex->UploadMemory, 0);
+        check_vk_result(err);
+        err = vkMapMemory(g_Device, tex->UploadMemory, 0, upload_size, 0, &tex->UploadMapped);
+        check_vk_result(err);
+    }
+    {
+        VkCommandPoolCreateInfo info = {};
+        info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        info.queueFamilyIndex = g_QueueFamily;
+        err = vkCreateCommandPool(g_Device, &info, g_Allocator, &tex->CommandPool);
+        check_vk_result(err);
+        VkCommandBufferAllocateInfo alloc_info = {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        alloc_info.commandPool = tex->CommandPool;
+        alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        alloc_info.commandBufferCount = 1;
+        err = vkAllocateCommandBuffers(g_Device, &alloc_info, &tex->CommandBuffer);
+        check_vk_result(err);
+    }
+}
+
+// Waits for the queue to drain first, frames in flight may still sample the texture.
+// Only happens when the preview has a new frame, a few times a second at most.
+static ImTextureID UploadPreviewTexture(const uint8_t* rgba, int width, int height)
+{
+    PreviewTexture* tex = &g_PreviewTexture;
+    VkResult err = vkQueueWaitIdle(g_Queue);
+    check_vk_result(err);
+    if (tex->Width != width || tex->Height != height)
+    {
+        DestroyPreviewTexture(tex);
+        CreatePreviewTexture(tex, width, height);
+    }
+    memcpy(tex->UploadMapped, rgba, (size_t)width * height * 4);
+
+    err = vkResetCommandPool(g_Device, tex->CommandPool, 0);
+    check_vk_result(err);
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags |= VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    err = vkBeginCommandBuffer(tex->CommandBuffer, &begin_info);
+    check_vk_result(err);
+
+    // The whole image is overwritten, so its old contents can be discarded.
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = tex->Image;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.layerCount = 1;
+    vkCmdPipelineBarrier(tex->CommandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    VkBufferImageCopy region = {};
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent.width = width;
+    region.imageExtent.height = height;
+    region.imageExtent.depth = 1;
+    vkCmdCopyBufferToImage(tex->CommandBuffer, tex->UploadBuffer, tex->Image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    vkCmdPipelineBarrier(tex->CommandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+    err = vkEndCommandBuffer(tex->CommandBuffer);
+    check_vk_result(err);
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &tex->CommandBuffer;
+    err = vkQueueSubmit(g_Queue, 1, &submit_info, VK_NULL_HANDLE);
+    check_vk_result(err);
+    err = vkQueueWaitIdle(g_Queue);
+    check_vk_result(err);
+    return (ImTextureID)tex->DescriptorSet;
+}
+
 static void FrameRender(ImGui_ImplVulkanH_Window* wd, ImDrawData* draw_data)
 {
     VkResult err;
@@ -489,6 +699,7 @@ int main(int, char**)
     ImVec4 clear_color = ImVec4(0.45f, 0.55f, 0.60f, 1.00f);
 
     Application App;
+    App.uploadPreview = UploadPreviewTexture;
 
     // Main loop
     while (!glfwWindowShouldClose(window))
@@ -550,6 +761,7 @@ int main(int, char**)
     // Cleanup
     err = vkDeviceWaitIdle(g_Device);
     check_vk_result(err);
+    DestroyPreviewTexture(&g_PreviewTexture);
     ImGui_ImplVulkan_Shutdown();
     ImGui_ImplGlfw_Shutdown();
     ImGui::DestroyContext();
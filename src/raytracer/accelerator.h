@@ -0,0 +1,164 @@
+#ifndef ACCELERATOR_H
+#define ACCELERATOR_H
+
+#include "rtweekend.h"
+#include "material.h"
+#include "scene.h"
+#include "sphere.h"
+#include "sphere_grid.h"
+#include "sphere_list.h"
+#include "sphere_set.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// Which structure a large set of spheres is rendered from: every sphere
+// tested in SIMD blocks (sphere_list), a BVH (sphere_set) or a uniform grid
+// (sphere_grid). automatic measures the spheres and picks one.
+enum class acceleratorKind
+{
+    automatic,
+    list,
+    bvh,
+    grid
+};
+
+inline const char* acceleratorName(acceleratorKind kind)
+{
+    switch (kind)
+    {
+        case acceleratorKind::list: return "list";
+        case acceleratorKind::bvh: return "bvh";
+        case acceleratorKind::grid: return "grid";
+        default: return "auto";
+    }
+}
+
+// What decides between them. Measured on the grid sphere_grid would build,
+// counting each sphere in the cell of its center and in every cell its
+// bounds overlap.
+struct sphereDistribution
+{
+    size_t count = 0;
+    // Cells holding no sphere center. High when spheres cluster, and a grid
+    // walk then spends its time crossing empty cells.
+    double emptyCells = 0;
+    // Cube root of the number of cells, about how many a ray crosses.
+    double cellsAcross = 0;
+    // Cells the average sphere overlaps. High when radii vary, a big sphere
+    // is then listed, and tested, in many cells.
+    double cellsPerSphere = 0;
+
+    static sphereDistribution measure(const std::vector<compactSphere>& spheres)
+    {
+        sphereDistribution d;
+        d.count = spheres.size();
+        if (spheres.empty())
+        {
+            return d;
+        }
+        double lo[3];
+        double hi[3];
+        sphere_grid::bounds(spheres, lo, hi);
+        auto dims = sphere_grid::resolution(lo, hi, spheres.size());
+        double cellSize[3];
+        for (int a = 0; a < 3; a++)
+        {
+            cellSize[a] = (hi[a] - lo[a]) / dims[a];
+        }
+        auto cellOf = [&](double x, int a){
+            return std::clamp(int((x - lo[a]) / cellSize[a]), 0, dims[a] - 1);
+        };
+
+        std::vector<uint8_t> occupied(size_t(dims[0]) * dims[1] * dims[2], 0);
+        double overlapped = 0;
+        for (const auto& s : spheres)
+        {
+            int c[3];
+            double span = 1;
+            for (int a = 0; a < 3; a++)
+            {
+                c[a] = cellOf(s.center[a], a);
+                span *= cellOf(double(s.center[a]) + s.radius, a) - cellOf(double(s.center[a]) - s.radius, a) + 1;
+            }
+            occupied[(size_t(c[2]) * dims[1] + c[1]) * dims[0] + c[0]] = 1;
+            overlapped += span;
+        }
+        size_t empty = size_t(std::count(occupied.begin(), occupied.end(), uint8_t(0)));
+        d.emptyCells = double(empty) / occupied.size();
+        d.cellsAcross = std::cbrt(double(occupied.size()));
+        d.cellsPerSphere = overlapped / spheres.size();
+        return d;
+    }
+};
+
+// Thresholds from tools/accel_bench.cpp. Up to about 64 spheres the
+// SIMD list's brute force wins, nothing else saves enough tests to pay for
+// its bookkeeping. Past that the grid wins, by 2-8x over the BVH on evenly
+// spread spheres and still where radii vary a lot, unless a ray crosses many
+// empty cells on its way: a million spheres in a few clusters, where the
+// tree is 1.5x faster. Spheres listed in very many cells each cost the grid
+// more memory and build time than it saves.
+inline acceleratorKind chooseAccelerator(const sphereDistribution& d)
+{
+    static constexpr size_t listUpTo = 64;
+    static constexpr double maxEmptyCellsCrossed = 64;
+    static constexpr double maxCellsPerSphere = 64;
+    if (d.count <= listUpTo)
+    {
+        return acceleratorKind::list;
+    }
+    if (d.emptyCells * d.cellsAcross > maxEmptyCellsCrossed || d.cellsPerSphere > maxCellsPerSphere)
+    {
+        return acceleratorKind::bvh;
+    }
+    return acceleratorKind::grid;
+}
+
+// Builds spheres under kind (measured first if automatic), owned by world,
+// and returns it for world.add(). chosen is set to the kind built.
+inline hittable* buildAccelerator(scene& world, acceleratorKind kind, std::vector<compactSphere> spheres,
+    std::vector<const material*> materials, acceleratorKind* chosen = nullptr)
+{
+    if (kind == acceleratorKind::automatic)
+    {
+        kind = chooseAccelerator(sphereDistribution::measure(spheres));
+    }
+    if (chosen)
+    {
+        *chosen = kind;
+    }
+    switch (kind)
+    {
+        case acceleratorKind::list:
+        {
+            auto& list = *world.makeOwned<sphere_list>();
+            list.spheres.reserve(spheres.size());
+            for (const auto& s : spheres)
+            {
+                list.spheres.emplace_back(point3(s.center[0], s.center[1], s.center[2]), s.radius, materials[s.material]);
+            }
+            list.pack();
+            return &list;
+        }
+        case acceleratorKind::grid:
+        {
+            auto& grid = *world.makeOwned<sphere_grid>();
+            grid.spheres = std::move(spheres);
+            grid.materials = std::move(materials);
+            grid.build();
+            return &grid;
+        }
+        default:
+        {
+            auto& set = *world.makeOwned<sphere_set>();
+            set.spheres = std::move(spheres);
+            set.materials = std::move(materials);
+            set.build();
+            return &set;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Bump allocator. Memory is handed out from large blocks and only given back
+// all at once, so nothing allocated here ever has its destructor run.
+class arena
+{
+    public:
+        explicit arena(size_t blockSize = 1 << 20) : blockSize(blockSize) {}
+
+        arena(const arena&) = delete;
+        arena& operator=(const arena&) = delete;
+        arena(arena&&) = default;
+        arena& operator=(arena&&) = default;
+
+        void* allocate(size_t bytes, size_t alignment)
+        {
+            uintptr_t aligned = (current + alignment - 1) & ~(uintptr_t(alignment) - 1);
+            if (blocks.empty() || aligned + bytes > end)
+            {
+                addBlock(bytes + alignment);
+                aligned = (current + alignment - 1) & ~(uintptr_t(alignment) - 1);
+            }
+            current = aligned + bytes;
+            used += bytes;
+            return reinterpret_cast<void*>(aligned);
+        }
+
+        void release()
+        {
+            blocks.clear();
+            current = 0;
+            end = 0;
+            used = 0;
+            reserved = 0;
+        }
+
+        size_t bytesUsed() const {return used;}
+        size_t bytesReserved() const {return reserved;}
+
+    private:
+        size_t blockSize;
+        std::vector<std::unique_ptr<std::byte[]>> blocks;
+        uintptr_t current = 0;
+        uintptr_t end = 0;
+        size_t used = 0;
+        size_t reserved = 0;
+
+        void addBlock(size_t minimumSize)
+        {
+            size_t size = minimumSize > blockSize ? minimumSize : blockSize;
+            blocks.emplace_back(new std::byte[size]);
+            current = reinterpret_cast<uintptr_t>(blocks.back().get());
+            end = current + size;
+            reserved += size;
+        }
+};
+
+#endif
@@ -1,15 +1,35 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
-// openEXR
-#include <ImfRgbaFile.h>
-#include <ImfArray.h>
-
 // TBB
 #include <tbb/parallel_for.h>
+#include <tbb/task_group.h>
 
+#include "denoiser.h"
+#include "environment.h"
+#include "framebuffer.h"
+#include "g_buffer.h"
 #include "hittable.h"
+#include "image_io.h"
+#include "irradiance_cache.h"
 #include "material.h"
+#include "paged_sphere_set.h"
+#include "path_guide.h"
+#include "preview_stream.h"
+#include "render_cache.h"
+#include "render_threads.h"
+#include "scene.h"
+#include "sphere_list.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
 
 class camera
 {
@@ -27,76 +47,511 @@ class camera
         double defocusAngle = 0;
         double focusDist = 10;
 
-        Imf::Array2D<Imf::Rgba> frame;
-        Imf::Array2D<Imf::Rgba> debugFrame;
+        // Writes a layered EXR with the noisy beauty, the denoised beauty
+        // and the albedo/normal features that guided the filter.
+        bool denoise = false;
+        int denoiseIterations = 5;
+
+        // Replaces the path after the first diffuse bounce with interpolated
+        // irradiance. Lower tolerance means more records and less error.
+        bool useIrradianceCache = false;
+        double irradianceCacheTolerance = 0.3;
+        int irradianceCacheSamples = 64;
+
+        // Every sample draws from a stream derived from this seed and its
+        // pixel and index, so renders are reproducible and extendable.
+        uint64_t seed = 0;
+
+        // Renders for this many seconds instead of to samplesPerPixel, 0 turns
+        // it off. Every pixel gets a few samples first, then short passes go to
+        // the tiles with the most noise left until the time is up, and what is
+        // done by then is written. Not split into NUMA bands.
+        double timeBudget = 0;
+
+        // Reuses earlier renders of the same scene and settings, tracing only
+        // the samples beyond what is already stored.
+        bool useRenderCache = false;
+        std::string renderCacheDirectory = "renderCache";
+
+        // Lights the scene with this lat-long map instead of the sky gradient.
+        // Diffuse hits sample it directly as well as through their bounce, and
+        // the two estimates are combined with multiple importance sampling.
+        std::shared_ptr<const environmentMap> environment;
+
+        // Learns where light comes from at diffuse surfaces over the first
+        // passes and sends half the bounces there, the other half by the
+        // cosine as usual. Pays off where most light reaches diffuse surfaces
+        // through glass or off metal. Renders in passes of doubling sample
+        // counts so there is something to learn from.
+        bool pathGuiding = false;
+
+        // Look-dev: keeps the primary hit of every camera sample here, and a
+        // later render with the same geometry, camera and seed shades from
+        // them without intersecting camera rays at all. Materials, lighting,
+        // depth and the other shading settings are free to change in between.
+        // Anything else invalidates it on its own. Keep one per view, and only
+        // worlds that flatten to a sphere_list use it.
+        std::shared_ptr<gBuffer> lookDev;
+
+        // Threading for parallelRender. 0 lets TBB use every core.
+        int maxConcurrency = 0;
+        // Pins render threads to these cpus. Ignored when rendering per NUMA node,
+        // those arenas are already bound to their node's cpus.
+        std::vector<int> cpuSet;
+        // Gives each NUMA node its own arena and band of rows, with the band's
+        // buffer first touched there. If sceneFactory is set, each node also
+        // builds its own read-only copy of the scene instead of sharing world.
+        bool numaAware = false;
+        std::function<std::unique_ptr<hittable>()> sceneFactory;
+
+        // The encoder is picked from the extension: .exr, .png or .ppm. Empty
+        // writes nothing, frame() still has the result.
+        std::string outputPath = "output.exr";
+
+        // Publishes the render in progress to this POSIX shared memory segment,
+        // e.g. "/raytracer-preview", for the GUI or an external viewer. Empty
+        // turns it off. The segment outlives the render until the next one.
+        std::string previewName;
+        // Publishes to memory of this process instead, read with
+        // previewReader::attach(previewStream()). Works without POSIX shared
+        // memory, previewName is then ignored.
+        bool previewInProcess = false;
+
+        // Writes test.exr, a gradient of pixel coordinates.
+        bool writeDebugFrame = true;
+
+        // Renders on this arena instead of making one, so several renders can
+        // share a pool. maxConcurrency and cpuSet are then up to its owner.
+        tbb::task_arena* sharedArena = nullptr;
+
+        // Called from render threads as rows finish, must be thread safe.
+        std::function<void(int finishedRows, int totalRows)> onProgress;
+        bool logProgress = true;
+
+        // Set from another thread to stop the render early. Rows already
+        // started still finish, and a cancelled render writes no output.
+        const std::atomic<bool>* cancel = nullptr;
 
         void parallelRender(const hittable& world)
         {
+            TRACE_ZONE("camera::parallelRender");
             initialize();
-            
-            Imf::Array2D<Imf::Rgba> frame(imagePlaneHeight, imagePlaneWidth);
-            Imf::Array2D<Imf::Rgba> debugFrame(imagePlaneHeight, imagePlaneWidth);
-            
-            int finishedRows = 0;
-            tbb::parallel_for(0, imagePlaneHeight, [&](int y){
-                finishedRows++;
-                std::clog << "Rows Left: " << (imagePlaneHeight - finishedRows) << std::endl;
-                std::clog.flush();
-                tbb::parallel_for(0, imagePlaneWidth, [&](int x){
-                    calPixelColor(x, y, world, frame, debugFrame);
-                });
-            });
+            beginAccumulation(world);
+            beginPreview();
+
+            sphere_list flatStorage;
+            const sphere_list* flatWorld = flatView(world, flatStorage);
+            bool isFlat = flatWorld != nullptr;
+            const hittable& target = isFlat ? *flatWorld : world;
+            selectKernel(isFlat);
+            beginLookDev(flatWorld);
+            beginPagedPrimaries(target);
 
-            std::clog << "Writing to frame with width: " << frame.width() << std::endl;
-            std::clog << "Writing to frame with height: " << frame.height() << std::endl;
-            writeToOpenEXR(frame, imagePlaneWidth, imagePlaneHeight, "output.exr");
-            writeToOpenEXR(debugFrame, imagePlaneWidth, imagePlaneHeight, "test.exr");
+            std::atomic<int> finishedRows(0);
+            auto nodes = renderNumaNodes();
+            auto renderImage = [&]{
+                if (timeBudget > 0)
+                {
+                    renderToDeadline(target, true);
+                } else if (guide) {
+                    renderGuided(target, true);
+                } else {
+                    renderRows(0, imagePlaneHeight, target, finishedRows);
+                }
+            };
+            if (numaAware && nodes.size() > 1 && !sharedArena && timeBudget <= 0 && !guide)
+            {
+                renderNumaBands(nodes, target, isFlat, finishedRows);
+            } else if (sharedArena) {
+                sharedArena->execute(renderImage);
+            } else {
+                tbb::task_arena arena(concurrencyPerArena(maxConcurrency, 1));
+                pinningObserver pinning(arena, cpuSet);
+                arena.execute(renderImage);
+            }
+
+            preview.finish(accumulation);
+            if (cancelled())
+            {
+                std::clog << "\rCancelled.            \n";
+                return;
+            }
+            endAccumulation();
+            std::clog << "Writing to frame with width: " << accumulation.width << std::endl;
+            std::clog << "Writing to frame with height: " << accumulation.height << std::endl;
+            outputFailed = !writeOutput();
             std::clog << "\rDone.                 \n";
         };
 
         void render(const hittable& world)
         {
+            TRACE_ZONE("camera::render");
             initialize();
-            //std::cout << "P3\n" << imagePlaneWidth << ' ' << imagePlaneHeight << "\n255\n";
-            Imf::Array2D<Imf::Rgba> frame(imagePlaneWidth, imagePlaneHeight);
-            Imf::Array2D<Imf::Rgba> debugFrame(imagePlaneWidth, imagePlaneHeight);
+            beginAccumulation(world);
+            beginPreview();
+
+            sphere_list flatStorage;
+            const sphere_list* flatWorld = flatView(world, flatStorage);
+            selectKernel(flatWorld != nullptr);
+            beginLookDev(flatWorld);
+            beginPagedPrimaries(flatWorld ? *flatWorld : world);
+
+            if (timeBudget > 0 || guide)
+            {
+                if (timeBudget > 0)
+                {
+                    renderToDeadline(flatWorld ? *flatWorld : world, false);
+                } else {
+                    renderGuided(flatWorld ? *flatWorld : world, false);
+                }
+                preview.finish(accumulation);
+                if (cancelled())
+                {
+                    std::clog << "\rCancelled.            \n";
+                    return;
+                }
+                endAccumulation();
+                outputFailed = !writeOutput();
+                std::clog << "\rDone.                 \n";
+                return;
+            }
+            if (!accumulationResumed)
+            {
+                accumulation.clearRows(0, imagePlaneHeight);
+            }
 
             for (int y = 0; y < imagePlaneHeight; y++)
             {
-                std::clog << "\rScanlines Left: " << (imagePlaneHeight - y) << ' ' << std::flush;
-                for (int x = 0; x < imagePlaneWidth; x++)
+                if (cancelled())
                 {
-                    calPixelColor(x, y, world, frame, debugFrame);
-                };
+                    preview.finish(accumulation);
+                    std::clog << "\rCancelled.            \n";
+                    return;
+                }
+                if (logProgress)
+                {
+                    std::clog << "\rScanlines Left: " << (imagePlaneHeight - y) << ' ' << std::flush;
+                }
+                TRACE_ZONE_VALUE("row", y);
+                (this->*renderRow)(y, flatWorld ? *flatWorld : world);
+                preview.markRows(y, y + 1);
+                if (onProgress)
+                {
+                    onProgress(y + 1, imagePlaneHeight);
+                }
             };
 
-            writeToOpenEXR(frame, imagePlaneWidth, imagePlaneHeight, "output.exr");
-            writeToOpenEXR(debugFrame, imagePlaneWidth, imagePlaneHeight, "test.exr");
+            preview.finish(accumulation);
+            endAccumulation();
+            outputFailed = !writeOutput();
             std::clog << "\rDone.                 \n";
         }
+
+        // For interactive previews: one sample per 16x16 block of pixels, then
+        // per 4x4 block, then per pixel, so a first image is out after a small
+        // fraction of a sample per pixel. Each coarse sample is the first sample
+        // of the pixel it was taken at, and the preview fills the pixels around
+        // it with it until they have their own. Samples per pixel then double
+        // up to samplesPerPixel. Only published to the preview, no file is
+        // written. False if cancelled first.
+        bool progressiveRender(const hittable& world)
+        {
+            TRACE_ZONE("camera::progressiveRender");
+            initialize();
+            beginAccumulation(world);
+            beginPreview(true);
+            if (!accumulationResumed)
+            {
+                accumulation.clearRows(0, imagePlaneHeight);
+            }
+
+            sphere_list flatStorage;
+            const sphere_list* flatWorld = flatView(world, flatStorage);
+            const hittable& target = flatWorld ? *flatWorld : world;
+            selectKernel(flatWorld != nullptr);
+            beginLookDev(flatWorld);
+            beginPagedPrimaries(target);
+
+            auto refine = [&]{
+                beginTiles(std::chrono::steady_clock::time_point::max());
+                for (int stride : {16, 4, 1})
+                {
+                    pixelStride = stride;
+                    std::fill(tileTargets.begin(), tileTargets.end(), 1u);
+                    tracePass(target);
+                }
+                for (uint32_t spp = 2; spp <= uint32_t(samplesPerPixel) && !cancelled(); spp *= 2)
+                {
+                    std::fill(tileTargets.begin(), tileTargets.end(), spp);
+                    tracePass(target);
+                }
+                if (uint32_t(samplesPerPixel) > 1)
+                {
+                    std::fill(tileTargets.begin(), tileTargets.end(), uint32_t(samplesPerPixel));
+                    tracePass(target);
+                }
+                tileTargets.clear();
+            };
+            if (sharedArena)
+            {
+                sharedArena->execute(refine);
+            } else {
+                tbb::task_arena arena(concurrencyPerArena(maxConcurrency, 1));
+                pinningObserver pinning(arena, cpuSet);
+                arena.execute(refine);
+            }
+
+            preview.finish(accumulation);
+            if (cancelled())
+            {
+                return false;
+            }
+            endAccumulation();
+            return true;
+        }
+
+        // Renders several views of one scene as one job: turntables, stereo
+        // pairs, product shots. The world is flattened once and shared, and the
+        // rows of all views go to one parallel_for, interleaved, so the cores
+        // run out of work once at the end instead of at the end of every view.
+        // Each view writes its own outputPath, and its preview and render cache
+        // work as in parallelRender.
+        //
+        // Threads come from the first view's maxConcurrency, cpuSet and
+        // sharedArena, as does logProgress. timeBudget, numaAware and
+        // pathGuiding are not used here, lookDev is, one per view. False if
+        // two views would write the same file, or if any view was cancelled;
+        // the others are still written.
+        static bool renderViews(const std::vector<camera*>& views, const hittable& world)
+        {
+            TRACE_ZONE("camera::renderViews");
+            if (views.empty())
+            {
+                return true;
+            }
+            for (size_t i = 0; i < views.size(); i++)
+            {
+                for (size_t j = 0; j < i; j++)
+                {
+                    if (!views[i]->outputPath.empty() && views[i]->outputPath == views[j]->outputPath)
+                    {
+                        std::cerr << "Fails to Render Views: views " << j << " and " << i << " both write " << views[i]->outputPath << std::endl;
+                        return false;
+                    }
+                }
+            }
+
+            sphere_list flatStorage;
+            const sphere_list* flatWorld = flatView(world, flatStorage);
+            const hittable& target = flatWorld ? *flatWorld : world;
+
+            int tallest = 0;
+            for (camera* view : views)
+            {
+                view->initialize();
+                view->guide.reset();
+                view->beginAccumulation(world);
+                view->beginPreview();
+                view->selectKernel(flatWorld != nullptr);
+                view->beginLookDev(flatWorld);
+                view->beginPagedPrimaries(target);
+                if (!view->accumulationResumed)
+                {
+                    view->accumulation.clearRows(0, view->imagePlaneHeight);
+                }
+                tallest = std::max(tallest, view->imagePlaneHeight);
+            }
+
+            // Row y of every view, then row y + 1 of every view.
+            struct viewRow
+            {
+                uint32_t view;
+                int y;
+            };
+            std::vector<viewRow> rows;
+            for (int y = 0; y < tallest; y++)
+            {
+                for (size_t i = 0; i < views.size(); i++)
+                {
+                    if (y < views[i]->imagePlaneHeight)
+                    {
+                        rows.push_back({uint32_t(i), y});
+                    }
+                }
+            }
+
+            const camera& first = *views.front();
+            std::vector<std::atomic<int>> finishedPerView(views.size());
+            std::atomic<size_t> finishedRows(0);
+            auto renderAll = [&]{
+                tbb::parallel_for(size_t(0), rows.size(), [&](size_t i){
+                    camera& view = *views[rows[i].view];
+                    int y = rows[i].y;
+                    if (view.cancelled())
+                    {
+                        return;
+                    }
+                    TRACE_ZONE_VALUE("row", y);
+                    (view.*view.renderRow)(y, target);
+                    view.preview.markRows(y, y + 1);
+
+                    size_t finished = ++finishedRows;
+                    if (first.logProgress)
+                    {
+                        std::clog << "Rows Left: " << (rows.size() - finished) << std::endl;
+                        std::clog.flush();
+                    }
+                    if (view.onProgress)
+                    {
+                        view.onProgress(++finishedPerView[rows[i].view], view.imagePlaneHeight);
+                    }
+                });
+            };
+            if (first.sharedArena)
+            {
+                first.sharedArena->execute(renderAll);
+            } else {
+                tbb::task_arena arena(concurrencyPerArena(first.maxConcurrency, 1));
+                pinningObserver pinning(arena, first.cpuSet);
+                arena.execute(renderAll);
+            }
+
+            bool complete = true;
+            for (camera* view : views)
+            {
+                view->preview.finish(view->accumulation);
+                if (view->cancelled())
+                {
+                    complete = false;
+                    continue;
+                }
+                view->endAccumulation();
+                view->outputFailed = !view->writeOutput();
+            }
+            std::clog << "\rDone, " << views.size() << " views.       \n";
+            return complete;
+        }
+
+        // Sums and sample counts of the last render.
+        const framebuffer& frame() const {return accumulation;}
+
+        // Where the preview is published, see previewInProcess.
+        const previewPublisher& previewStream() const {return preview;}
+
+        // True if the last render finished but its image couldn't be written.
+        bool outputWriteFailed() const {return outputFailed;}
+
     private:
         int imagePlaneHeight;
-        double pixelSampleScale;
+        bool outputFailed = false;
         point3 cameraCenter;
         point3 pixel_00_loc;
         vec3 pixelDeltaU;
+        // Angle one pixel subtends, the spread of camera ray cones.
+        double pixelSpread;
+        static constexpr double diffuseConeSpread = 0.1;
+        // Rays leaving a surface skip hits closer than this, so rounding in
+        // the hit point doesn't find the same surface again (shadow acne).
+        static constexpr double bounceTMin = 0.001;
         vec3 pixelDeltaV;
         vec3 u, v, w;
         vec3 defocusDiskU;
         vec3 defocusDiskV;
 
+        framebuffer accumulation;
+        bool accumulationResumed = false;
+        uint64_t cacheKey = 0;
+        featureBuffers features;
+        previewPublisher preview;
+
+        using rowKernel = void (camera::*)(int y, const hittable& world);
+        rowKernel renderRow = nullptr;
+        shared_ptr<irradianceCache> irradiance;
+        // lookDev for this render, null when the world can't use it.
+        gBuffer* primaryHits = nullptr;
+
+        // Out-of-core worlds: the paged sphere set, the list it is in (null
+        // if it is the whole world) and where, and the world passed to the
+        // kernels.
+        const paged_sphere_set* pagedWorld = nullptr;
+        const hittable_list* pagedList = nullptr;
+        size_t pagedIndex = 0;
+        const hittable* pagedOwner = nullptr;
+        // Camera rays per pixel batched through pagedWorld, later samples
+        // find their chunks resident by then and trace one by one.
+        static constexpr uint32_t pagedBatchSamples = 16;
+
+        // Camera rays of one row, traced through pagedWorld together so each
+        // chunk they reach is read once for all of them.
+        struct pagedPrimaryBatch
+        {
+            // Rays of the row's kth pixel are [first[k], first[k + 1]).
+            std::vector<size_t> first;
+            std::vector<ray> rays;
+            std::vector<interval> ranges;
+            // The closest hit in pagedWorld and the objects listed before it.
+            std::vector<hitCandidate> hits;
+
+            uint32_t samples(size_t k) const {return first.empty() ? 0 : uint32_t(first[k + 1] - first[k]);}
+        };
+        std::unique_ptr<pathGuide> guide;
+        static constexpr double guideFraction = 0.5;
+        std::chrono::steady_clock::time_point renderStart;
+
+        // Time budget mode. Pixels run to their tile's target instead of
+        // samplesPerPixel while tileTargets is filled, rows started after the
+        // deadline are skipped.
+        static constexpr int tileSize = 16;
+        static constexpr uint32_t warmupSamples = 4;
+        static constexpr double minPassSeconds = 0.05;
+        int tilesX = 0;
+        int tilesY = 0;
+        std::vector<uint32_t> tileTargets;
+        std::chrono::steady_clock::time_point deadline;
+        // Coarse passes of progressiveRender only trace every pixelStride-th
+        // pixel of every pixelStride-th row.
+        int pixelStride = 1;
+        // Set after the first pass, pixels a pass skips keep their features.
+        bool keepFeatures = false;
+
+        // Per pixel sums of the first hit features over all samples.
+        struct firstHit
+        {
+            color albedo;
+            vec3 normal;
+            double depth = 0;
+        };
+
         void initialize()
         {
+            TRACE_ZONE("camera::initialize");
+            renderStart = std::chrono::steady_clock::now();
+            outputFailed = false;
             imagePlaneHeight = int(imagePlaneWidth / aspectRatio);
             imagePlaneHeight = (imagePlaneHeight < 1) ? 1 : imagePlaneHeight;
-            Imf::Array2D<Imf::Rgba> frame(imagePlaneWidth, imagePlaneHeight);
-            Imf::Array2D<Imf::Rgba> debugFrame(imagePlaneWidth, imagePlaneHeight);
 
             std::cout << "Height: " << imagePlaneHeight<< std::endl;
             std::cout << "Width: " << imagePlaneWidth << std::endl;
             std::cout << "aspectRatio: " << aspectRatio << std::endl;
 
-            pixelSampleScale = 1.0 / samplesPerPixel;
+            if (denoise)
+            {
+                features.resize(imagePlaneWidth, imagePlaneHeight);
+            }
+
+            guide.reset();
+            if (pathGuiding)
+            {
+                guide = std::make_unique<pathGuide>();
+            }
+
+            irradiance.reset();
+            if (useIrradianceCache)
+            {
+                irradiance = make_shared<irradianceCache>();
+                irradiance->tolerance = irradianceCacheTolerance;
+                irradiance->samplesPerRecord = irradianceCacheSamples;
+            }
 
             cameraCenter = lookFrom;
 
@@ -114,6 +569,7 @@ class camera
 
             pixelDeltaU = viewportU / imagePlaneWidth;
             pixelDeltaV = viewportV / imagePlaneHeight;
+            pixelSpread = pixelDeltaU.length() / focusDist;
 
             auto viewportUpperLeft = cameraCenter - (focusDist * w) - viewportU/2 - viewportV/2;
             pixel_00_loc = viewportUpperLeft + 0.5 * (pixelDeltaU + pixelDeltaV);
@@ -123,19 +579,514 @@ class camera
             defocusDiskV = v * defocusRadius;
         };
 
+        // Rows [firstRow, lastRow) on the calling arena. Clearing the band here
+        // is what places its accumulation pages on this arena's NUMA node.
+        void renderRows(int firstRow, int lastRow, const hittable& world, std::atomic<int>& finishedRows)
+        {
+            if (!accumulationResumed)
+            {
+                accumulation.clearRows(firstRow, lastRow);
+            }
+            traceRows(firstRow, lastRow, world, finishedRows);
+        }
+
+        void traceRows(int firstRow, int lastRow, const hittable& world, std::atomic<int>& finishedRows)
+        {
+            bool progressive = !tileTargets.empty();
+            int rows = (lastRow - firstRow + pixelStride - 1) / pixelStride;
+            tbb::parallel_for(0, rows, [&](int i){
+                if (stopRequested())
+                {
+                    return;
+                }
+                int y = firstRow + i * pixelStride;
+                TRACE_ZONE_VALUE("row", y);
+                (this->*renderRow)(y, world);
+                preview.markRows(y, std::min(y + pixelStride, lastRow));
+
+                // Passes report progress as a whole instead.
+                int finished = ++finishedRows;
+                if (logProgress && !progressive)
+                {
+                    std::clog << "Rows Left: " << (imagePlaneHeight - finished) << std::endl;
+                    std::clog.flush();
+                }
+                if (onProgress && !progressive)
+                {
+                    onProgress(finished, imagePlaneHeight);
+                }
+            });
+        }
+
+        // Progressive passes until timeBudget is used up. The first few take
+        // every pixel to warmupSamples so they all have a variance. After that
+        // each pass is sized from the samples per second measured so far, and
+        // spread over the tiles by their noise.
+        void renderToDeadline(const hittable& world, bool parallel)
+        {
+            TRACE_ZONE("camera::renderToDeadline");
+            using clock = std::chrono::steady_clock;
+            auto start = clock::now();
+            beginTiles(start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(timeBudget)));
+            if (!accumulationResumed)
+            {
+                accumulation.clearRows(0, imagePlaneHeight);
+            }
+
+            uint64_t startSamples = totalSamples();
+            double elapsed = 0;
+            int passes = 0;
+            while (elapsed < timeBudget)
+            {
+                uint32_t warmup = uint32_t(1) << std::min(passes, 31);
+                if (warmup <= warmupSamples)
+                {
+                    std::fill(tileTargets.begin(), tileTargets.end(), warmup);
+                } else {
+                    // A quarter of what is left per pass, so the spread can follow
+                    // the noise, and never more than what is left.
+                    double left = timeBudget - elapsed;
+                    double passSeconds = std::fmin(std::fmax(left / 4, minPassSeconds), left);
+                    double samplesPerSecond = (totalSamples() - startSamples) / elapsed;
+                    spreadSamples(samplesPerSecond * passSeconds);
+                }
+
+                tracePass(world, parallel);
+                passes++;
+                keepFeatures = true;
+                elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+                int done = std::min(imagePlaneHeight, int(imagePlaneHeight * elapsed / timeBudget));
+                if (logProgress)
+                {
+                    std::clog << "\rPass " << passes << ", " << int(100 * elapsed / timeBudget) << "% of time budget " << std::flush;
+                }
+                if (onProgress)
+                {
+                    onProgress(done, imagePlaneHeight);
+                }
+            }
+            tileTargets.clear();
+            keepFeatures = false;
+
+            uint64_t traced = totalSamples() - startSamples;
+            std::clog << "\nTime budget " << timeBudget << "s: " << passes << " passes, " << traced << " samples in "
+                      << elapsed << "s, " << double(totalSamples()) / accumulation.pixelCount() << " per pixel" << std::endl;
+        }
+
+        // Pixels run to their tile's target from here on, until tileTargets
+        // is cleared again.
+        void beginTiles(std::chrono::steady_clock::time_point until)
+        {
+            deadline = until;
+            pixelStride = 1;
+            tilesX = (imagePlaneWidth + tileSize - 1) / tileSize;
+            tilesY = (imagePlaneHeight + tileSize - 1) / tileSize;
+            tileTargets.assign(size_t(tilesX) * tilesY, 0);
+        }
+
+        // One pass over the image at the current tile targets, shown in the
+        // preview as soon as it is done. The guide learns from every pass.
+        void tracePass(const hittable& world, bool parallel = true)
+        {
+            if (stopRequested())
+            {
+                return;
+            }
+            TRACE_ZONE("pass");
+            if (parallel)
+            {
+                std::atomic<int> finishedRows(0);
+                traceRows(0, imagePlaneHeight, world, finishedRows);
+            } else {
+                for (int y = 0; y < imagePlaneHeight && !stopRequested(); y++)
+                {
+                    (this->*renderRow)(y, world);
+                    preview.markRows(y, y + 1);
+                }
+            }
+            if (guide)
+            {
+                TRACE_ZONE("pathGuide::refresh");
+                guide->refresh();
+            }
+            preview.publishSoon();
+        }
+
+        // For path guiding: passes of 1, 2, 4, ... samples per pixel more than
+        // the image had, then the rest up to samplesPerPixel, so each pass
+        // samples from what the ones before it learned.
+        void renderGuided(const hittable& world, bool parallel)
+        {
+            TRACE_ZONE("camera::renderGuided");
+            if (!accumulationResumed)
+            {
+                accumulation.clearRows(0, imagePlaneHeight);
+            }
+            beginTiles(std::chrono::steady_clock::time_point::max());
+
+            uint32_t target = uint32_t(std::max(samplesPerPixel, 0));
+            uint32_t start = target;
+            for (size_t i = 0; i < accumulation.pixelCount(); i++)
+            {
+                start = std::min(start, accumulation.samples[i]);
+            }
+            int passes = 0;
+            for (uint32_t step = 1; start < target && !cancelled(); step *= 2)
+            {
+                uint32_t spp = target - start > step ? start + step : target;
+                std::fill(tileTargets.begin(), tileTargets.end(), spp);
+                tracePass(world, parallel);
+                passes++;
+                if (logProgress)
+                {
+                    std::clog << "\rGuided pass " << passes << ", " << spp << " of " << target << " samples per pixel " << std::flush;
+                }
+                if (onProgress)
+                {
+                    onProgress(int(int64_t(imagePlaneHeight) * spp / target), imagePlaneHeight);
+                }
+                if (spp == target)
+                {
+                    break;
+                }
+            }
+            tileTargets.clear();
+            if (logProgress)
+            {
+                std::clog << std::endl;
+            }
+        }
+
+        bool cancelled() const
+        {
+            return cancel && cancel->load(std::memory_order_relaxed);
+        }
+
+        bool stopRequested() const
+        {
+            return cancelled() || (!tileTargets.empty() && std::chrono::steady_clock::now() >= deadline);
+        }
+
+        uint64_t totalSamples() const
+        {
+            uint64_t total = 0;
+            for (size_t i = 0; i < accumulation.pixelCount(); i++)
+            {
+                total += accumulation.samples[i];
+            }
+            return total;
+        }
+
+        // Raises the tile targets by about budget samples in all, each tile's
+        // share in proportion to its noise. A tile at most doubles per pass, so
+        // one bad estimate can't swallow the budget. When the budget is too
+        // small to give any tile a whole sample per pixel the noisiest gets one.
+        void spreadSamples(double budget)
+        {
+            std::vector<double> noise = tileNoise();
+            double total = 0;
+            for (double n : noise)
+            {
+                total += n;
+            }
+
+            bool added = false;
+            for (size_t t = 0; t < tileTargets.size(); t++)
+            {
+                double share = total > 0 ? budget * noise[t] / total : budget / tileTargets.size();
+                double perPixel = std::fmin(share / tilePixels(t), double(std::max(tileTargets[t], 1u)));
+                uint32_t extra = uint32_t(perPixel);
+                tileTargets[t] += extra;
+                added = added || extra > 0;
+            }
+            if (!added)
+            {
+                tileTargets[std::max_element(noise.begin(), noise.end()) - noise.begin()]++;
+            }
+        }
+
+        // Sum over the tile's pixels of the variance of their mean, relative to
+        // their brightness so dark tiles count as much as bright ones. The
+        // floor keeps black pixels from dominating. Pixels with fewer than two
+        // samples don't have a variance yet and count as very noisy.
+        std::vector<double> tileNoise() const
+        {
+            static constexpr double brightnessFloor = 1e-3;
+            std::vector<double> noise(tileTargets.size(), 0.0);
+            for (int y = 0; y < imagePlaneHeight; y++)
+            {
+                for (int x = 0; x < imagePlaneWidth; x++)
+                {
+                    size_t index = size_t(y) * imagePlaneWidth + x;
+                    double variance = accumulation.varianceOfMean(index);
+                    double mean = luminance(accumulation.average(index));
+                    noise[size_t(y / tileSize) * tilesX + x / tileSize] += variance < 0 ? 1.0 : variance / (mean * mean + brightnessFloor);
+                }
+            }
+            return noise;
+        }
+
+        size_t tilePixels(size_t tile) const
+        {
+            int x = int(tile % tilesX) * tileSize;
+            int y = int(tile / tilesX) * tileSize;
+            return size_t(std::min(tileSize, imagePlaneWidth - x)) * std::min(tileSize, imagePlaneHeight - y);
+        }
+
+        void renderNumaBands(const std::vector<tbb::numa_node_id>& nodes, const hittable& world, bool isFlat,
+            std::atomic<int>& finishedRows)
+        {
+            int nodeCount = int(nodes.size());
+            std::vector<std::unique_ptr<tbb::task_arena>> arenas;
+            for (auto node : nodes)
+            {
+                arenas.push_back(std::make_unique<tbb::task_arena>(
+                    tbb::task_arena::constraints(node, concurrencyPerArena(maxConcurrency, nodeCount))));
+            }
+
+            std::clog << "Rendering across " << nodeCount << " NUMA nodes" << std::endl;
+            std::vector<tbb::task_group> groups(nodeCount);
+            for (int i = 0; i < nodeCount; i++)
+            {
+                int firstRow = imagePlaneHeight * i / nodeCount;
+                int lastRow = imagePlaneHeight * (i + 1) / nodeCount;
+                // run() inside execute(), so each band is in its group before
+                // the waits below can see the group empty and return.
+                arenas[i]->execute([&, i, firstRow, lastRow]{
+                    groups[i].run([&, firstRow, lastRow]{
+                        std::unique_ptr<hittable> localWorld = sceneFactory ? sceneFactory() : nullptr;
+                        sphere_list localFlat;
+                        if (localWorld && isFlat && flattenWorld(*localWorld, localFlat))
+                        {
+                            renderRows(firstRow, lastRow, localFlat, finishedRows);
+                            return;
+                        }
+                        renderRows(firstRow, lastRow, localWorld && !isFlat ? *localWorld : world, finishedRows);
+                    });
+                });
+            }
+            for (int i = 0; i < nodeCount; i++)
+            {
+                arenas[i]->execute([&, i]{ groups[i].wait(); });
+            }
+        }
+
+        void beginAccumulation(const hittable& world)
+        {
+            accumulation.allocate(imagePlaneWidth, imagePlaneHeight);
+            accumulationResumed = false;
+            if (!useRenderCache)
+            {
+                return;
+            }
+
+            cacheKey = settingsKey(world);
+            renderCache cache(renderCacheDirectory);
+            if (cache.load(cacheKey, imagePlaneWidth, imagePlaneHeight, accumulation))
+            {
+                accumulationResumed = true;
+                std::clog << "Render cache hit: " << accumulation.samples[0] << " samples per pixel stored" << std::endl;
+            }
+        }
+
+        void endAccumulation()
+        {
+            if (useRenderCache)
+            {
+                renderCache(renderCacheDirectory).store(cacheKey, accumulation);
+            }
+        }
+
+        // Progressive previews fill pixels without samples from the coarse passes.
+        void beginPreview(bool progressive = false)
+        {
+            preview.close();
+            preview.fillFromCoarse = progressive;
+            bool opened = previewInProcess
+                ? preview.openLocal(imagePlaneWidth, imagePlaneHeight)
+                : !previewName.empty() && preview.open(previewName, imagePlaneWidth, imagePlaneHeight);
+            if (!opened)
+            {
+                return;
+            }
+            if (!previewInProcess)
+            {
+                std::clog << "Streaming preview to shared memory " << previewName << std::endl;
+            }
+            preview.start(accumulation);
+        }
+
+        // Everything that changes what a given sample of a given pixel returns.
+        // samplesPerPixel is left out on purpose, it only decides how many we take.
+        uint64_t settingsKey(const hittable& world) const
+        {
+            hasher h;
+            world.fingerprint(h);
+            h.add(imagePlaneWidth);
+            h.add(imagePlaneHeight);
+            h.add(maxDepth);
+            h.add(viewFov);
+            h.add(lookFrom);
+            h.add(lookAt);
+            h.add(vUp);
+            h.add(defocusAngle);
+            h.add(focusDist);
+            h.add(seed);
+            h.add(useIrradianceCache);
+            h.add(bool(guide));
+            if (useIrradianceCache)
+            {
+                h.add(irradianceCacheTolerance);
+                h.add(irradianceCacheSamples);
+            }
+            if (environment)
+            {
+                environment->fingerprint(h);
+            }
+            return h.digest();
+        }
+
+        // Points primaryHits at lookDev if the world is flat, clearing it when
+        // anything that moves a camera ray's first hit has changed.
+        void beginLookDev(const sphere_list* flatWorld)
+        {
+            primaryHits = nullptr;
+            if (!lookDev)
+            {
+                return;
+            }
+            if (!flatWorld)
+            {
+                std::clog << "Look-dev: the world isn't flat, tracing camera rays" << std::endl;
+                return;
+            }
+
+            hasher h;
+            flatWorld->geometryFingerprint(h);
+            h.add(imagePlaneWidth);
+            h.add(imagePlaneHeight);
+            h.add(viewFov);
+            h.add(lookFrom);
+            h.add(lookAt);
+            h.add(vUp);
+            h.add(defocusAngle);
+            h.add(focusDist);
+            h.add(seed);
+            bool kept = lookDev->prepare(h.digest(), accumulation.pixelCount(), uint32_t(std::max(samplesPerPixel, 0)));
+            primaryHits = lookDev.get();
+            std::clog << "Look-dev: " << (kept ? "shading from cached camera hits, " : "geometry or camera changed, caching camera hits, ")
+                      << primaryHits->samples() << " samples per pixel in " << primaryHits->bytesUsed() << " bytes" << std::endl;
+        }
+
+        // Finds a paged_sphere_set in world or in its top level list, for the
+        // row kernels to batch camera rays through.
+        void beginPagedPrimaries(const hittable& world)
+        {
+            pagedWorld = dynamic_cast<const paged_sphere_set*>(&world);
+            pagedList = nullptr;
+            pagedOwner = &world;
+            if (pagedWorld)
+            {
+                return;
+            }
+            const hittable_list* list = dynamic_cast<const hittable_list*>(&world);
+            if (auto s = dynamic_cast<const scene*>(&world))
+            {
+                list = &s->world();
+            }
+            if (!list)
+            {
+                return;
+            }
+            for (size_t i = 0; i < list->objects.size(); i++)
+            {
+                if (auto paged = dynamic_cast<const paged_sphere_set*>(list->objects[i]))
+                {
+                    pagedWorld = paged;
+                    pagedList = list;
+                    pagedIndex = i;
+                    return;
+                }
+            }
+        }
+
+        uint64_t sampleSeed(int x, int y, uint32_t sampleID) const
+        {
+            return mixBits(seed ^ mixBits((uint64_t(y) << 40) ^ (uint64_t(x) << 20) ^ sampleID));
+        }
+
+        // A world made of nothing but spheres is copied into a sphere_list so the
+        // kernels can intersect it without virtual calls.
+        static bool flattenWorld(const hittable& world, sphere_list& out)
+        {
+            if (auto flat = dynamic_cast<const sphere_list*>(&world))
+            {
+                out = *flat;
+                return true;
+            }
+            if (auto s = dynamic_cast<const scene*>(&world))
+            {
+                return sphere_list::flatten(s->world(), out);
+            }
+            if (auto list = dynamic_cast<const hittable_list*>(&world))
+            {
+                return sphere_list::flatten(*list, out);
+            }
+            return false;
+        }
+
+        // The world as a sphere_list if it can be one: itself when it already is
+        // (a caller keeping one resident), otherwise flattened into storage.
+        static const sphere_list* flatView(const hittable& world, sphere_list& storage)
+        {
+            if (auto flat = dynamic_cast<const sphere_list*>(&world))
+            {
+                return flat;
+            }
+            return flattenWorld(world, storage) ? &storage : nullptr;
+        }
+
+        // Picks the row kernel for this render's settings, once. Every feature
+        // that is off is compiled out of the per sample loop.
+        void selectKernel(bool flatWorld)
+        {
+            const bool flags[5] = {defocusAngle > 0, denoise, bool(irradiance), bool(environment), bool(guide)};
+            renderRow = flatWorld ? pickKernel<independentSampler, sphere_list>(flags)
+                                  : pickKernel<independentSampler, hittable>(flags);
+        }
+
+        template <typename Sampler, typename World, bool... Chosen>
+        static rowKernel pickKernel(const bool* flags)
+        {
+            if constexpr (sizeof...(Chosen) == 5)
+            {
+                return &camera::renderRowKernel<Sampler, World, Chosen...>;
+            } else {
+                return flags[0] ? pickKernel<Sampler, World, Chosen..., true>(flags + 1)
+                                : pickKernel<Sampler, World, Chosen..., false>(flags + 1);
+            }
+        }
+
+        template <typename Sampler, bool ThinLens>
         ray getRay(int x, int y) const
         {
-            auto offset = sampleSquare();
+            auto offset = sampleSquare<Sampler>();
             auto pixelSample = pixel_00_loc + ((x + offset.x()) * pixelDeltaU) + ((y + offset.y()) * pixelDeltaV);
-            auto rayOrigin = (defocusAngle <= 0) ? cameraCenter : defocusDiskSample();
+            point3 rayOrigin = cameraCenter;
+            if constexpr (ThinLens)
+            {
+                rayOrigin = defocusDiskSample();
+            }
             auto rayDirection = pixelSample - rayOrigin;
 
-            return ray(rayOrigin, rayDirection);
+            return ray(rayOrigin, rayDirection, 0, pixelSpread);
         }
 
+        template <typename Sampler>
         vec3 sampleSquare() const
         {
-            return vec3(randomDouble() - 0.5, randomDouble() - 0.5, 0);
+            return vec3(Sampler::next() - 0.5, Sampler::next() - 0.5, 0);
         }
 
         point3 defocusDiskSample() const
@@ -144,41 +1095,516 @@ class camera
             return cameraCenter + (p[0] * defocusDiskU) + (p[1] * defocusDiskV);
         }
 
-        color rayColor(const ray& r, int maxDepth, const hittable& world)
+        // bouncePdf is the solid angle pdf r was sampled with when it left a
+        // diffuse surface, so an environment hit can be weighted against the
+        // light sample taken there. 0 for every other ray. Hits closer than
+        // tMin are skipped.
+        template <typename World, bool WithCache, bool WithEnvironment, bool WithGuide, bool WithFeatures = false>
+        color rayColor(const ray& r, int maxDepth, const World& world, firstHit* features = nullptr, double bouncePdf = 0, double tMin = 0)
+        {
+            if (maxDepth <= 0)
+            {
+                return color(0,0,0);
+            }
+            hitRecord rec;
+            if(world.hit(r, interval(tMin, infinity), rec))
+            {
+                return hitColor<World, WithCache, WithEnvironment, WithGuide, WithFeatures>(r, rec, maxDepth, world, features);
+            }
+            return missColor<WithEnvironment, WithFeatures>(r, features, bouncePdf);
+        };
+
+        // rayColor for a camera ray, with its first hit from primaryHits. A
+        // sample seen for the first time is intersected and stored.
+        template <bool WithCache, bool WithEnvironment, bool WithGuide, bool WithFeatures>
+        color cachedRayColor(const ray& r, size_t slot, const sphere_list& world, firstHit* features)
         {
             if (maxDepth <= 0)
             {
                 return color(0,0,0);
             }
+            hitCandidate candidate;
+            uint32_t primitive = primaryHits->primitive(slot);
+            if (primitive == gBuffer::unknown)
+            {
+                primitive = world.intersect(r, interval(0, infinity), candidate) ? candidate.primitive : gBuffer::miss;
+                primaryHits->store(slot, primitive == gBuffer::miss ? 0 : candidate.t, primitive);
+            } else if (primitive != gBuffer::miss) {
+                candidate = {primaryHits->distance(slot), &world, primitive};
+            }
+            if (primitive == gBuffer::miss)
+            {
+                return missColor<WithEnvironment, WithFeatures>(r, features, 0);
+            }
             hitRecord rec;
-            if(world.hit(r, interval(0, infinity), rec))
+            world.finalize(r, candidate, rec);
+            return hitColor<sphere_list, WithCache, WithEnvironment, WithGuide, WithFeatures>(r, rec, maxDepth, world, features);
+        }
+
+        template <typename World, bool WithCache, bool WithEnvironment, bool WithGuide, bool WithFeatures>
+        color hitColor(const ray& r, const hitRecord& rec, int maxDepth, const World& world, firstHit* features)
+        {
+            if constexpr (WithFeatures)
             {
-                ray scattered;
-                color attenuation;
-                if(rec.mat->scatter(r, rec, attenuation, scattered))
+                features->albedo += rec.mat->baseColor(rec);
+                features->normal += rec.normal;
+                features->depth += rec.t * r.direction().length();
+            }
+            return shade<World, WithCache, WithEnvironment, WithGuide>(r, rec, maxDepth, world);
+        }
+
+        template <bool WithEnvironment, bool WithFeatures>
+        color missColor(const ray& r, firstHit* features, double bouncePdf)
+        {
+            auto skyColor = background<WithEnvironment>(r);
+            if constexpr (WithEnvironment)
+            {
+                if (bouncePdf > 0)
                 {
-                    return attenuation * rayColor(scattered, maxDepth - 1, world);
+                    skyColor *= powerHeuristic(bouncePdf, environment->pdf(r.direction()));
                 }
+            }
+            if constexpr (WithFeatures)
+            {
+                features->albedo += skyColor;
+            }
+            return skyColor;
+        }
+
+        template <typename World, bool WithCache, bool WithEnvironment, bool WithGuide>
+        color shade(const ray& r, const hitRecord& rec, int maxDepth, const World& world)
+        {
+            if constexpr (WithCache)
+            {
+                if (rec.mat->isDiffuse())
+                {
+                    auto incoming = irradiance->lookup(rec.p, rec.normal, [&](const ray& sampleRay){
+                        return traceIrradianceSample<World, WithEnvironment>(sampleRay, maxDepth - 1, world);
+                    });
+                    return rec.mat->baseColor(rec) * incoming;
+                }
+            }
+            if constexpr (WithGuide)
+            {
+                if (rec.mat->isDiffuse())
+                {
+                    return shadeGuided<World, WithCache, WithEnvironment>(r, rec, maxDepth, world);
+                }
+            }
+
+            ray scattered;
+            color attenuation;
+            if(scatterDirect(*rec.mat, r, rec, attenuation, scattered))
+            {
+                // Carry the cone on so textures seen in reflections are filtered
+                // too. A diffuse bounce scatters over the whole hemisphere, so its
+                // cone is widened a lot; keeping the pixel's spread there would
+                // read the finest mip level for every far away secondary hit.
+                double spread = rec.mat->isDiffuse() ? std::fmax(r.coneSpread(), diffuseConeSpread) : r.coneSpread();
+                scattered = ray(scattered.origin(), scattered.direction(), rec.coneWidth, spread);
+                if constexpr (WithEnvironment)
+                {
+                    if (rec.mat->isDiffuse())
+                    {
+                        // The bounce is cosine distributed around the normal.
+                        double bouncePdf = std::fmax(dot(unitVector(scattered.direction()), rec.normal), 0.0) / pi;
+                        return attenuation * (sampleEnvironment(rec, world)
+                            + rayColor<World, WithCache, WithEnvironment, WithGuide>(scattered, maxDepth - 1, world, nullptr, bouncePdf, bounceTMin));
+                    }
+                }
+                return attenuation * rayColor<World, WithCache, WithEnvironment, WithGuide>(scattered, maxDepth - 1, world, nullptr, 0, bounceTMin);
+            }
+            return color(0,0,0);
+        }
+
+        // A diffuse bounce drawn from the guide's distribution at rec.p or from
+        // the cosine, by a coin flip, and weighted by the pdf of that mixture.
+        // Where the guide has learned nothing yet it is plain cosine sampling.
+        // Every bounce is recorded into the guide for the next pass.
+        template <typename World, bool WithCache, bool WithEnvironment>
+        color shadeGuided(const ray& r, const hitRecord& rec, int maxDepth, const World& world)
+        {
+            color albedo = rec.mat->baseColor(rec);
+            const pathGuide::distribution* learned = guide->find(rec.p);
+
+            // The cosine branch draws the same unnormalized direction diffuse
+            // scatter does, so an unguided cell samples like no guide.
+            vec3 direction;
+            if (learned && randomDouble() < guideFraction)
+            {
+                double u = randomDouble();
+                double v = randomDouble();
+                direction = pathGuide::sample(*learned, u, v, randomDouble());
+            } else {
+                direction = rec.normal + randomUnitVector();
+                if (direction.nearZero())
+                {
+                    direction = rec.normal;
+                }
+            }
+            vec3 unit = unitVector(direction);
+
+            color lit(0,0,0);
+            if constexpr (WithEnvironment)
+            {
+                lit = sampleEnvironment(rec, world, learned);
+            }
+            double cosine = dot(unit, rec.normal);
+            if (cosine <= 0)
+            {
+                return albedo * lit;
+            }
+
+            double bouncePdf = mixturePdf(learned, unit, cosine);
+            double spread = std::fmax(r.coneSpread(), diffuseConeSpread);
+            ray scattered(rec.p, direction, rec.coneWidth, spread);
+            color incoming = rayColor<World, WithCache, WithEnvironment, true>(scattered, maxDepth - 1, world, nullptr,
+                WithEnvironment ? bouncePdf : 0, bounceTMin);
+            guide->record(rec.p, unit, luminance(incoming) / bouncePdf);
+            return albedo * (lit + (cosine / pi / bouncePdf) * incoming);
+        }
+
+        // Density of shadeGuided's bounce direction, given its cosine.
+        double mixturePdf(const pathGuide::distribution* learned, const vec3& direction, double cosine) const
+        {
+            double cosinePdf = std::fmax(cosine, 0.0) / pi;
+            if (!learned)
+            {
+                return cosinePdf;
+            }
+            return guideFraction * pathGuide::pdf(*learned, direction) + (1 - guideFraction) * cosinePdf;
+        }
+
+        // Next event estimation towards the environment from a diffuse hit,
+        // without the albedo. Its share of the MIS weight is pLight^2 against
+        // the bounce's pBounce^2; the bounce ray picks up the rest on a miss.
+        //
+        // learned is the guide's distribution at rec.p when the bounce is guided,
+        // which changes its pdf.
+        template <typename World>
+        color sampleEnvironment(const hitRecord& rec, const World& world, const pathGuide::distribution* learned = nullptr)
+        {
+            double lightPdf;
+            vec3 direction = environment->sample(randomDouble(), randomDouble(), lightPdf);
+            double cosine = dot(direction, rec.normal);
+            if (lightPdf <= 0 || cosine <= 0)
+            {
                 return color(0,0,0);
             }
+            if (world.occluded(ray(rec.p, direction), interval(bounceTMin, infinity)))
+            {
+                return color(0,0,0);
+            }
+            double bouncePdf = mixturePdf(learned, direction, cosine);
+            return environment->lookup(direction) * (cosine / pi * powerHeuristic(lightPdf, bouncePdf) / lightPdf);
+        }
+
+        static double powerHeuristic(double pdf, double otherPdf)
+        {
+            return pdf * pdf / (pdf * pdf + otherPdf * otherPdf);
+        }
+
+        // Records are filled by plain path tracing, never from other records.
+        template <typename World, bool WithEnvironment>
+        irradianceSample traceIrradianceSample(const ray& r, int maxDepth, const World& world)
+        {
+            if (maxDepth <= 0)
+            {
+                return {color(0,0,0), infinity};
+            }
+            hitRecord rec;
+            if(!world.hit(r, interval(bounceTMin, infinity), rec))
+            {
+                return {background<WithEnvironment>(r), infinity};
+            }
+            return {shade<World, false, WithEnvironment, false>(r, rec, maxDepth, world), rec.t * r.direction().length()};
+        }
 
+        template <bool WithEnvironment>
+        color background(const ray& r) const
+        {
+            if constexpr (WithEnvironment)
+            {
+                return environment->lookup(r.direction());
+            }
             vec3 unitDirection = unitVector(r.direction());
             auto a = 0.5*(unitDirection.y() + 1.0);
             return (1.0-a)*color(1.0, 1.0, 1.0) + a*color(0.5, 0.7, 1.0);
-        };
+        }
+
+        // The sample count pixel (x, y) runs to in this pass.
+        uint32_t sampleTarget(int x, int y) const
+        {
+            return tileTargets.empty() ? uint32_t(samplesPerPixel) : tileTargets[size_t(y / tileSize) * tilesX + x / tileSize];
+        }
 
-        void calPixelColor(int x, int y, const hittable& world, Imf::Array2D<Imf::Rgba>& frame, Imf::Array2D<Imf::Rgba>& debugFrame)
+        // Makes the first pagedBatchSamples camera rays of every pixel in row
+        // y still to be traced, and finds their hits in pagedWorld in one
+        // batch. The objects listed before pagedWorld are tested first, as
+        // world.intersect() would, so their hits bound the walk through the
+        // chunks. The kernel reseeds and makes the same rays again, so each
+        // sample's random numbers run on exactly as without the batch.
+        template <typename Sampler, bool ThinLens>
+        void batchPagedPrimaries(int y, pagedPrimaryBatch& batch)
         {
-            color pixelColor (0,0,0);
-            for (int sampleID = 0; sampleID < samplesPerPixel; sampleID++)
+            TRACE_ZONE("paged camera rays");
+            for (int x = 0; x < imagePlaneWidth; x += pixelStride)
             {
-                ray r = getRay(x, y);
-                pixelColor += rayColor(r, maxDepth, world);
+                batch.first.push_back(batch.rays.size());
+                uint32_t firstSample = accumulation.samples[size_t(y) * imagePlaneWidth + x];
+                uint32_t lastSample = std::min(sampleTarget(x, y), firstSample + pagedBatchSamples);
+                for (uint32_t sampleID = firstSample; sampleID < lastSample; sampleID++)
+                {
+                    Sampler::seed(sampleSeed(x, y, sampleID));
+                    batch.rays.push_back(getRay<Sampler, ThinLens>(x, y));
+                }
             }
-            auto finalPixel = pixelSampleScale * pixelColor;
-            frame[y][x] = Imf::Rgba(half(finalPixel.x()), half(finalPixel.y()), half(finalPixel.z()), 0.0);
-            debugFrame[y][x] = Imf::Rgba(x / (imagePlaneWidth-1.0f), y / (imagePlaneHeight-1.0f), 0.0);
-        };
+            batch.first.push_back(batch.rays.size());
+            batch.hits.assign(batch.rays.size(), hitCandidate{0, nullptr, 0});
+            batch.ranges.resize(batch.rays.size());
+            for (size_t i = 0; i < batch.rays.size(); i++)
+            {
+                double closest = infinity;
+                for (size_t k = 0; pagedList && k < pagedIndex; k++)
+                {
+                    if (pagedList->objects[k]->intersect(batch.rays[i], interval(0, closest), batch.hits[i]))
+                    {
+                        closest = batch.hits[i].t;
+                    }
+                }
+                batch.ranges[i] = interval(0, closest);
+            }
+            pagedWorld->intersectBatch(batch.rays.data(), batch.rays.size(), batch.ranges.data(), batch.hits.data());
+        }
+
+        // What world.intersect() finds, given batched, its closest hit up to
+        // and including pagedWorld: the objects listed after it are left.
+        bool pagedPrimaryHit(const ray& r, const hitCandidate& batched, hitCandidate& candidate) const
+        {
+            candidate = batched;
+            bool hitAnything = batched.object != nullptr;
+            double closest = hitAnything ? batched.t : infinity;
+            for (size_t k = pagedIndex + 1; pagedList && k < pagedList->objects.size(); k++)
+            {
+                if (pagedList->objects[k]->intersect(r, interval(0, closest), candidate))
+                {
+                    hitAnything = true;
+                    closest = candidate.t;
+                }
+            }
+            return hitAnything;
+        }
+
+        // rayColor for a camera ray whose hit in pagedWorld came from a batch.
+        template <typename World, bool WithCache, bool WithEnvironment, bool WithGuide, bool WithFeatures>
+        color pagedRayColor(const ray& r, const hitCandidate& batched, const World& world, firstHit* features)
+        {
+            if (maxDepth <= 0)
+            {
+                return color(0,0,0);
+            }
+            hitCandidate candidate;
+            if (!pagedPrimaryHit(r, batched, candidate))
+            {
+                return missColor<WithEnvironment, WithFeatures>(r, features, 0);
+            }
+            hitRecord rec;
+            candidate.object->finalize(r, candidate, rec);
+            return hitColor<World, WithCache, WithEnvironment, WithGuide, WithFeatures>(r, rec, maxDepth, world, features);
+        }
+
+        template <typename Sampler, typename World, bool ThinLens, bool WithFeatures, bool WithCache, bool WithEnvironment, bool WithGuide>
+        void renderRowKernel(int y, const hittable& world)
+        {
+            const World& typedWorld = static_cast<const World&>(world);
+            uint32_t cachedSamples = primaryHits ? primaryHits->samples() : 0;
+            pagedPrimaryBatch batch;
+            if (pagedWorld && &world == pagedOwner)
+            {
+                batchPagedPrimaries<Sampler, ThinLens>(y, batch);
+            }
+            for (int x = 0; x < imagePlaneWidth; x += pixelStride)
+            {
+                // A pixel can take long at high sample counts, so don't wait for the row.
+                if (cancelled())
+                {
+                    return;
+                }
+                size_t index = size_t(y) * imagePlaneWidth + x;
+                uint32_t firstSample = accumulation.samples[index];
+                uint32_t lastSample = sampleTarget(x, y);
+                size_t column = size_t(x / pixelStride);
+                uint32_t batchedSamples = batch.samples(column);
+
+                color pixelColor (0,0,0);
+                double luminanceSq = 0;
+                firstHit pixelFeatures;
+                uint32_t tracedSamples = 0;
+                for (uint32_t sampleID = firstSample; sampleID < lastSample; sampleID++)
+                {
+                    Sampler::seed(sampleSeed(x, y, sampleID));
+                    ray r = getRay<Sampler, ThinLens>(x, y);
+                    color sample;
+                    if constexpr (std::is_same_v<World, sphere_list>)
+                    {
+                        if (sampleID < cachedSamples)
+                        {
+                            sample = cachedRayColor<WithCache, WithEnvironment, WithGuide, WithFeatures>(r, primaryHits->slot(index, sampleID), typedWorld, &pixelFeatures);
+                        } else {
+                            sample = rayColor<World, WithCache, WithEnvironment, WithGuide, WithFeatures>(r, maxDepth, typedWorld, &pixelFeatures);
+                        }
+                    } else if (sampleID - firstSample < batchedSamples) {
+                        const hitCandidate& batched = batch.hits[batch.first[column] + (sampleID - firstSample)];
+                        sample = pagedRayColor<World, WithCache, WithEnvironment, WithGuide, WithFeatures>(r, batched, typedWorld, &pixelFeatures);
+                    } else {
+                        sample = rayColor<World, WithCache, WithEnvironment, WithGuide, WithFeatures>(r, maxDepth, typedWorld, &pixelFeatures);
+                    }
+                    pixelColor += sample;
+                    double l = luminance(sample);
+                    luminanceSq += l * l;
+                    tracedSamples++;
+                }
+                accumulation.add(index, pixelColor, luminanceSq, tracedSamples);
+
+                if constexpr (WithFeatures)
+                {
+                    // Everything came from the render cache, trace one sample for the features.
+                    if (tracedSamples == 0)
+                    {
+                        if (keepFeatures)
+                        {
+                            continue;
+                        }
+                        Sampler::seed(sampleSeed(x, y, firstSample));
+                        rayColor<World, WithCache, WithEnvironment, WithGuide, true>(getRay<Sampler, ThinLens>(x, y), maxDepth, typedWorld, &pixelFeatures);
+                        tracedSamples = 1;
+                    }
+                    double featureScale = 1.0 / tracedSamples;
+                    features.albedo[index] = featureScale * pixelFeatures.albedo;
+                    features.normal[index] = featureScale * pixelFeatures.normal;
+                    features.depth[index] = featureScale * pixelFeatures.depth;
+                }
+            }
+        }
+
+        // Resolves the sums once and hands whole planes to the encoder. False
+        // if outputPath couldn't be written.
+        bool writeOutput()
+        {
+            TRACE_ZONE("camera::writeOutput");
+            rgbPlanes image;
+            accumulation.resolve(image);
+            imageMetadata metadata = renderMetadata();
+
+            if (writeDebugFrame)
+            {
+                writeImage(debugGradient(), "test.exr");
+            }
+            if (outputPath.empty())
+            {
+                return true;
+            }
+
+            if (!denoise)
+            {
+                return writeImage(image, outputPath, metadata);
+            }
+
+            std::clog << "Denoising..." << std::endl;
+            TRACE_ZONE("denoise");
+            std::vector<color> beauty(image.pixelCount());
+            for (size_t i = 0; i < beauty.size(); i++)
+            {
+                beauty[i] = color(image.r[i], image.g[i], image.b[i]);
+            }
+            denoiser filter;
+            filter.iterations = denoiseIterations;
+            rgbPlanes denoised = toPlanes(filter.denoise(imagePlaneWidth, imagePlaneHeight, beauty, features));
+
+            // Only EXR can carry the extra layers, other formats get the denoised image.
+            if (outputPath.size() < 4 || outputPath.compare(outputPath.size() - 4, 4, ".exr") != 0)
+            {
+                return writeImage(denoised, outputPath, metadata);
+            }
+            rgbPlanes albedo = toPlanes(features.albedo);
+            rgbPlanes normal = toPlanes(features.normal);
+            return writeLayersToOpenEXR({
+                {"", &denoised},
+                {"noisy", &image},
+                {"albedo", &albedo},
+                {"normal", &normal}
+            }, outputPath.c_str(), metadata);
+        }
+
+        // How the image was sampled and how noisy it should be, for the EXR
+        // header. The noise estimates are the RMS over pixels of the standard
+        // error of their luminance, absolute and relative to the pixel's.
+        imageMetadata renderMetadata() const
+        {
+            uint32_t fewest = UINT32_MAX;
+            uint32_t most = 0;
+            uint64_t total = 0;
+            double squaredError = 0;
+            double relativeSquaredError = 0;
+            size_t measured = 0;
+            for (size_t i = 0; i < accumulation.pixelCount(); i++)
+            {
+                uint32_t n = accumulation.samples[i];
+                fewest = std::min(fewest, n);
+                most = std::max(most, n);
+                total += n;
+                double variance = accumulation.varianceOfMean(i);
+                if (variance >= 0)
+                {
+                    double mean = luminance(accumulation.average(i));
+                    squaredError += variance;
+                    relativeSquaredError += variance / std::fmax(mean * mean, 1e-6);
+                    measured++;
+                }
+            }
+
+            imageMetadata metadata;
+            double pixels = double(std::max<size_t>(accumulation.pixelCount(), 1));
+            metadata.floats.push_back({"samplesPerPixel", float(total / pixels)});
+            metadata.ints.push_back({"samplesPerPixelMin", int(fewest)});
+            metadata.ints.push_back({"samplesPerPixelMax", int(most)});
+            if (measured > 0)
+            {
+                metadata.floats.push_back({"noiseEstimate", float(std::sqrt(squaredError / measured))});
+                metadata.floats.push_back({"relativeNoiseEstimate", float(std::sqrt(relativeSquaredError / measured))});
+            }
+            metadata.floats.push_back({"renderTime", float(std::chrono::duration<double>(std::chrono::steady_clock::now() - renderStart).count())});
+            if (timeBudget > 0)
+            {
+                metadata.floats.push_back({"timeBudget", float(timeBudget)});
+            }
+            return metadata;
+        }
+
+        rgbPlanes toPlanes(const std::vector<color>& pixels) const
+        {
+            rgbPlanes planes;
+            planes.allocate(imagePlaneWidth, imagePlaneHeight);
+            for (size_t i = 0; i < pixels.size(); i++)
+            {
+                planes.set(i, pixels[i]);
+            }
+            return planes;
+        }
+
+        rgbPlanes debugGradient() const
+        {
+            rgbPlanes planes;
+            planes.allocate(imagePlaneWidth, imagePlaneHeight);
+            for (int y = 0; y < imagePlaneHeight; y++)
+            {
+                for (int x = 0; x < imagePlaneWidth; x++)
+                {
+                    planes.set(size_t(y) * imagePlaneWidth + x, color(x / (imagePlaneWidth-1.0f), y / (imagePlaneHeight-1.0f), 0.0));
+                }
+            }
+            return planes;
+        }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,139 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "rtweekend.h"
+
+// TBB
+#include <tbb/blocked_range2d.h>
+#include <tbb/parallel_for.h>
+
+#include <vector>
+
+// First hit features, averaged over every sample of a pixel.
+// Misses leave the normal and depth at zero.
+class featureBuffers
+{
+    public:
+        std::vector<color> albedo;
+        std::vector<vec3> normal;
+        std::vector<double> depth;
+
+        void resize(int width, int height)
+        {
+            albedo.assign(size_t(width) * height, color(0,0,0));
+            normal.assign(size_t(width) * height, vec3(0,0,0));
+            depth.assign(size_t(width) * height, 0.0);
+        }
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010).
+// The beauty is divided by albedo first so texture detail is not blurred,
+// then filtered with a 5x5 B3 spline kernel whose taps spread out by 2^i
+// each iteration and are weighted by colour, normal and depth similarity.
+class denoiser
+{
+    public:
+        int iterations = 5;
+        double colorSigma = 1.0;
+        double normalSigma = 0.3;
+        double depthSigma = 0.1;
+        int tileSize = 32;
+
+        std::vector<color> denoise(int width, int height, const std::vector<color>& beauty, const featureBuffers& features) const
+        {
+            std::vector<color> current(beauty.size());
+            for (size_t i = 0; i < beauty.size(); i++)
+            {
+                current[i] = demodulate(beauty[i], features.albedo[i]);
+            }
+
+            std::vector<color> next(beauty.size());
+            double colorPhi = colorSigma * colorSigma;
+            for (int iteration = 0; iteration < iterations; iteration++)
+            {
+                int step = 1 << iteration;
+                tbb::parallel_for(tbb::blocked_range2d<int>(0, height, tileSize, 0, width, tileSize),
+                    [&](const tbb::blocked_range2d<int>& tile){
+                        for (int y = tile.rows().begin(); y < tile.rows().end(); y++)
+                        {
+                            for (int x = tile.cols().begin(); x < tile.cols().end(); x++)
+                            {
+                                next[size_t(y) * width + x] = filterPixel(x, y, step, colorPhi, width, height, current, features);
+                            }
+                        }
+                    });
+                std::swap(current, next);
+                colorPhi *= 0.5;
+            }
+
+            for (size_t i = 0; i < current.size(); i++)
+            {
+                current[i] = remodulate(current[i], features.albedo[i]);
+            }
+            return current;
+        }
+
+    private:
+        static constexpr double epsilon = 1e-3;
+
+        static color demodulate(const color& c, const color& albedo)
+        {
+            return color(c.x() / std::fmax(albedo.x(), epsilon),
+                         c.y() / std::fmax(albedo.y(), epsilon),
+                         c.z() / std::fmax(albedo.z(), epsilon));
+        }
+
+        static color remodulate(const color& c, const color& albedo)
+        {
+            return color(c.x() * std::fmax(albedo.x(), epsilon),
+                         c.y() * std::fmax(albedo.y(), epsilon),
+                         c.z() * std::fmax(albedo.z(), epsilon));
+        }
+
+        color filterPixel(int x, int y, int step, double colorPhi, int width, int height,
+            const std::vector<color>& input, const featureBuffers& features) const
+        {
+            static const double kernel[5] = {1.0/16.0, 1.0/4.0, 3.0/8.0, 1.0/4.0, 1.0/16.0};
+
+            size_t center = size_t(y) * width + x;
+            const color& centerColor = input[center];
+            const vec3& centerNormal = features.normal[center];
+            double centerDepth = features.depth[center];
+            double normalPhi = normalSigma * normalSigma;
+            double depthPhi = depthSigma * std::fmax(centerDepth, epsilon) * step;
+
+            color sum(0,0,0);
+            double weightSum = 0.0;
+            for (int dy = -2; dy <= 2; dy++)
+            {
+                int sy = y + dy * step;
+                if (sy < 0 || sy >= height)
+                {
+                    continue;
+                }
+                for (int dx = -2; dx <= 2; dx++)
+                {
+                    int sx = x + dx * step;
+                    if (sx < 0 || sx >= width)
+                    {
+                        continue;
+                    }
+
+                    size_t tap = size_t(sy) * width + sx;
+                    double colorDist = (input[tap] - centerColor).lengthSquared();
+                    double normalDist = (features.normal[tap] - centerNormal).lengthSquared();
+                    double depthDist = std::fabs(features.depth[tap] - centerDepth);
+
+                    double weight = kernel[dx + 2] * kernel[dy + 2]
+                                  * std::exp(-colorDist / colorPhi)
+                                  * std::exp(-normalDist / normalPhi)
+                                  * std::exp(-depthDist / depthPhi);
+                    sum += weight * input[tap];
+                    weightSum += weight;
+                }
+            }
+            return weightSum > 0.0 ? sum / weightSum : centerColor;
+        }
+};
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef DOUBLE_LANES_H
+#define DOUBLE_LANES_H
+
+#include "rtweekend.h"
+
+// One double per SIMD lane, for running the same scalar code on several
+// primitives at once: 4 lanes with AVX2, 2 with SSE2, 1 otherwise. The backend
+// is picked at compile time from what the target can do (build with -mavx2 or
+// -march=native for AVX2). Each operation is the IEEE one per lane, so lane
+// results match the scalar code to the bit, as long as the compiler doesn't
+// fuse multiplies and adds in the scalar code (-ffp-contract=off when FMA is
+// available) or keep it in x87 registers. tools/lanes_check.cpp checks this.
+
+#if defined(__AVX2__)
+#define DOUBLE_LANES_AVX2
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DOUBLE_LANES_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(DOUBLE_LANES_AVX2)
+
+class alignas(32) double_lanes
+{
+    public:
+        static constexpr const char* backend = "avx2";
+        static constexpr int width = 4;
+
+        __m256d v;
+
+        explicit double_lanes(double x) : v(_mm256_set1_pd(x)) {}
+        explicit double_lanes(__m256d v) : v(v) {}
+
+        static double_lanes load(const double* p) {return double_lanes(_mm256_load_pd(p));}
+        void store(double* p) const {_mm256_store_pd(p, v);}
+
+        // NaN counts as not negative.
+        bool anyNonNegative() const {return _mm256_movemask_pd(_mm256_cmp_pd(v, _mm256_setzero_pd(), _CMP_LT_OQ)) != 0xf;}
+};
+
+inline double_lanes operator+(const double_lanes& a, const double_lanes& b) {return double_lanes(_mm256_add_pd(a.v, b.v));}
+inline double_lanes operator-(const double_lanes& a, const double_lanes& b) {return double_lanes(_mm256_sub_pd(a.v, b.v));}
+inline double_lanes operator*(const double_lanes& a, const double_lanes& b) {return double_lanes(_mm256_mul_pd(a.v, b.v));}
+inline double_lanes operator/(const double_lanes& a, const double_lanes& b) {return double_lanes(_mm256_div_pd(a.v, b.v));}
+inline double_lanes sqrt(const double_lanes& a) {return double_lanes(_mm256_sqrt_pd(a.v));}
+
+#elif defined(DOUBLE_LANES_SSE2)
+
+class alignas(16) double_lanes
+{
+    public:
+        static constexpr const char* backend = "sse2";
+        static constexpr int width = 2;
+
+        __m128d v;
+
+        explicit double_lanes(double x) : v(_mm_set1_pd(x)) {}
+        explicit double_lanes(__m128d v) : v(v) {}
+
+        static double_lanes load(const double* p) {return double_lanes(_mm_load_pd(p));}
+        void store(double* p) const {_mm_store_pd(p, v);}
+
+        bool anyNonNegative() const {return _mm_movemask_pd(_mm_cmplt_pd(v, _mm_setzero_pd())) != 0x3;}
+};
+
+inline double_lanes operator+(const double_lanes& a, const double_lanes& b) {return double_lanes(_mm_add_pd(a.v, b.v));}
+inline double_lanes operator-(const double_lanes& a, const double_lanes& b) {return double_lanes(_mm_sub_pd(a.v, b.v));}
+inline double_lanes operator*(const double_lanes& a, const double_lanes& b) {return double_lanes(_mm_mul_pd(a.v, b.v));}
+inline double_lanes operator/(const double_lanes& a, const double_lanes& b) {return double_lanes(_mm_div_pd(a.v, b.v));}
+inline double_lanes sqrt(const double_lanes& a) {return double_lanes(_mm_sqrt_pd(a.v));}
+
+#else
+
+class double_lanes
+{
+    public:
+        static constexpr const char* backend = "scalar";
+        static constexpr int width = 1;
+
+        double v;
+
+        explicit double_lanes(double x) : v(x) {}
+
+        static double_lanes load(const double* p) {return double_lanes(*p);}
+        void store(double* p) const {*p = v;}
+
+        bool anyNonNegative() const {return !(v < 0);}
+};
+
+inline double_lanes operator+(const double_lanes& a, const double_lanes& b) {return double_lanes(a.v + b.v);}
+inline double_lanes operator-(const double_lanes& a, const double_lanes& b) {return double_lanes(a.v - b.v);}
+inline double_lanes operator*(const double_lanes& a, const double_lanes& b) {return double_lanes(a.v * b.v);}
+inline double_lanes operator/(const double_lanes& a, const double_lanes& b) {return double_lanes(a.v / b.v);}
+inline double_lanes sqrt(const double_lanes& a) {return double_lanes(std::sqrt(a.v));}
+
+#endif
+
+#endif
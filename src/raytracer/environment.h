@@ -0,0 +1,230 @@
+#ifndef ENVIRONMENT_H
+#define ENVIRONMENT_H
+
+#include "rtweekend.h"
+#include "hash.h"
+
+// openEXR
+#include <ImfRgbaFile.h>
+#include <ImfArray.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// A lat-long HDR image around the scene, +y up. u runs with the angle around
+// y starting at -z, v from the top (v = 0 is straight up) to the bottom.
+//
+// Directions are importance sampled in proportion to texel luminance times
+// the solid angle the texel covers: a marginal CDF picks the row, that row's
+// conditional CDF picks the texel. Lookups and sampling both treat the map as
+// piecewise constant per texel, so sample() and pdf() agree exactly.
+class environmentMap
+{
+    public:
+        double intensity = 1.0;
+
+        // Reads the first part's RGB. False, with a message, if it can't be read.
+        bool load(const std::string& filename)
+        {
+            try
+            {
+                Imf::RgbaInputFile file(filename.c_str());
+                Imath::Box2i dw = file.dataWindow();
+                int w = dw.max.x - dw.min.x + 1;
+                int h = dw.max.y - dw.min.y + 1;
+                Imf::Array2D<Imf::Rgba> pixels(h, w);
+                file.setFrameBuffer(&pixels[0][0] - dw.min.x - dw.min.y * w, 1, w);
+                file.readPixels(dw.min.y, dw.max.y);
+
+                std::vector<float> rgb(size_t(w) * h * 3);
+                for (int y = 0; y < h; y++)
+                {
+                    for (int x = 0; x < w; x++)
+                    {
+                        const Imf::Rgba& p = pixels[y][x];
+                        float* out = &rgb[(size_t(y) * w + x) * 3];
+                        out[0] = p.r;
+                        out[1] = p.g;
+                        out[2] = p.b;
+                    }
+                }
+                set(w, h, std::move(rgb));
+            } catch (const std::exception& e) {
+                std::cerr << "Fails to Open Environment: " << e.what() << std::endl;
+                return false;
+            }
+            path = filename;
+            return true;
+        }
+
+        // Takes interleaved rgb rows, top row first.
+        void set(int w, int h, std::vector<float> rgb)
+        {
+            width = w;
+            height = h;
+            texels = std::move(rgb);
+            for (auto& value : texels)
+            {
+                // Negative or NaN texels would break the CDF, and mean nothing as light.
+                value = value > 0 ? value : 0.0f;
+            }
+            hasher content;
+            content.add(texels.data(), texels.size() * sizeof(float));
+            contentHash = content.digest();
+            buildDistribution();
+        }
+
+        bool empty() const
+        {
+            return width == 0;
+        }
+
+        color lookup(const vec3& direction) const
+        {
+            return texel(texelIndex(unitVector(direction)));
+        }
+
+        // Picks a direction from two uniform numbers. pdf is per unit solid
+        // angle, 0 if the map is black and the direction is useless.
+        vec3 sample(double u1, double u2, double& pdf) const
+        {
+            int row = pickFrom(marginal.data(), height, u1);
+            const float* conditional = &conditionals[size_t(row) * (width + 1)];
+            int column = pickFrom(conditional, width, u2);
+
+            // Reuse what is left of the random numbers to place the direction inside the texel.
+            double rowFraction = fractionWithin(marginal.data(), row, u1);
+            double columnFraction = fractionWithin(conditional, column, u2);
+            // Uniform in cos theta is uniform in solid angle within the row.
+            double cos0 = std::cos(pi * row / height);
+            double cos1 = std::cos(pi * (row + 1) / height);
+            double cosTheta = cos0 + rowFraction * (cos1 - cos0);
+            double sinTheta = std::sqrt(std::fmax(0.0, 1 - cosTheta * cosTheta));
+            double phi = 2 * pi * ((column + columnFraction) / width - 0.5);
+
+            pdf = texelPdf(row, column);
+            return vec3(sinTheta * std::sin(phi), cosTheta, -sinTheta * std::cos(phi));
+        }
+
+        double pdf(const vec3& direction) const
+        {
+            size_t index = texelIndex(unitVector(direction));
+            return texelPdf(int(index / width), int(index % width));
+        }
+
+        void fingerprint(hasher& h) const
+        {
+            // The texels rather than the path: maps filled by set() have none,
+            // and a file can change under the same name.
+            h.add("environmentMap");
+            h.add(contentHash);
+            h.add(width);
+            h.add(height);
+            h.add(intensity);
+        }
+
+        const std::string& source() const
+        {
+            return path;
+        }
+
+    private:
+        std::string path;
+        int width = 0;
+        int height = 0;
+        std::vector<float> texels;
+        uint64_t contentHash = 0;
+        // Running sums, normalised to end at 1: one of height + 1 entries over
+        // the rows, and one of width + 1 per row over that row's texels.
+        std::vector<float> marginal;
+        std::vector<float> conditionals;
+        double totalWeight = 0;
+
+        color texel(size_t index) const
+        {
+            const float* p = &texels[index * 3];
+            return intensity * color(p[0], p[1], p[2]);
+        }
+
+        static double luminance(const float* p)
+        {
+            return 0.2126 * p[0] + 0.7152 * p[1] + 0.0722 * p[2];
+        }
+
+        size_t texelIndex(const vec3& direction) const
+        {
+            double u = 0.5 + std::atan2(direction.x(), -direction.z()) / (2 * pi);
+            double v = std::acos(std::clamp(direction.y(), -1.0, 1.0)) / pi;
+            int column = std::clamp(int(u * width), 0, width - 1);
+            int row = std::clamp(int(v * height), 0, height - 1);
+            return size_t(row) * width + column;
+        }
+
+        void buildDistribution()
+        {
+            marginal.assign(height + 1, 0.0f);
+            conditionals.assign(size_t(height) * (width + 1), 0.0f);
+            totalWeight = 0;
+
+            for (int y = 0; y < height; y++)
+            {
+                // Rows near the poles cover less of the sphere.
+                double rowArea = std::cos(pi * y / height) - std::cos(pi * (y + 1) / height);
+                float* conditional = &conditionals[size_t(y) * (width + 1)];
+                double sum = 0;
+                for (int x = 0; x < width; x++)
+                {
+                    sum += luminance(&texels[(size_t(y) * width + x) * 3]);
+                    conditional[x + 1] = float(sum);
+                }
+                normalise(conditional, width);
+                totalWeight += sum * rowArea;
+                marginal[y + 1] = float(totalWeight);
+            }
+            normalise(marginal.data(), height);
+        }
+
+        // Turns running sums into a CDF. An all black range becomes uniform.
+        static void normalise(float* cdf, int count)
+        {
+            float total = cdf[count];
+            for (int i = 1; i <= count; i++)
+            {
+                cdf[i] = total > 0 ? cdf[i] / total : float(i) / count;
+            }
+            cdf[count] = 1.0f;
+        }
+
+        static int pickFrom(const float* cdf, int count, double u)
+        {
+            int i = int(std::upper_bound(cdf, cdf + count + 1, float(u)) - cdf) - 1;
+            return std::clamp(i, 0, count - 1);
+        }
+
+        static double fractionWithin(const float* cdf, int i, double u)
+        {
+            double span = cdf[i + 1] - cdf[i];
+            return span > 0 ? std::clamp((u - cdf[i]) / span, 0.0, 0.999999) : 0.5;
+        }
+
+        // Probability of the texel over the area it covers on the unit sphere.
+        double texelPdf(int row, int column) const
+        {
+            if (totalWeight <= 0)
+            {
+                return 0;
+            }
+            const float* conditional = &conditionals[size_t(row) * (width + 1)];
+            double rowProbability = marginal[row + 1] - marginal[row];
+            double columnProbability = conditional[column + 1] - conditional[column];
+            double theta0 = pi * row / height;
+            double theta1 = pi * (row + 1) / height;
+            double solidAngle = (2 * pi / width) * (std::cos(theta0) - std::cos(theta1));
+            return rowProbability * columnProbability / solidAngle;
+        }
+};
+
+#endif
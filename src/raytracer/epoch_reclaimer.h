@@ -0,0 +1,124 @@
+#ifndef EPOCH_RECLAIMER_H
+#define EPOCH_RECLAIMER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Epoch based reclamation for things readers reach through an atomic pointer
+// without taking a lock. A reader holds a guard while it uses the pointer;
+// retired objects are freed once every guard that might have seen them is gone.
+template <typename T>
+class epochReclaimer
+{
+    public:
+        epochReclaimer() : instance(nextInstance()++) {}
+        epochReclaimer(const epochReclaimer&) = delete;
+        epochReclaimer& operator=(const epochReclaimer&) = delete;
+
+        ~epochReclaimer()
+        {
+            for (auto& item : retired)
+            {
+                delete item.second;
+            }
+        }
+
+        class guard
+        {
+            public:
+                explicit guard(epochReclaimer& owner) : slot(owner.participantSlot())
+                {
+                    slot.store(owner.globalEpoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                    // Pairs with the fence in collect(): either we see the pointer
+                    // already cleared, or collect sees us as active.
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                }
+                ~guard() {slot.store(0, std::memory_order_release);}
+                guard(const guard&) = delete;
+                guard& operator=(const guard&) = delete;
+
+            private:
+                std::atomic<uint64_t>& slot;
+        };
+
+        // Call after the object can no longer be reached from any atomic pointer.
+        void retire(T* item)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            retired.emplace_back(globalEpoch.fetch_add(1, std::memory_order_seq_cst), item);
+            collectLocked();
+        }
+
+        void collect()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            collectLocked();
+        }
+
+        size_t pending() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return retired.size();
+        }
+
+    private:
+        uint64_t instance;
+        std::atomic<uint64_t> globalEpoch{1};
+        mutable std::mutex mutex;
+        // One per thread that ever read, never removed so references stay valid.
+        std::deque<std::atomic<uint64_t>> participants;
+        std::vector<std::pair<uint64_t, T*>> retired;
+
+        static std::atomic<uint64_t>& nextInstance()
+        {
+            static std::atomic<uint64_t> counter{1};
+            return counter;
+        }
+
+        // Keyed by instance id, not address, so a new reclaimer at the same
+        // address never picks up a slot of a destroyed one.
+        std::atomic<uint64_t>& participantSlot()
+        {
+            thread_local std::vector<std::pair<uint64_t, std::atomic<uint64_t>*>> slots;
+            for (auto& entry : slots)
+            {
+                if (entry.first == instance)
+                {
+                    return *entry.second;
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            participants.emplace_back(0);
+            slots.emplace_back(instance, &participants.back());
+            return participants.back();
+        }
+
+        void collectLocked()
+        {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            uint64_t oldestActive = UINT64_MAX;
+            for (const auto& participant : participants)
+            {
+                uint64_t epoch = participant.load(std::memory_order_acquire);
+                if (epoch != 0)
+                {
+                    oldestActive = std::min(oldestActive, epoch);
+                }
+            }
+            auto keep = std::partition(retired.begin(), retired.end(), [&](const std::pair<uint64_t, T*>& item){
+                return item.first >= oldestActive;
+            });
+            for (auto it = keep; it != retired.end(); ++it)
+            {
+                delete it->second;
+            }
+            retired.erase(keep, retired.end());
+        }
+};
+
+#endif
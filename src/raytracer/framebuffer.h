@@ -0,0 +1,291 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <new>
+#include <utility>
+
+#if defined(__F16C__)
+#include <immintrin.h>
+#endif
+
+// Cache line aligned array. The memory is not touched on allocation, so the
+// first thread to write a page decides which NUMA node it lives on.
+template <typename T>
+class alignedBuffer
+{
+    public:
+        static constexpr size_t alignment = 64;
+
+        alignedBuffer() {}
+        alignedBuffer(const alignedBuffer&) = delete;
+        alignedBuffer& operator=(const alignedBuffer&) = delete;
+        alignedBuffer(alignedBuffer&& other) noexcept : items(other.items), length(other.length)
+        {
+            other.items = nullptr;
+            other.length = 0;
+        }
+        alignedBuffer& operator=(alignedBuffer&& other) noexcept
+        {
+            std::swap(items, other.items);
+            std::swap(length, other.length);
+            return *this;
+        }
+        ~alignedBuffer() {release();}
+
+        // Aligned operator new rather than std::aligned_alloc, which MSVC's
+        // runtime doesn't have. Throws std::bad_alloc like any new.
+        void allocate(size_t count)
+        {
+            release();
+            size_t bytes = (count * sizeof(T) + alignment - 1) / alignment * alignment;
+            items = static_cast<T*>(::operator new(bytes > 0 ? bytes : alignment, std::align_val_t(alignment)));
+            length = count;
+        }
+
+        T* data() {return items;}
+        const T* data() const {return items;}
+        size_t size() const {return length;}
+        T& operator[](size_t i) {return items[i];}
+        const T& operator[](size_t i) const {return items[i];}
+
+    private:
+        T* items = nullptr;
+        size_t length = 0;
+
+        void release()
+        {
+            if (items)
+            {
+                ::operator delete(items, std::align_val_t(alignment));
+            }
+            items = nullptr;
+            length = 0;
+        }
+};
+
+// Resolved pixels, one float plane per channel, ready for an encoder.
+class rgbPlanes
+{
+    public:
+        int width = 0;
+        int height = 0;
+        alignedBuffer<float> r, g, b;
+
+        void allocate(int w, int h)
+        {
+            width = w;
+            height = h;
+            r.allocate(size_t(w) * h);
+            g.allocate(size_t(w) * h);
+            b.allocate(size_t(w) * h);
+        }
+
+        size_t pixelCount() const {return size_t(width) * height;}
+
+        void set(size_t index, const color& c)
+        {
+            r[index] = float(c.x());
+            g[index] = float(c.y());
+            b[index] = float(c.z());
+        }
+};
+
+inline double luminance(const color& c)
+{
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+// Float32 accumulation with per pixel sample counts, stored as aligned planes
+// so resolving and converting whole frames are straight vectorisable loops.
+// The sum of squared sample luminances gives each pixel's variance.
+class framebuffer
+{
+    public:
+        int width = 0;
+        int height = 0;
+        alignedBuffer<float> sumR, sumG, sumB;
+        alignedBuffer<float> sumLuminanceSq;
+        alignedBuffer<uint32_t> samples;
+
+        void allocate(int w, int h)
+        {
+            width = w;
+            height = h;
+            sumR.allocate(pixelCount());
+            sumG.allocate(pixelCount());
+            sumB.allocate(pixelCount());
+            sumLuminanceSq.allocate(pixelCount());
+            samples.allocate(pixelCount());
+        }
+
+        void clearRows(int firstRow, int lastRow)
+        {
+            size_t begin = size_t(firstRow) * width;
+            size_t end = size_t(lastRow) * width;
+            std::fill(sumR.data() + begin, sumR.data() + end, 0.0f);
+            std::fill(sumG.data() + begin, sumG.data() + end, 0.0f);
+            std::fill(sumB.data() + begin, sumB.data() + end, 0.0f);
+            std::fill(sumLuminanceSq.data() + begin, sumLuminanceSq.data() + end, 0.0f);
+            std::fill(samples.data() + begin, samples.data() + end, 0u);
+        }
+
+        void resize(int w, int h)
+        {
+            allocate(w, h);
+            clearRows(0, h);
+        }
+
+        size_t pixelCount() const {return size_t(width) * height;}
+
+        void add(size_t index, const color& c, double luminanceSq, uint32_t count)
+        {
+            sumR[index] += float(c.x());
+            sumG[index] += float(c.y());
+            sumB[index] += float(c.z());
+            sumLuminanceSq[index] += float(luminanceSq);
+            samples[index] += count;
+        }
+
+        // Variance of the pixel's mean luminance, from its samples so far.
+        // Unknown below two samples, reported as -1.
+        double varianceOfMean(size_t index) const
+        {
+            uint32_t n = samples[index];
+            if (n < 2)
+            {
+                return -1;
+            }
+            double mean = luminance(color(sumR[index], sumG[index], sumB[index])) / n;
+            double variance = (sumLuminanceSq[index] / n - mean * mean) * n / (n - 1);
+            return std::fmax(variance, 0.0) / n;
+        }
+
+        color average(size_t index) const
+        {
+            if (samples[index] == 0)
+            {
+                return color(0,0,0);
+            }
+            double scale = 1.0 / samples[index];
+            return scale * color(sumR[index], sumG[index], sumB[index]);
+        }
+
+        void resolve(rgbPlanes& out) const
+        {
+            out.allocate(width, height);
+            resolvePlane(sumR.data(), out.r.data());
+            resolvePlane(sumG.data(), out.g.data());
+            resolvePlane(sumB.data(), out.b.data());
+        }
+
+    private:
+        void resolvePlane(const float* __restrict sum, float* __restrict out) const
+        {
+            const uint32_t* __restrict count = samples.data();
+            size_t n = pixelCount();
+            for (size_t i = 0; i < n; i++)
+            {
+                float c = float(count[i]);
+                out[i] = c > 0.0f ? sum[i] / c : 0.0f;
+            }
+        }
+};
+
+// float -> IEEE half bits. F16C converts eight at a time; the fallback
+// handles rounding, subnormals, overflow and NaN the same way.
+inline uint16_t floatToHalfBits(float value)
+{
+    uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+    uint32_t sign = (f >> 16) & 0x8000;
+    int32_t exponent = int32_t((f >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = f & 0x7fffff;
+
+    if (((f >> 23) & 0xff) == 0xff)
+    {
+        return uint16_t(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+    }
+    if (exponent >= 31)
+    {
+        return uint16_t(sign | 0x7c00);
+    }
+    if (exponent <= 0)
+    {
+        if (exponent < -10)
+        {
+            return uint16_t(sign);
+        }
+        mantissa |= 0x800000;
+        uint32_t shift = uint32_t(14 - exponent);
+        uint32_t halfMantissa = mantissa >> shift;
+        uint32_t remainder = mantissa & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (halfMantissa & 1)))
+        {
+            halfMantissa++;
+        }
+        return uint16_t(sign | halfMantissa);
+    }
+
+    uint32_t bits = sign | (uint32_t(exponent) << 10) | (mantissa >> 13);
+    uint32_t remainder = mantissa & 0x1fff;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (bits & 1)))
+    {
+        bits++;
+    }
+    return uint16_t(bits);
+}
+
+inline void floatToHalf(const float* in, uint16_t* out, size_t count)
+{
+    size_t i = 0;
+#if defined(__F16C__)
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i halves = _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), halves);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        out[i] = floatToHalfBits(in[i]);
+    }
+}
+
+// Linear float -> 8 bit sRGB through a table indexed by the clamped value.
+// 4096 steps is finer than the 8 bit output can show anywhere on the curve.
+inline void floatToSrgb8(const float* r, const float* g, const float* b, uint8_t* rgb, size_t count)
+{
+    static constexpr int tableSize = 4096;
+    static const auto table = []{
+        static uint8_t values[tableSize];
+        for (int i = 0; i < tableSize; i++)
+        {
+            double linear = i / double(tableSize - 1);
+            double encoded = linear <= 0.0031308 ? 12.92 * linear : 1.055 * std::pow(linear, 1.0 / 2.4) - 0.055;
+            values[i] = uint8_t(std::lround(255.0 * encoded));
+        }
+        return values;
+    }();
+
+    auto lookup = [](float v){
+        // Written so NaN lands on 0.
+        float clamped = v > 0.0f ? (v < 1.0f ? v : 1.0f) : 0.0f;
+        return table[int(clamped * (tableSize - 1) + 0.5f)];
+    };
+    for (size_t i = 0; i < count; i++)
+    {
+        rgb[i * 3 + 0] = lookup(r[i]);
+        rgb[i * 3 + 1] = lookup(g[i]);
+        rgb[i * 3 + 2] = lookup(b[i]);
+    }
+}
+
+#endif
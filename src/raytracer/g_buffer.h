@@ -0,0 +1,85 @@
+#ifndef G_BUFFER_H
+#define G_BUFFER_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Look-dev: the primary hit of every camera sample, kept from one render to
+// the next. After an edit that leaves geometry and camera alone, a material
+// tweak say, a re-render starts shading at the cached hits and never
+// intersects a camera ray with the scene.
+//
+// A hit is the distance along the camera ray and the index of the primitive
+// in the flattened world, 12 bytes. The ray itself is cheap to make again
+// from the sample's seed, and finalize() on the primitive gives back the
+// position, normal and uv to the bit. The material comes from the primitive
+// as it is now, so the index doubles as the material slot.
+//
+// The camera hands prepare() a key of the geometry, camera and seed before
+// each render. When it differs from the last one, every hit is forgotten.
+class gBuffer
+{
+    public:
+        static constexpr uint32_t miss = UINT32_MAX;
+        static constexpr uint32_t unknown = UINT32_MAX - 1;
+        static constexpr size_t bytesPerSample = sizeof(double) + sizeof(uint32_t);
+
+        // Samples beyond what fits in this many bytes aren't cached, they are
+        // traced from the camera every time.
+        explicit gBuffer(size_t maxBytes = size_t(1) << 30) : maxBytes(maxBytes) {}
+
+        // Makes room for samplesPerPixel of pixelCount pixels, or as many as
+        // fit. True if the hits stored for renderKey were kept.
+        bool prepare(uint64_t renderKey, size_t pixelCount, uint32_t samplesPerPixel)
+        {
+            bool kept = renderKey == key && pixelCount == pixels;
+            if (!kept)
+            {
+                key = renderKey;
+                pixels = pixelCount;
+                distances.clear();
+                primitives.clear();
+            }
+            size_t fits = pixels > 0 ? maxBytes / (pixels * bytesPerSample) : 0;
+            size_t wanted = std::min<size_t>(samplesPerPixel, fits) * pixels;
+            if (wanted > primitives.size())
+            {
+                distances.resize(wanted, 0);
+                primitives.resize(wanted, unknown);
+            }
+            return kept;
+        }
+
+        // Samples per pixel with a place in the buffer, those below this index.
+        uint32_t samples() const {return pixels > 0 ? uint32_t(primitives.size() / pixels) : 0;}
+
+        // Sample major, so growing the buffer keeps what is stored.
+        size_t slot(size_t pixel, uint32_t sampleID) const {return size_t(sampleID) * pixels + pixel;}
+
+        uint32_t primitive(size_t slot) const {return primitives[slot];}
+        double distance(size_t slot) const {return distances[slot];}
+
+        // Render threads store different slots, so no locking.
+        void store(size_t slot, double t, uint32_t primitive)
+        {
+            distances[slot] = t;
+            primitives[slot] = primitive;
+        }
+
+        size_t bytesUsed() const
+        {
+            return distances.capacity() * sizeof(double) + primitives.capacity() * sizeof(uint32_t);
+        }
+
+    private:
+        size_t maxBytes;
+        uint64_t key = 0;
+        size_t pixels = 0;
+        std::vector<double> distances;
+        std::vector<uint32_t> primitives;
+};
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+
+// 64 bit FNV-1a, used to fingerprint scenes and render settings.
+class hasher
+{
+    public:
+        void add(const void* data, size_t bytes)
+        {
+            auto p = static_cast<const unsigned char*>(data);
+            for (size_t i = 0; i < bytes; i++)
+            {
+                value = (value ^ p[i]) * 0x100000001b3ull;
+            }
+        }
+
+        void add(const std::string& text)
+        {
+            add(text.data(), text.size());
+        }
+
+        template <typename T>
+        void add(const T& v)
+        {
+            static_assert(std::is_trivially_copyable<T>::value, "hash the members instead");
+            add(&v, sizeof(T));
+        }
+
+        uint64_t digest() const {return value;}
+
+    private:
+        uint64_t value = 0xcbf29ce484222325ull;
+};
+
+#endif
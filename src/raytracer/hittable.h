@@ -2,17 +2,52 @@
 #define HITTABLE_H
 
 #include "rtweekend.h"
+#include "hash.h"
 
+#include <algorithm>
+
+class hittable;
 class material;
 
+// What the cheap first phase of an intersection returns: just enough to pick
+// the closest primitive. Only the winner is turned into a hitRecord.
+struct hitCandidate
+{
+    double t;
+    // The leaf that owns the primitive, it knows how to finalize it.
+    const hittable* object;
+    // Which primitive inside object, for objects that hold many.
+    uint32_t primitive;
+};
+
 class hitRecord
 {
     public:
         point3 p;
         vec3 normal;
-        shared_ptr<material> mat;
+        const material* mat;
         double t;
         bool frontFace;
+        // Point on the unit sphere that texture coordinates come from. Only
+        // textured materials need u and v, so they ask for them through uv()
+        // rather than every hit paying for an acos and an atan2.
+        vec3 uvPoint;
+        // World space width of the ray cone at p, and how many uv units one
+        // world unit covers there. Their product sizes texture lookups.
+        double coneWidth;
+        double uvScale;
+
+        double uvFootprint() const {return coneWidth * uvScale;}
+
+        // u is the angle round y starting at x = -1, v the angle from y = -1
+        // up to y = +1, both scaled to [0, 1].
+        void uv(double& u, double& v) const
+        {
+            auto theta = std::acos(std::clamp(-uvPoint.y(), -1.0, 1.0));
+            auto phi = std::atan2(-uvPoint.z(), uvPoint.x()) + pi;
+            u = phi / (2 * pi);
+            v = theta / pi;
+        }
 
         void setFaceNormals(const ray& r, const vec3& outwardNormal)
         {
@@ -26,7 +61,34 @@ class hittable
     public:
         virtual ~hittable() = default; // google this?
 
-        virtual bool hit(const ray& r, interval rayT, hitRecord& rec) const = 0;
+        // Closest hit in two phases: intersect() finds the nearest candidate
+        // using only t, then finalize() computes p, normal, face and material
+        // for that one primitive.
+        virtual bool hit(const ray& r, interval rayT, hitRecord& rec) const
+        {
+            hitCandidate candidate;
+            if (!intersect(r, rayT, candidate))
+            {
+                return false;
+            }
+            candidate.object->finalize(r, candidate, rec);
+            return true;
+        }
+
+        virtual bool intersect(const ray& r, interval rayT, hitCandidate& candidate) const = 0;
+
+        virtual void finalize(const ray& r, const hitCandidate& candidate, hitRecord& rec) const = 0;
+
+        // Any hit query for shadow and visibility rays: true as soon as anything
+        // blocks r within rayT. Nothing is shaded, so override it where that's cheaper.
+        virtual bool occluded(const ray& r, interval rayT) const
+        {
+            hitRecord rec;
+            return hit(r, rayT, rec);
+        }
+
+        // Feeds everything that affects the rendered image into h.
+        virtual void fingerprint(hasher& h) const = 0;
 };
 
 #endif
\ No newline at end of file
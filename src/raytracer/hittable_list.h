@@ -9,35 +9,60 @@
 class hittable_list : public hittable
 {
     public:
-        std::vector<shared_ptr<hittable>> objects;
+        // Not owned, see scene for the storage behind them.
+        std::vector<const hittable*> objects;
 
         hittable_list() {}
-        hittable_list(shared_ptr<hittable> object) {add(object);}
+        hittable_list(const hittable* object) {add(object);}
 
         void clear() {objects.clear();}
 
-        void add(shared_ptr<hittable> object)
+        void add(const hittable* object)
         {
             objects.push_back(object);
         };
         
-        bool hit(const ray& r, interval rayT, hitRecord& rec) const override
+        bool intersect(const ray& r, interval rayT, hitCandidate& candidate) const override
         {
-            hitRecord tempRec;
             bool hitAnything = false;
             auto closetSoFar = rayT.max;
 
             for (const auto& object : objects)
             {
-                if(object->hit(r, interval(rayT.min, closetSoFar), tempRec))
+                if(object->intersect(r, interval(rayT.min, closetSoFar), candidate))
                 {
                     hitAnything = true;
-                    closetSoFar = tempRec.t;
-                    rec = tempRec;
+                    closetSoFar = candidate.t;
                 }
             }
             return hitAnything;
         }
+
+        void finalize(const ray& r, const hitCandidate& candidate, hitRecord& rec) const override
+        {
+            candidate.object->finalize(r, candidate, rec);
+        }
+
+        bool occluded(const ray& r, interval rayT) const override
+        {
+            for (const auto& object : objects)
+            {
+                if (object->occluded(r, rayT))
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void fingerprint(hasher& h) const override
+        {
+            h.add(objects.size());
+            for (const auto& object : objects)
+            {
+                object->fingerprint(h);
+            }
+        }
 };
 
 #endif
\ No newline at end of file
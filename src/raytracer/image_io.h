@@ -0,0 +1,329 @@
+#ifndef IMAGE_IO_H
+#define IMAGE_IO_H
+
+#include "rtweekend.h"
+#include "framebuffer.h"
+#include "trace.h"
+
+// openEXR
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImfFloatAttribute.h>
+#include <ImfHeader.h>
+#include <ImfInputFile.h>
+#include <ImfIntAttribute.h>
+#include <ImfOutputFile.h>
+#include <ImfStringAttribute.h>
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Encoders that write a whole rgbPlanes in one pass from contiguous memory.
+
+// Extra EXR header attributes, such as how a render was sampled. PNG and PPM
+// have nowhere to keep them and leave them out.
+struct imageMetadata
+{
+    std::vector<std::pair<std::string, int>> ints;
+    std::vector<std::pair<std::string, float>> floats;
+    std::vector<std::pair<std::string, std::string>> strings;
+
+    void addTo(Imf::Header& header) const
+    {
+        for (const auto& [name, value] : ints)
+        {
+            header.insert(name.c_str(), Imf::IntAttribute(value));
+        }
+        for (const auto& [name, value] : floats)
+        {
+            header.insert(name.c_str(), Imf::FloatAttribute(value));
+        }
+        for (const auto& [name, value] : strings)
+        {
+            header.insert(name.c_str(), Imf::StringAttribute(value));
+        }
+    }
+};
+
+// Half float RGB, one planar slice per channel, no interleaving copy.
+inline bool writeExr(const rgbPlanes& image, const char* filename, const imageMetadata& metadata = {})
+{
+    TRACE_ZONE("writeExr");
+    try
+    {
+        size_t count = image.pixelCount();
+        alignedBuffer<uint16_t> r, g, b;
+        r.allocate(count);
+        g.allocate(count);
+        b.allocate(count);
+        {
+            TRACE_ZONE("floatToHalf");
+            floatToHalf(image.r.data(), r.data(), count);
+            floatToHalf(image.g.data(), g.data(), count);
+            floatToHalf(image.b.data(), b.data(), count);
+        }
+
+        Imf::Header fileHeader(image.width, image.height);
+        metadata.addTo(fileHeader);
+
+        Imf::FrameBuffer frameBuffer;
+        const char* names[3] = {"R", "G", "B"};
+        uint16_t* planes[3] = {r.data(), g.data(), b.data()};
+        for (int c = 0; c < 3; c++)
+        {
+            fileHeader.channels().insert(names[c], Imf::Channel(Imf::HALF));
+            frameBuffer.insert(names[c], Imf::Slice(Imf::HALF, (char*)planes[c],
+                sizeof(uint16_t), sizeof(uint16_t) * image.width));
+        }
+
+        // Compression and file I/O both happen in here.
+        TRACE_ZONE("OpenEXR writePixels");
+        Imf::OutputFile file(filename, fileHeader);
+        file.setFrameBuffer(frameBuffer);
+        file.writePixels(image.height);
+        return true;
+    } catch (const std::exception &e) {
+        std::cerr << "Fails to Write Image: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+// A named group of RGB channels, e.g. "denoised" is written as denoised.R/G/B.
+// An empty name writes the default R, G, B channels.
+struct exrLayer
+{
+    std::string name;
+    const rgbPlanes* pixels;
+};
+
+inline bool writeLayersToOpenEXR(const std::vector<exrLayer>& layers, const char* filename, const imageMetadata& metadata = {})
+{
+    TRACE_ZONE("writeLayersToOpenEXR");
+    try
+    {
+        int width = layers.front().pixels->width;
+        int height = layers.front().pixels->height;
+        Imf::Header header(width, height);
+        metadata.addTo(header);
+        Imf::FrameBuffer frameBuffer;
+
+        static const char* channelNames[3] = {"R", "G", "B"};
+        for (const auto& layer : layers)
+        {
+            const float* planes[3] = {layer.pixels->r.data(), layer.pixels->g.data(), layer.pixels->b.data()};
+            for (int c = 0; c < 3; c++)
+            {
+                std::string channel = layer.name.empty() ? channelNames[c] : layer.name + "." + channelNames[c];
+                header.channels().insert(channel.c_str(), Imf::Channel(Imf::FLOAT));
+                frameBuffer.insert(channel.c_str(), Imf::Slice(Imf::FLOAT, (char*)planes[c],
+                    sizeof(float), sizeof(float) * width));
+            }
+        }
+
+        Imf::OutputFile file(filename, header);
+        file.setFrameBuffer(frameBuffer);
+        file.writePixels(height);
+        return true;
+    } catch (const std::exception &e) {
+        std::cerr << "Fails to Write Image: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+// Binary P6, 8 bit sRGB.
+inline bool writePpm(const rgbPlanes& image, const char* filename)
+{
+    TRACE_ZONE("writePpm");
+    std::vector<uint8_t> rgb(image.pixelCount() * 3);
+    {
+        TRACE_ZONE("floatToSrgb8");
+        floatToSrgb8(image.r.data(), image.g.data(), image.b.data(), rgb.data(), image.pixelCount());
+    }
+    TRACE_ZONE("file write");
+
+    FILE* file = std::fopen(filename, "wb");
+    if (!file)
+    {
+        std::cerr << "Fails to Write Image: " << filename << std::endl;
+        return false;
+    }
+    std::fprintf(file, "P6\n%d %d\n255\n", image.width, image.height);
+    bool ok = std::fwrite(rgb.data(), 1, rgb.size(), file) == rgb.size();
+    ok = (std::fclose(file) == 0) && ok;
+    return ok;
+}
+
+namespace png
+{
+    inline uint32_t crc(const uint8_t* data, size_t length, uint32_t crc = 0xffffffffu)
+    {
+        static const auto table = []{
+            static uint32_t values[256];
+            for (uint32_t n = 0; n < 256; n++)
+            {
+                uint32_t c = n;
+                for (int k = 0; k < 8; k++)
+                {
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                }
+                values[n] = c;
+            }
+            return values;
+        }();
+        for (size_t i = 0; i < length; i++)
+        {
+            crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+    inline void putBigEndian(std::vector<uint8_t>& out, uint32_t value)
+    {
+        out.push_back(uint8_t(value >> 24));
+        out.push_back(uint8_t(value >> 16));
+        out.push_back(uint8_t(value >> 8));
+        out.push_back(uint8_t(value));
+    }
+
+    inline void chunk(std::vector<uint8_t>& out, const char* type, const uint8_t* data, size_t length)
+    {
+        putBigEndian(out, uint32_t(length));
+        size_t start = out.size();
+        out.insert(out.end(), type, type + 4);
+        out.insert(out.end(), data, data + length);
+        putBigEndian(out, crc(out.data() + start, length + 4) ^ 0xffffffffu);
+    }
+}
+
+// 8 bit sRGB PNG. The zlib stream uses stored (uncompressed) deflate blocks,
+// which costs file size but keeps encoding a single memcpy-speed pass.
+inline bool writePng(const rgbPlanes& image, const char* filename)
+{
+    TRACE_ZONE("writePng");
+    size_t rowBytes = size_t(image.width) * 3;
+    std::vector<uint8_t> rgb(image.pixelCount() * 3);
+    {
+        TRACE_ZONE("floatToSrgb8");
+        floatToSrgb8(image.r.data(), image.g.data(), image.b.data(), rgb.data(), image.pixelCount());
+    }
+
+    std::vector<uint8_t> file;
+    {
+        TRACE_ZONE("png encode");
+        // Scanlines each prefixed with filter type 0.
+        std::vector<uint8_t> raw((rowBytes + 1) * image.height);
+        for (int y = 0; y < image.height; y++)
+        {
+            raw[y * (rowBytes + 1)] = 0;
+            std::memcpy(&raw[y * (rowBytes + 1) + 1], &rgb[y * rowBytes], rowBytes);
+        }
+
+        std::vector<uint8_t> zlib = {0x78, 0x01};
+        uint32_t adlerA = 1, adlerB = 0;
+        for (size_t offset = 0; offset < raw.size() || offset == 0; )
+        {
+            size_t blockLength = std::min<size_t>(65535, raw.size() - offset);
+            bool last = offset + blockLength == raw.size();
+            zlib.push_back(last ? 1 : 0);
+            zlib.push_back(uint8_t(blockLength));
+            zlib.push_back(uint8_t(blockLength >> 8));
+            zlib.push_back(uint8_t(~blockLength));
+            zlib.push_back(uint8_t(~blockLength >> 8));
+            zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + blockLength);
+
+            // Adler-32, reduced every 4096 bytes and at the end of each block.
+            // Sums stay 32 bit for up to 5552 bytes between reductions.
+            for (size_t i = offset; i < offset + blockLength; i++)
+            {
+                adlerA += raw[i];
+                adlerB += adlerA;
+                if ((i & 0xfff) == 0xfff)
+                {
+                    adlerA %= 65521;
+                    adlerB %= 65521;
+                }
+            }
+            adlerA %= 65521;
+            adlerB %= 65521;
+
+            offset += blockLength;
+            if (last)
+            {
+                break;
+            }
+        }
+        png::putBigEndian(zlib, (adlerB << 16) | adlerA);
+
+        file = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+        std::vector<uint8_t> ihdr;
+        png::putBigEndian(ihdr, uint32_t(image.width));
+        png::putBigEndian(ihdr, uint32_t(image.height));
+        ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0});
+        png::chunk(file, "IHDR", ihdr.data(), ihdr.size());
+        png::chunk(file, "IDAT", zlib.data(), zlib.size());
+        png::chunk(file, "IEND", nullptr, 0);
+    }
+
+    TRACE_ZONE("file write");
+    FILE* out = std::fopen(filename, "wb");
+    if (!out)
+    {
+        std::cerr << "Fails to Write Image: " << filename << std::endl;
+        return false;
+    }
+    bool ok = std::fwrite(file.data(), 1, file.size(), out) == file.size();
+    ok = (std::fclose(out) == 0) && ok;
+    return ok;
+}
+
+// Picks the encoder from the file extension, EXR when there isn't one we know.
+inline bool writeImage(const rgbPlanes& image, const std::string& filename, const imageMetadata& metadata = {})
+{
+    auto endsWith = [&](const char* suffix){
+        size_t n = std::strlen(suffix);
+        return filename.size() >= n && filename.compare(filename.size() - n, n, suffix) == 0;
+    };
+    if (endsWith(".png"))
+    {
+        return writePng(image, filename.c_str());
+    }
+    if (endsWith(".ppm"))
+    {
+        return writePpm(image, filename.c_str());
+    }
+    return writeExr(image, filename.c_str(), metadata);
+}
+
+// R, G and B of an EXR as float, whatever type they were stored as, e.g. a
+// reference image to measure renders against.
+inline bool readExr(const char* filename, rgbPlanes& image)
+{
+    try
+    {
+        Imf::InputFile file(filename);
+        Imath::Box2i dw = file.header().dataWindow();
+        int width = dw.max.x - dw.min.x + 1;
+        int height = dw.max.y - dw.min.y + 1;
+        image.allocate(width, height);
+
+        Imf::FrameBuffer frameBuffer;
+        const char* names[3] = {"R", "G", "B"};
+        float* planes[3] = {image.r.data(), image.g.data(), image.b.data()};
+        for (int c = 0; c < 3; c++)
+        {
+            char* origin = (char*)(planes[c] - dw.min.x - ptrdiff_t(dw.min.y) * width);
+            frameBuffer.insert(names[c], Imf::Slice(Imf::FLOAT, origin, sizeof(float), sizeof(float) * width));
+        }
+        file.setFrameBuffer(frameBuffer);
+        file.readPixels(dw.min.y, dw.max.y);
+        return true;
+    } catch (const std::exception &e) {
+        std::cerr << "Fails to Read Image: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+#endif
@@ -0,0 +1,215 @@
+#ifndef IRRADIANCE_CACHE_H
+#define IRRADIANCE_CACHE_H
+
+#include "rtweekend.h"
+
+// TBB
+#include <tbb/concurrent_vector.h>
+
+#include <array>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+// One hemisphere sample traced while computing a record.
+struct irradianceSample
+{
+    color radiance;
+    double distance;
+};
+
+// Ward style irradiance cache. Records live in a world space hash grid and are
+// created lazily the first time a lookup finds nothing close enough.
+//
+// The stored value is the mean incoming radiance over a cosine weighted
+// hemisphere, which is exactly what a diffuse bounce multiplies its albedo
+// with, so a lookup can stand in for the rest of the path.
+class irradianceCache
+{
+    public:
+        // Larger values reuse records further away, trading accuracy for speed.
+        double tolerance = 0.3;
+        int samplesPerRecord = 64;
+        double minSpacing = 0.05;
+        double maxSpacing = 2.0;
+
+        irradianceCache(double cellSize = 0.5) : cellSize(cellSize) {}
+
+        template <typename Trace>
+        color lookup(const point3& p, const vec3& n, Trace&& trace)
+        {
+            color estimate;
+            if (interpolate(p, n, estimate))
+            {
+                return estimate;
+            }
+            return insert(computeRecord(p, n, trace));
+        }
+
+        size_t size() const {return records.size();}
+
+    private:
+        struct record
+        {
+            point3 p;
+            vec3 n;
+            color irradiance;
+            // Translational gradient of each colour channel.
+            vec3 gradient[3];
+            double radius;
+        };
+
+        struct shard
+        {
+            std::shared_mutex lock;
+            std::unordered_map<uint64_t, std::vector<size_t>> cells;
+        };
+
+        static constexpr int shardCount = 64;
+
+        double cellSize;
+        tbb::concurrent_vector<record> records;
+        std::array<shard, shardCount> shards;
+
+        bool interpolate(const point3& p, const vec3& n, color& estimate)
+        {
+            uint64_t key = cellKey(cellOf(p.x()), cellOf(p.y()), cellOf(p.z()));
+            shard& s = shards[key % shardCount];
+            std::shared_lock<std::shared_mutex> guard(s.lock);
+
+            auto cell = s.cells.find(key);
+            if (cell == s.cells.end())
+            {
+                return false;
+            }
+
+            color sum(0,0,0);
+            double weightSum = 0.0;
+            for (size_t index : cell->second)
+            {
+                const record& rec = records[index];
+                vec3 offset = p - rec.p;
+
+                // Skip records that sit in front of p, they see a different hemisphere.
+                if (dot(offset, n + rec.n) < -0.1 * rec.radius)
+                {
+                    continue;
+                }
+
+                double error = offset.length() / rec.radius + std::sqrt(std::fmax(0.0, 1.0 - dot(n, rec.n)));
+                if (error >= tolerance)
+                {
+                    continue;
+                }
+
+                double weight = 1.0 / std::fmax(error, 1e-6);
+                color value(rec.irradiance.x() + dot(offset, rec.gradient[0]),
+                            rec.irradiance.y() + dot(offset, rec.gradient[1]),
+                            rec.irradiance.z() + dot(offset, rec.gradient[2]));
+                sum += weight * color(std::fmax(value.x(), 0.0), std::fmax(value.y(), 0.0), std::fmax(value.z(), 0.0));
+                weightSum += weight;
+            }
+
+            if (weightSum <= 0.0)
+            {
+                return false;
+            }
+            estimate = sum / weightSum;
+            return true;
+        }
+
+        template <typename Trace>
+        record computeRecord(const point3& p, const vec3& n, Trace& trace) const
+        {
+            std::vector<vec3> directions(samplesPerRecord);
+            std::vector<irradianceSample> samples(samplesPerRecord);
+
+            color mean(0,0,0);
+            double inverseDistanceSum = 0.0;
+            for (int i = 0; i < samplesPerRecord; i++)
+            {
+                auto direction = n + randomUnitVector();
+                if (direction.nearZero())
+                {
+                    direction = n;
+                }
+                directions[i] = unitVector(direction);
+                samples[i] = trace(ray(p, directions[i]));
+                mean += samples[i].radiance;
+                // Very short hits are the surface finding itself again, not a neighbour.
+                if (samples[i].distance > 1e-3)
+                {
+                    inverseDistanceSum += 1.0 / samples[i].distance;
+                }
+            }
+            mean /= samplesPerRecord;
+
+            record rec;
+            rec.p = p;
+            rec.n = n;
+            rec.irradiance = mean;
+
+            // Harmonic mean distance to the surroundings, the classic split sphere bound.
+            double harmonicMean = inverseDistanceSum > 0.0 ? samplesPerRecord / inverseDistanceSum : maxSpacing;
+            rec.radius = interval(minSpacing, maxSpacing).clamp(harmonicMean);
+
+            // Cheap translational gradient: each sample's deviation from the mean,
+            // pushed along the tangential part of its direction and scaled by how
+            // close its hit is. Near occluders change fastest as p moves.
+            for (int c = 0; c < 3; c++)
+            {
+                rec.gradient[c] = vec3(0,0,0);
+            }
+            for (int i = 0; i < samplesPerRecord; i++)
+            {
+                vec3 tangential = directions[i] - dot(directions[i], n) * n;
+                double scale = 1.0 / (samplesPerRecord * std::fmax(samples[i].distance, rec.radius));
+                auto deviation = samples[i].radiance - mean;
+                for (int c = 0; c < 3; c++)
+                {
+                    rec.gradient[c] += (deviation[c] * scale) * tangential;
+                }
+            }
+
+            return rec;
+        }
+
+        color insert(const record& rec)
+        {
+            size_t index = records.push_back(rec) - records.begin();
+
+            // Register the record with every cell its validity sphere overlaps.
+            double reach = rec.radius * tolerance;
+            int64_t minX = cellOf(rec.p.x() - reach), maxX = cellOf(rec.p.x() + reach);
+            int64_t minY = cellOf(rec.p.y() - reach), maxY = cellOf(rec.p.y() + reach);
+            int64_t minZ = cellOf(rec.p.z() - reach), maxZ = cellOf(rec.p.z() + reach);
+            for (int64_t x = minX; x <= maxX; x++)
+            {
+                for (int64_t y = minY; y <= maxY; y++)
+                {
+                    for (int64_t z = minZ; z <= maxZ; z++)
+                    {
+                        uint64_t key = cellKey(x, y, z);
+                        shard& s = shards[key % shardCount];
+                        std::unique_lock<std::shared_mutex> guard(s.lock);
+                        s.cells[key].push_back(index);
+                    }
+                }
+            }
+            return rec.irradiance;
+        }
+
+        int64_t cellOf(double coordinate) const
+        {
+            return int64_t(std::floor(coordinate / cellSize));
+        }
+
+        static uint64_t cellKey(int64_t x, int64_t y, int64_t z)
+        {
+            return (uint64_t(x) * 73856093u) ^ (uint64_t(y) * 19349663u) ^ (uint64_t(z) * 83492791u);
+        }
+};
+
+#endif
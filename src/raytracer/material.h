@@ -2,9 +2,23 @@
 #define MATERIAL_H
 
 #include "hittable.h"
+#include "texture.h"
+
+// Lets specialised render kernels pick the concrete scatter() with a switch
+// instead of a virtual call, see scatterDirect.
+enum class materialKind
+{
+    diffuse,
+    metal,
+    glass,
+    other
+};
 
 class material {
     public:
+        const materialKind kind;
+
+        material(materialKind kind = materialKind::other) : kind(kind) {}
         virtual ~material() = default;
 
         virtual bool scatter(
@@ -12,12 +26,27 @@ class material {
             ) const {
                 return false;
             }
+
+        // Surface colour seen by the denoiser's albedo feature buffer.
+        virtual color baseColor(const hitRecord& rec) const
+        {
+            return color(1.0, 1.0, 1.0);
+        }
+
+        // True for lambertian surfaces whose bounce the irradiance cache can replace.
+        virtual bool isDiffuse() const
+        {
+            return false;
+        }
+
+        virtual void fingerprint(hasher& h) const = 0;
 };
 
-class diffuse : public material 
+class diffuse final : public material 
 {
     public:
-        diffuse(const color& albedo) : albedo(albedo){}
+        diffuse(const color& albedo) : material(materialKind::diffuse), albedo(albedo){}
+        diffuse(const texture* tex) : material(materialKind::diffuse), albedo(1,1,1), tex(tex){}
 
         bool scatter(const ray& rIn, const hitRecord& rec, color& attenuation, ray& scattered)
         const override {
@@ -27,37 +56,76 @@ class diffuse : public material
                 scatterDirection = rec.normal;
             }
             scattered = ray(rec.p, scatterDirection);
-            attenuation = albedo;
+            attenuation = baseColor(rec);
             return true;
         }
 
+        color baseColor(const hitRecord& rec) const override
+        {
+            return tex ? tex->value(rec) : albedo;
+        }
+
+        bool isDiffuse() const override
+        {
+            return true;
+        }
+
+        void fingerprint(hasher& h) const override
+        {
+            h.add("diffuse");
+            h.add(albedo);
+            if (tex)
+            {
+                tex->fingerprint(h);
+            }
+        }
+
     private:
         color albedo;
+        const texture* tex = nullptr;
 };
 
-class metal : public material
+class metal final : public material
 {
     public:
-        metal(const color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+        metal(const color& albedo, double fuzz) : material(materialKind::metal), albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+        metal(const texture* tex, double fuzz) : material(materialKind::metal), albedo(1,1,1), fuzz(fuzz < 1 ? fuzz : 1), tex(tex) {}
 
         bool scatter(const ray& rIn, const hitRecord& rec, color& attenuation, ray& scattered)
         const override {
             vec3 reflected = reflect(rIn.direction(), rec.normal);
             reflected = unitVector(reflected) + (fuzz * randomUnitVector());
             scattered = ray(rec.p, reflected);
-            attenuation = albedo;
+            attenuation = baseColor(rec);
             return (dot(scattered.direction(), rec.normal) > 0);
     }
 
+        color baseColor(const hitRecord& rec) const override
+        {
+            return tex ? tex->value(rec) : albedo;
+        }
+
+        void fingerprint(hasher& h) const override
+        {
+            h.add("metal");
+            h.add(albedo);
+            h.add(fuzz);
+            if (tex)
+            {
+                tex->fingerprint(h);
+            }
+        }
+
     private:
         color albedo;
         double fuzz;
+        const texture* tex = nullptr;
 };
 
-class glass : public material
+class glass final : public material
 {
     public:
-        glass(double refractionIndex) : refractionIndex(refractionIndex) {}
+        glass(double refractionIndex) : material(materialKind::glass), refractionIndex(refractionIndex) {}
 
         bool scatter(const ray& rIn, const hitRecord& rec, color& attenuation, ray& scattered)
         const override {
@@ -82,6 +150,12 @@ class glass : public material
             return true;
         }
 
+        void fingerprint(hasher& h) const override
+        {
+            h.add("glass");
+            h.add(refractionIndex);
+        }
+
     private:
         double refractionIndex;
 
@@ -93,4 +167,20 @@ class glass : public material
         }
 };
 
+// Non-virtual scatter. The casts are to final classes, so each call is direct.
+inline bool scatterDirect(const material& mat, const ray& rIn, const hitRecord& rec, color& attenuation, ray& scattered)
+{
+    switch (mat.kind)
+    {
+        case materialKind::diffuse:
+            return static_cast<const diffuse&>(mat).scatter(rIn, rec, attenuation, scattered);
+        case materialKind::metal:
+            return static_cast<const metal&>(mat).scatter(rIn, rec, attenuation, scattered);
+        case materialKind::glass:
+            return static_cast<const glass&>(mat).scatter(rIn, rec, attenuation, scattered);
+        default:
+            return mat.scatter(rIn, rec, attenuation, scattered);
+    }
+}
+
 #endif
\ No newline at end of file
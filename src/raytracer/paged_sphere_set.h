@@ -0,0 +1,709 @@
+#ifndef PAGED_SPHERE_SET_H
+#define PAGED_SPHERE_SET_H
+
+#include "rtweekend.h"
+#include "epoch_reclaimer.h"
+#include "hittable.h"
+#include "sphere_set.h"
+
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// On disk: a header, then per chunk its BVH nodes followed by its spheres,
+// then the directory of chunks. Chunks are sphere_sets of at most 65536
+// spheres, built when written and read back as they are.
+namespace paged
+{
+    constexpr uint64_t magic = 0x31454741505452ull; // "RTPAGE1"
+    constexpr uint32_t version = 1;
+    constexpr size_t maxChunkSpheres = 65536;
+    constexpr size_t maxChunks = 65536;
+
+    struct fileHeader
+    {
+        uint64_t magic;
+        uint32_t version;
+        uint32_t chunkCount;
+        uint64_t sphereCount;
+        uint64_t directoryOffset;
+    };
+
+    struct chunkEntry
+    {
+        float lo[3];
+        float hi[3];
+        uint64_t offset;
+        uint32_t sphereCount;
+        uint32_t nodeCount;
+    };
+
+    // A file opened for reading at any offset from any thread: pread on
+    // POSIX, a seek and read under a lock on Windows, which has no pread.
+    class readOnlyFile
+    {
+        public:
+            readOnlyFile() = default;
+            readOnlyFile(const readOnlyFile&) = delete;
+            readOnlyFile& operator=(const readOnlyFile&) = delete;
+            ~readOnlyFile() {close();}
+
+            bool open(const std::string& filename)
+            {
+                close();
+#ifdef _WIN32
+                fd = ::_open(filename.c_str(), _O_RDONLY | _O_BINARY);
+#else
+                fd = ::open(filename.c_str(), O_RDONLY);
+#endif
+                return fd >= 0;
+            }
+
+            void close()
+            {
+                if (fd >= 0)
+                {
+#ifdef _WIN32
+                    ::_close(fd);
+#else
+                    ::close(fd);
+#endif
+                }
+                fd = -1;
+            }
+
+            // All of bytes, or false.
+            bool readAt(void* data, size_t bytes, uint64_t offset) const
+            {
+                auto p = static_cast<char*>(data);
+#ifdef _WIN32
+                std::lock_guard<std::mutex> lock(seeking);
+                if (fd < 0 || ::_lseeki64(fd, int64_t(offset), SEEK_SET) < 0)
+                {
+                    return false;
+                }
+#endif
+                while (bytes > 0)
+                {
+#ifdef _WIN32
+                    int n = ::_read(fd, p, unsigned(std::min<size_t>(bytes, size_t(1) << 30)));
+#else
+                    ssize_t n = ::pread(fd, p, bytes, off_t(offset));
+#endif
+                    if (n <= 0)
+                    {
+                        return false;
+                    }
+                    p += n;
+                    bytes -= size_t(n);
+                    offset += uint64_t(n);
+                }
+                return true;
+            }
+
+        private:
+            int fd = -1;
+#ifdef _WIN32
+            mutable std::mutex seeking;
+#endif
+    };
+}
+
+// Writes a paged sphere file a chunk at a time, so a set larger than memory
+// can be produced in pieces. Each chunk should be spatially compact, the top
+// of the tree can only separate whole chunks.
+class pagedSphereWriter
+{
+    public:
+        pagedSphereWriter() = default;
+        pagedSphereWriter(const pagedSphereWriter&) = delete;
+        pagedSphereWriter& operator=(const pagedSphereWriter&) = delete;
+
+        ~pagedSphereWriter()
+        {
+            if (file)
+            {
+                std::fclose(file);
+            }
+        }
+
+        bool open(const std::string& filename)
+        {
+            file = std::fopen(filename.c_str(), "wb");
+            if (!file)
+            {
+                std::cerr << "Fails to Write Sphere File: " << filename << std::endl;
+                return false;
+            }
+            paged::fileHeader header = {};
+            return std::fwrite(&header, sizeof(header), 1, file) == 1;
+        }
+
+        bool addChunk(std::vector<compactSphere> spheres)
+        {
+            // Hits carry the chunk and the sphere in 16 bits each.
+            if (!file || spheres.empty() || spheres.size() > paged::maxChunkSpheres || directory.size() >= paged::maxChunks)
+            {
+                return false;
+            }
+            sphere_set chunk;
+            chunk.spheres = std::move(spheres);
+            chunk.build();
+
+            paged::chunkEntry entry = {};
+            const auto& root = chunk.bvh().front();
+            std::copy(root.lo, root.lo + 3, entry.lo);
+            std::copy(root.hi, root.hi + 3, entry.hi);
+            entry.offset = uint64_t(std::ftell(file));
+            entry.sphereCount = uint32_t(chunk.spheres.size());
+            entry.nodeCount = uint32_t(chunk.bvh().size());
+            bool ok = std::fwrite(chunk.bvh().data(), sizeof(sphere_set::node), entry.nodeCount, file) == entry.nodeCount
+                   && std::fwrite(chunk.spheres.data(), sizeof(compactSphere), entry.sphereCount, file) == entry.sphereCount;
+            directory.push_back(entry);
+            sphereCount += entry.sphereCount;
+            return ok;
+        }
+
+        bool finish()
+        {
+            if (!file)
+            {
+                return false;
+            }
+            paged::fileHeader header = {paged::magic, paged::version, uint32_t(directory.size()), sphereCount, uint64_t(std::ftell(file))};
+            bool ok = std::fwrite(directory.data(), sizeof(paged::chunkEntry), directory.size(), file) == directory.size();
+            ok = std::fseek(file, 0, SEEK_SET) == 0 && std::fwrite(&header, sizeof(header), 1, file) == 1 && ok;
+            ok = std::fclose(file) == 0 && ok;
+            file = nullptr;
+            return ok;
+        }
+
+    private:
+        FILE* file = nullptr;
+        std::vector<paged::chunkEntry> directory;
+        uint64_t sphereCount = 0;
+};
+
+// A sphere set that doesn't have to fit in memory. The directory and a small
+// tree over the chunks' bounds stay resident; the chunks themselves, each a
+// sphere_set with its own BVH, are read from the file the first time a ray
+// reaches them and kept under budgetBytes, least recently used out first.
+//
+// Like textureCache, traversal doesn't lock: chunk slots are atomic pointers
+// and evicted chunks are freed by an epochReclaimer once no traversal can
+// still be inside them. A ray that needs a chunk still on disk waits on that
+// chunk's mutex, so every ray that reaches it meanwhile shares one read.
+// intersectBatch goes further and queues a whole batch of rays per chunk
+// before reading anything, the camera traces its camera rays through it a
+// row at a time.
+//
+// Materials are referenced by index, open() must get the table the file was
+// written against.
+class paged_sphere_set final : public hittable
+{
+    public:
+        explicit paged_sphere_set(size_t budgetBytes = size_t(1) << 30) : budgetBytes(budgetBytes) {}
+        paged_sphere_set(const paged_sphere_set&) = delete;
+        paged_sphere_set& operator=(const paged_sphere_set&) = delete;
+
+        ~paged_sphere_set()
+        {
+            for (size_t i = 0; i < directory.size(); i++)
+            {
+                delete slots[i].set.load(std::memory_order_relaxed);
+            }
+        }
+
+        bool open(const std::string& filename, std::vector<const material*> materialTable)
+        {
+            paged::fileHeader header = {};
+            if (!file.open(filename) || !file.readAt(&header, sizeof(header), 0)
+                || header.magic != paged::magic || header.version != paged::version)
+            {
+                std::cerr << "Fails to Open Sphere File: " << filename << std::endl;
+                return false;
+            }
+            directory.resize(header.chunkCount);
+            size_t bytes = directory.size() * sizeof(paged::chunkEntry);
+            if (!file.readAt(directory.data(), bytes, header.directoryOffset))
+            {
+                std::cerr << "Fails to Read Sphere File Directory: " << filename << std::endl;
+                directory.clear();
+                return false;
+            }
+            path = filename;
+            sphereCount = header.sphereCount;
+            materials = std::move(materialTable);
+            slots = std::make_unique<chunkSlot[]>(directory.size());
+            buildTop();
+            return true;
+        }
+
+        size_t size() const {return size_t(sphereCount);}
+        size_t chunkCount() const {return directory.size();}
+        size_t bytesResident() const {return residentBytes.load(std::memory_order_relaxed);}
+
+        // What stays in memory for good, plus the chunks resident right now.
+        size_t bytesUsed() const
+        {
+            return directory.capacity() * sizeof(paged::chunkEntry) + top.capacity() * sizeof(topNode)
+                 + directory.size() * sizeof(chunkSlot) + bytesResident();
+        }
+
+        std::string describe() const
+        {
+            std::ostringstream out;
+            out << "spheres=" << sphereCount << " chunks=" << directory.size()
+                << " resident=" << bytesResident() << "/" << budgetBytes
+                << " loads=" << loads.load() << " evictions=" << evictions.load()
+                << " pendingFree=" << reclaimer.pending();
+            return out.str();
+        }
+
+        bool intersect(const ray& r, interval rayT, hitCandidate& candidate) const override
+        {
+            if (top.empty())
+            {
+                return false;
+            }
+            typename epochReclaimer<sphere_set>::guard reading(reclaimer);
+            bool hitAnything = false;
+            double closest = rayT.max;
+            forChunks(r, rayT.min, [&](uint32_t chunk, double){
+                hitCandidate local;
+                if (resident(chunk)->intersect(r, interval(rayT.min, closest), local))
+                {
+                    hitAnything = true;
+                    closest = local.t;
+                    candidate.primitive = encode(chunk, local.primitive);
+                }
+                return closest;
+            }, closest);
+
+            if (hitAnything)
+            {
+                candidate.t = closest;
+                candidate.object = this;
+            }
+            return hitAnything;
+        }
+
+        // The chunk may have been evicted since intersect(), then it is read again.
+        void finalize(const ray& r, const hitCandidate& candidate, hitRecord& rec) const override
+        {
+            typename epochReclaimer<sphere_set>::guard reading(reclaimer);
+            const sphere_set* set = resident(candidate.primitive >> 16);
+            set->finalize(r, {candidate.t, set, candidate.primitive & 0xffff}, rec);
+        }
+
+        bool hit(const ray& r, interval rayT, hitRecord& rec) const override
+        {
+            hitCandidate candidate;
+            if (!intersect(r, rayT, candidate))
+            {
+                return false;
+            }
+            finalize(r, candidate, rec);
+            return true;
+        }
+
+        bool occluded(const ray& r, interval rayT) const override
+        {
+            if (top.empty())
+            {
+                return false;
+            }
+            typename epochReclaimer<sphere_set>::guard reading(reclaimer);
+            bool blocked = false;
+            forChunks(r, rayT.min, [&](uint32_t chunk, double){
+                blocked = resident(chunk)->occluded(r, rayT);
+                // Ends the walk once blocked.
+                return blocked ? -infinity : rayT.max;
+            }, rayT.max);
+            return blocked;
+        }
+
+        // Closest hits for count rays, ray i within rayT[i]. out[i] is only
+        // written where ray i hits. Every ray first runs through the resident
+        // top of the tree only, listing the chunks it reaches near to far.
+        // Then the rays go through their lists in waves: each wave takes every
+        // ray's next chunk, unless a hit already ended the ray, and traces
+        // them a chunk at a time in file order, so each chunk a wave needs is
+        // read once for all of its rays.
+        void intersectBatch(const ray* rays, size_t count, const interval* rayT, hitCandidate* out) const
+        {
+            struct reach
+            {
+                double entry;
+                uint32_t chunk;
+            };
+            std::vector<reach> reached;
+            // Ray i's chunks are reached[first[i], first[i + 1]).
+            std::vector<size_t> first(count + 1);
+            std::vector<double> closest(count);
+            for (size_t i = 0; i < count; i++)
+            {
+                first[i] = reached.size();
+                closest[i] = rayT[i].max;
+                forChunks(rays[i], rayT[i].min, [&](uint32_t chunk, double entry){
+                    reached.push_back({entry, chunk});
+                    return rayT[i].max;
+                }, rayT[i].max);
+                std::sort(reached.begin() + first[i], reached.end(), [](const reach& a, const reach& b){
+                    return a.entry < b.entry;
+                });
+            }
+            first[count] = reached.size();
+
+            std::vector<size_t> next(first.begin(), first.end() - 1);
+            std::vector<std::pair<uint32_t, uint32_t>> wave;
+            while (true)
+            {
+                wave.clear();
+                for (size_t i = 0; i < count; i++)
+                {
+                    // The rest of the list starts beyond the hit, the ray is done.
+                    if (next[i] < first[i + 1] && reached[next[i]].entry < closest[i])
+                    {
+                        wave.emplace_back(reached[next[i]].chunk, uint32_t(i));
+                        next[i]++;
+                    }
+                }
+                if (wave.empty())
+                {
+                    return;
+                }
+                std::sort(wave.begin(), wave.end());
+
+                for (size_t begin = 0; begin < wave.size(); )
+                {
+                    uint32_t chunk = wave[begin].first;
+                    // One guard per chunk, so a big batch doesn't pin everything it read.
+                    typename epochReclaimer<sphere_set>::guard reading(reclaimer);
+                    const sphere_set* set = resident(chunk);
+                    size_t end = begin;
+                    for (; end < wave.size() && wave[end].first == chunk; end++)
+                    {
+                        uint32_t i = wave[end].second;
+                        hitCandidate local;
+                        if (set->intersect(rays[i], interval(rayT[i].min, closest[i]), local))
+                        {
+                            closest[i] = local.t;
+                            out[i] = {local.t, this, encode(chunk, local.primitive)};
+                        }
+                    }
+                    begin = end;
+                }
+            }
+        }
+
+        // The file's path and directory stand for its contents, reading every
+        // chunk just to hash it would defeat the point.
+        void fingerprint(hasher& h) const override
+        {
+            h.add("paged_sphere_set");
+            h.add(path);
+            h.add(sphereCount);
+            h.add(directory.data(), directory.size() * sizeof(paged::chunkEntry));
+            h.add(materials.size());
+            for (auto mat : materials)
+            {
+                mat->fingerprint(h);
+            }
+        }
+
+    private:
+        struct chunkSlot
+        {
+            std::atomic<sphere_set*> set{nullptr};
+            std::atomic<uint32_t> lastUse{0};
+            std::mutex loading;
+        };
+
+        // Leaves hold one chunk, interior nodes have their first child next.
+        struct topNode
+        {
+            float lo[3];
+            float hi[3];
+            uint32_t index;
+            uint32_t isLeaf;
+        };
+
+        struct residentChunk
+        {
+            uint32_t chunk;
+            uint32_t lastUse;
+        };
+
+        std::string path;
+        paged::readOnlyFile file;
+        uint64_t sphereCount = 0;
+        size_t budgetBytes;
+        std::vector<const material*> materials;
+        std::vector<paged::chunkEntry> directory;
+        std::vector<topNode> top;
+        std::unique_ptr<chunkSlot[]> slots;
+
+        mutable std::atomic<size_t> residentBytes{0};
+        mutable std::atomic<uint32_t> useClock{1};
+        mutable std::atomic<uint64_t> loads{0};
+        mutable std::atomic<uint64_t> evictions{0};
+        mutable std::mutex residentMutex;
+        mutable std::vector<residentChunk> residentChunks;
+        mutable epochReclaimer<sphere_set> reclaimer;
+
+        static uint32_t encode(uint32_t chunk, uint32_t primitive)
+        {
+            return (chunk << 16) | primitive;
+        }
+
+        static size_t chunkBytes(const sphere_set& set)
+        {
+            return sizeof(sphere_set) + set.bytesUsed();
+        }
+
+        void buildTop()
+        {
+            top.clear();
+            std::vector<uint32_t> order(directory.size());
+            for (uint32_t i = 0; i < order.size(); i++)
+            {
+                order[i] = i;
+            }
+            if (!order.empty())
+            {
+                buildTopNode(order, 0, order.size());
+            }
+        }
+
+        size_t buildTopNode(std::vector<uint32_t>& order, size_t first, size_t count)
+        {
+            size_t index = top.size();
+            top.push_back({});
+            if (count == 1)
+            {
+                const auto& entry = directory[order[first]];
+                std::copy(entry.lo, entry.lo + 3, top[index].lo);
+                std::copy(entry.hi, entry.hi + 3, top[index].hi);
+                top[index].index = order[first];
+                top[index].isLeaf = 1;
+                return index;
+            }
+
+            auto center = [&](uint32_t chunk, int a){
+                return directory[chunk].lo[a] + directory[chunk].hi[a];
+            };
+            float lo[3] = {infinityF, infinityF, infinityF}, hi[3] = {-infinityF, -infinityF, -infinityF};
+            for (size_t i = first; i < first + count; i++)
+            {
+                for (int a = 0; a < 3; a++)
+                {
+                    lo[a] = std::fmin(lo[a], center(order[i], a));
+                    hi[a] = std::fmax(hi[a], center(order[i], a));
+                }
+            }
+            int axis = 0;
+            for (int a = 1; a < 3; a++)
+            {
+                if (hi[a] - lo[a] > hi[axis] - lo[axis])
+                {
+                    axis = a;
+                }
+            }
+            size_t leftCount = count / 2;
+            auto begin = order.begin() + first;
+            std::nth_element(begin, begin + leftCount, begin + count, [&](uint32_t x, uint32_t y){
+                return center(x, axis) < center(y, axis);
+            });
+
+            size_t left = buildTopNode(order, first, leftCount);
+            size_t right = buildTopNode(order, first + leftCount, count - leftCount);
+            topNode& n = top[index];
+            for (int a = 0; a < 3; a++)
+            {
+                n.lo[a] = std::fmin(top[left].lo[a], top[right].lo[a]);
+                n.hi[a] = std::fmax(top[left].hi[a], top[right].hi[a]);
+            }
+            n.index = uint32_t(right);
+            n.isLeaf = 0;
+            return index;
+        }
+
+        // Calls visit(chunk, entry) for every chunk whose bounds r enters, at
+        // entry, before closest, nearest side first. visit returns the new
+        // closest.
+        template <typename Visit>
+        void forChunks(const ray& r, double tMin, Visit&& visit, double closest) const
+        {
+            double origin[3], inverse[3];
+            for (int a = 0; a < 3; a++)
+            {
+                origin[a] = r.origin()[a];
+                inverse[a] = 1.0 / r.direction()[a];
+            }
+            auto overlaps = [&](const topNode& n, double tFar){
+                double tNear = tMin;
+                for (int a = 0; a < 3; a++)
+                {
+                    double t0 = (n.lo[a] - origin[a]) * inverse[a];
+                    double t1 = (n.hi[a] - origin[a]) * inverse[a];
+                    tNear = maxNumber(tNear, minNumber(t0, t1));
+                    tFar = minNumber(tFar, maxNumber(t0, t1));
+                }
+                return tNear <= tFar ? tNear : infinity;
+            };
+
+            uint32_t stack[64];
+            int depth = 0;
+            stack[depth++] = 0;
+            while (depth > 0)
+            {
+                const topNode& n = top[stack[--depth]];
+                double entry = overlaps(n, closest);
+                if (entry == infinity)
+                {
+                    continue;
+                }
+                if (n.isLeaf)
+                {
+                    closest = visit(n.index, entry);
+                    if (closest < tMin)
+                    {
+                        return;
+                    }
+                    continue;
+                }
+                uint32_t first = uint32_t(&n - top.data()) + 1;
+                uint32_t second = n.index;
+                const topNode& a = top[first];
+                const topNode& b = top[second];
+                // Visit the child whose center is nearer along the ray first.
+                double along = 0, alongB = 0;
+                for (int c = 0; c < 3; c++)
+                {
+                    along += (a.lo[c] + a.hi[c]) * r.direction()[c];
+                    alongB += (b.lo[c] + b.hi[c]) * r.direction()[c];
+                }
+                if (along > alongB)
+                {
+                    std::swap(first, second);
+                }
+                stack[depth++] = second;
+                stack[depth++] = first;
+            }
+        }
+
+        // Inside the caller's guard, which keeps the returned set alive.
+        const sphere_set* resident(uint32_t chunk) const
+        {
+            chunkSlot& slot = slots[chunk];
+            sphere_set* set = slot.set.load(std::memory_order_acquire);
+            if (!set)
+            {
+                set = load(chunk);
+            }
+            uint32_t now = useClock.load(std::memory_order_relaxed);
+            if (slot.lastUse.load(std::memory_order_relaxed) != now)
+            {
+                slot.lastUse.store(now, std::memory_order_relaxed);
+            }
+            return set;
+        }
+
+        sphere_set* load(uint32_t chunk) const
+        {
+            chunkSlot& slot = slots[chunk];
+            sphere_set* set = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(slot.loading);
+                set = slot.set.load(std::memory_order_acquire);
+                if (set)
+                {
+                    return set;
+                }
+
+                const auto& entry = directory[chunk];
+                std::vector<sphere_set::node> nodes(entry.nodeCount);
+                set = new sphere_set();
+                set->spheres.resize(entry.sphereCount);
+                set->materials = materials;
+                size_t nodeBytes = nodes.size() * sizeof(sphere_set::node);
+                size_t sphereBytes = set->spheres.size() * sizeof(compactSphere);
+                if (!file.readAt(nodes.data(), nodeBytes, entry.offset)
+                    || !file.readAt(set->spheres.data(), sphereBytes, entry.offset + nodeBytes))
+                {
+                    // Rendering on without the chunk would silently drop geometry.
+                    std::cerr << "Fails to Read Sphere Chunk " << chunk << " of " << path << std::endl;
+                    std::abort();
+                }
+                set->restore(std::move(nodes));
+                slot.lastUse.store(useClock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                slot.set.store(set, std::memory_order_release);
+            }
+
+            loads.fetch_add(1, std::memory_order_relaxed);
+            residentBytes.fetch_add(chunkBytes(*set), std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> lock(residentMutex);
+                residentChunks.push_back({chunk, 0});
+            }
+            if (residentBytes.load(std::memory_order_relaxed) > budgetBytes)
+            {
+                evict(chunk);
+            }
+            return set;
+        }
+
+        // Drops least recently used chunks down to 90% of the budget, never keep.
+        void evict(uint32_t keep) const
+        {
+            std::lock_guard<std::mutex> lock(residentMutex);
+            if (residentBytes.load(std::memory_order_relaxed) <= budgetBytes)
+            {
+                return;
+            }
+            for (auto& entry : residentChunks)
+            {
+                entry.lastUse = slots[entry.chunk].lastUse.load(std::memory_order_relaxed);
+            }
+            std::sort(residentChunks.begin(), residentChunks.end(), [](const residentChunk& a, const residentChunk& b){
+                return a.lastUse < b.lastUse;
+            });
+
+            size_t target = budgetBytes / 10 * 9;
+            size_t kept = 0;
+            for (auto& entry : residentChunks)
+            {
+                if (residentBytes.load(std::memory_order_relaxed) <= target || entry.chunk == keep)
+                {
+                    residentChunks[kept++] = entry;
+                    continue;
+                }
+                // Under the chunk's own mutex so a concurrent load() of it can't interleave.
+                std::lock_guard<std::mutex> loading(slots[entry.chunk].loading);
+                sphere_set* set = slots[entry.chunk].set.exchange(nullptr, std::memory_order_seq_cst);
+                residentBytes.fetch_sub(chunkBytes(*set), std::memory_order_relaxed);
+                reclaimer.retire(set);
+                evictions.fetch_add(1, std::memory_order_relaxed);
+            }
+            residentChunks.resize(kept);
+        }
+
+        static constexpr float infinityF = std::numeric_limits<float>::infinity();
+};
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef PATH_GUIDE_H
+#define PATH_GUIDE_H
+
+#include "rtweekend.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Path guiding: learns where light arrives from at diffuse surfaces and
+// samples bounces towards it, instead of only by the cosine.
+//
+// Space is a hash grid of cells, like the irradiance cache's. Each cell keeps
+// a histogram over the sphere of directions, binned by cos(theta) and phi
+// around world y, which makes every bin the same solid angle. Render threads
+// record(): the luminance a bounce brought back, over the pdf it was sampled
+// with, added to its bin. The sums are fixed point integers, so they come out
+// the same whatever order the threads add in, and a guided render is as
+// reproducible as any other.
+//
+// Between passes, with no thread rendering, refresh() turns the sums into
+// the tables sample() and pdf() read. Only cells that have seen enough
+// bounces get one, the others return nullptr from find() and the caller
+// falls back to its BSDF. Cells sharing a hash slot share a histogram, which
+// costs efficiency but not correctness: pdf() always describes what sample()
+// does.
+class pathGuide
+{
+    public:
+        static constexpr int thetaBins = 8;
+        static constexpr int phiBins = 16;
+        static constexpr int bins = thetaBins * phiBins;
+        // Bounces a cell must have seen before it is used.
+        static constexpr uint32_t minRecords = 2 * bins;
+
+        struct distribution
+        {
+            // cdf[i] is the probability of bins [0, i].
+            float cdf[bins];
+        };
+
+        explicit pathGuide(double cellSize = 0.5, size_t cellCount = size_t(1) << 13)
+            : cellSize(cellSize), mask(roundUpToPowerOfTwo(cellCount) - 1),
+              sums(new std::atomic<uint64_t>[(mask + 1) * bins]), records(new std::atomic<uint32_t>[mask + 1]),
+              tables(mask + 1), ready(mask + 1, 0)
+        {
+            for (size_t i = 0; i < (mask + 1) * bins; i++)
+            {
+                sums[i].store(0, std::memory_order_relaxed);
+            }
+            for (size_t i = 0; i <= mask; i++)
+            {
+                records[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        // The learned distribution around p, if there is one yet.
+        const distribution* find(const point3& p) const
+        {
+            size_t slot = slotOf(p);
+            return ready[slot] ? &tables[slot] : nullptr;
+        }
+
+        // Thread safe. direction must be a unit vector.
+        void record(const point3& p, const vec3& direction, double weight)
+        {
+            if (!(weight > 0))
+            {
+                weight = 0;
+            }
+            size_t slot = slotOf(p);
+            uint64_t fixed = uint64_t(std::fmin(weight, maxWeight) * fixedScale);
+            sums[slot * bins + binOf(direction)].fetch_add(fixed, std::memory_order_relaxed);
+            records[slot].fetch_add(1, std::memory_order_relaxed);
+        }
+
+        // Everything recorded so far, including earlier passes, goes into the
+        // new tables. Not thread safe against record() or find().
+        void refresh()
+        {
+            for (size_t slot = 0; slot <= mask; slot++)
+            {
+                if (records[slot].load(std::memory_order_relaxed) < minRecords)
+                {
+                    continue;
+                }
+                uint64_t total = 0;
+                for (int b = 0; b < bins; b++)
+                {
+                    total += sums[slot * bins + b].load(std::memory_order_relaxed);
+                }
+                if (total == 0)
+                {
+                    continue;
+                }
+                distribution& d = tables[slot];
+                uint64_t running = 0;
+                for (int b = 0; b < bins; b++)
+                {
+                    running += sums[slot * bins + b].load(std::memory_order_relaxed);
+                    d.cdf[b] = float(double(running) / total);
+                }
+                d.cdf[bins - 1] = 1;
+                ready[slot] = 1;
+            }
+        }
+
+        // A unit direction from d, for three uniform numbers.
+        static vec3 sample(const distribution& d, double u, double v, double w)
+        {
+            // The first bin whose cdf is above u, never an empty one: its cdf
+            // equals the one before. u < 1 = cdf[bins - 1], so there is one.
+            int b = int(std::upper_bound(d.cdf, d.cdf + bins, u, [](double x, float c){ return x < c; }) - d.cdf);
+            int t = b / phiBins;
+            int p = b % phiBins;
+            double cosTheta = -1 + 2 * (t + v) / thetaBins;
+            double phi = 2 * pi * (p + w) / phiBins;
+            double sinTheta = std::sqrt(std::fmax(0.0, 1 - cosTheta * cosTheta));
+            return vec3(sinTheta * std::cos(phi), cosTheta, sinTheta * std::sin(phi));
+        }
+
+        // Solid angle density of sample(), direction a unit vector.
+        static double pdf(const distribution& d, const vec3& direction)
+        {
+            int b = binOf(direction);
+            double p = double(d.cdf[b]) - (b > 0 ? double(d.cdf[b - 1]) : 0.0);
+            return p * bins / (4 * pi);
+        }
+
+    private:
+        // A bounce that returns more than this is clamped, one firefly
+        // shouldn't take over a cell's histogram.
+        static constexpr double maxWeight = 1 << 12;
+        static constexpr double fixedScale = 1 << 16;
+
+        double cellSize;
+        size_t mask;
+        std::unique_ptr<std::atomic<uint64_t>[]> sums;
+        std::unique_ptr<std::atomic<uint32_t>[]> records;
+        std::vector<distribution> tables;
+        std::vector<uint8_t> ready;
+
+        static size_t roundUpToPowerOfTwo(size_t n)
+        {
+            size_t p = 1;
+            while (p < n)
+            {
+                p <<= 1;
+            }
+            return p;
+        }
+
+        size_t slotOf(const point3& p) const
+        {
+            uint64_t x = uint64_t(int64_t(std::floor(p.x() / cellSize)));
+            uint64_t y = uint64_t(int64_t(std::floor(p.y() / cellSize)));
+            uint64_t z = uint64_t(int64_t(std::floor(p.z() / cellSize)));
+            return size_t(mixBits(x * 73856093u ^ y * 19349663u ^ z * 83492791u)) & mask;
+        }
+
+        static int binOf(const vec3& direction)
+        {
+            int t = int((direction.y() + 1) * 0.5 * thetaBins);
+            double phi = std::atan2(direction.z(), direction.x());
+            if (phi < 0)
+            {
+                phi += 2 * pi;
+            }
+            int p = int(phi / (2 * pi) * phiBins);
+            return std::clamp(t, 0, thetaBins - 1) * phiBins + std::clamp(p, 0, phiBins - 1);
+        }
+};
+
+#endif
@@ -0,0 +1,608 @@
+#ifndef PREVIEW_STREAM_H
+#define PREVIEW_STREAM_H
+
+#include "framebuffer.h"
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Live preview of a render in progress through POSIX shared memory, or
+// through plain memory when the reader is in the same process.
+//
+// The segment is a header followed by a ring of slots. Each slot holds a whole
+// frame of averaged float planes, a sequence number used as a seqlock (odd
+// while the publisher writes it) and a bitmap of the tiles that changed since
+// the previous frame. Readers map it read-only and look at the newest slot in
+// place; the publisher won't come back to that slot for slotCount - 1 frames,
+// so a reader almost never has to retry.
+//
+// Only the publisher thread touches the segment. Render threads just mark
+// tiles dirty, which is one atomic or per tile.
+
+namespace preview
+{
+    static constexpr uint64_t magic = 0x5745495645525052ull; // "RPREVIEW"
+    static constexpr uint32_t version = 1;
+    static constexpr size_t alignment = 64;
+
+    inline size_t alignUp(size_t bytes) {return (bytes + alignment - 1) / alignment * alignment;}
+
+    // Index of the lowest set bit, bits must not be zero.
+    inline uint32_t lowestBit(uint64_t bits)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward64(&index, bits);
+        return uint32_t(index);
+#elif defined(__GNUC__)
+        return uint32_t(__builtin_ctzll(bits));
+#else
+        uint32_t index = 0;
+        while (!(bits & 1))
+        {
+            bits >>= 1;
+            index++;
+        }
+        return index;
+#endif
+    }
+
+    struct header
+    {
+        uint64_t magic;
+        uint32_t version;
+        int32_t width;
+        int32_t height;
+        int32_t tileSize;
+        int32_t tilesX;
+        int32_t tilesY;
+        uint32_t slotCount;
+        uint32_t bitmapWords;
+        uint64_t slotBytes;
+        uint64_t firstSlot;
+        // Frames published so far, the newest is in slot (published - 1) % slotCount.
+        std::atomic<uint64_t> published;
+        // Set once the render has finished and the last frame is out.
+        std::atomic<uint32_t> finished;
+    };
+
+    // Followed by the dirty bitmap, then the r, g and b planes, each aligned.
+    struct slotHeader
+    {
+        std::atomic<uint64_t> sequence;
+        uint64_t frame;
+        // Samples per pixel over the tiles refreshed in this frame; min is 0
+        // while any tile hasn't been rendered yet.
+        uint32_t minSamples;
+        uint32_t maxSamples;
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "preview needs address free atomics");
+
+    struct layout
+    {
+        size_t bitmapOffset, planeOffset, planeBytes, slotBytes, firstSlot, totalBytes;
+
+        layout(int width, int height, uint32_t bitmapWords, uint32_t slotCount)
+        {
+            bitmapOffset = alignUp(sizeof(slotHeader));
+            planeOffset = alignUp(bitmapOffset + bitmapWords * sizeof(uint64_t));
+            planeBytes = alignUp(size_t(width) * height * sizeof(float));
+            slotBytes = planeOffset + 3 * planeBytes;
+            firstSlot = alignUp(sizeof(header));
+            totalBytes = firstSlot + slotBytes * slotCount;
+        }
+    };
+}
+
+// What a reader sees of one frame. Pointers go straight into the mapping.
+struct previewView
+{
+    int width, height, tileSize, tilesX, tilesY;
+    uint64_t frame;
+    uint32_t minSamples, maxSamples;
+    const uint64_t* dirty;
+    const float* r;
+    const float* g;
+    const float* b;
+
+    bool tileDirty(int tile) const {return (dirty[tile / 64] >> (tile % 64)) & 1;}
+};
+
+class previewPublisher
+{
+    public:
+        int tileSize = 32;
+        uint32_t slotCount = 3;
+        std::chrono::milliseconds interval{100};
+        // Pixels without samples show the nearest coarse sample above and to
+        // the left of them on a 4 then 16 pixel grid, see camera::progressiveRender.
+        bool fillFromCoarse = false;
+
+        previewPublisher() {}
+        previewPublisher(const previewPublisher&) = delete;
+        previewPublisher& operator=(const previewPublisher&) = delete;
+        ~previewPublisher() {close();}
+
+        // Creates the segment, name like "/raytracer-preview". An older segment of
+        // the same name is unlinked first, so readers still mapping it never see
+        // it resized underneath them.
+        bool open(const std::string& segmentName, int w, int h)
+        {
+#ifdef __linux__
+            close();
+            preview::layout sizes = resize(w, h);
+
+            shm_unlink(segmentName.c_str());
+            int fd = shm_open(segmentName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+            if (fd < 0 || ftruncate(fd, off_t(sizes.totalBytes)) != 0)
+            {
+                std::cerr << "Fails to Open Preview: " << segmentName << std::endl;
+                if (fd >= 0) ::close(fd);
+                return false;
+            }
+            void* mapping = mmap(nullptr, sizes.totalBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (mapping == MAP_FAILED)
+            {
+                std::cerr << "Fails to Map Preview: " << segmentName << std::endl;
+                return false;
+            }
+            base = static_cast<uint8_t*>(mapping);
+            mappedBytes = sizes.totalBytes;
+            name = segmentName;
+            initialize(sizes);
+            return true;
+#else
+            std::cerr << "Preview streaming needs POSIX shared memory" << std::endl;
+            return false;
+#endif
+        }
+
+        // Same segment in memory of this process, for a reader in this process
+        // (previewReader::attach). Needs no shared memory, so works everywhere.
+        bool openLocal(int w, int h)
+        {
+            close();
+            preview::layout sizes = resize(w, h);
+            base = static_cast<uint8_t*>(::operator new(sizes.totalBytes, std::align_val_t(preview::alignment)));
+            std::memset(base, 0, sizes.totalBytes);
+            mappedBytes = sizes.totalBytes;
+            local = true;
+            name.clear();
+            initialize(sizes);
+            return true;
+        }
+
+        void close()
+        {
+            stop();
+            ready.store(nullptr, std::memory_order_release);
+            if (base && local)
+            {
+                ::operator delete(base, std::align_val_t(preview::alignment));
+            }
+#ifdef __linux__
+            else if (base)
+            {
+                munmap(base, mappedBytes);
+            }
+#endif
+            base = nullptr;
+            local = false;
+        }
+
+        // Removes the name; readers that mapped it keep their view.
+        void unlink()
+        {
+#ifdef __linux__
+            if (!name.empty())
+            {
+                shm_unlink(name.c_str());
+            }
+#endif
+        }
+
+        bool isOpen() const {return base != nullptr;}
+
+        // The segment once it is set up, for previewReader::attach from any
+        // thread; null before that and after close().
+        const uint8_t* segment() const {return ready.load(std::memory_order_acquire);}
+
+        // Called by render threads once pixels in the rectangle are written.
+        void markDirty(int x0, int y0, int x1, int y1)
+        {
+            if (!base)
+            {
+                return;
+            }
+            for (int ty = y0 / tileSize; ty <= (y1 - 1) / tileSize; ty++)
+            {
+                for (int tx = x0 / tileSize; tx <= (x1 - 1) / tileSize; tx++)
+                {
+                    int tile = ty * tilesX + tx;
+                    dirtyTiles[tile / 64].fetch_or(uint64_t(1) << (tile % 64), std::memory_order_release);
+                }
+            }
+        }
+
+        void markRows(int firstRow, int lastRow) {markDirty(0, firstRow, width, lastRow);}
+
+        // Publishes from a background thread every interval until stop().
+        void start(const framebuffer& source)
+        {
+            if (!base)
+            {
+                return;
+            }
+            stopping = false;
+            requested = false;
+            worker = std::thread([this, &source]{
+                std::unique_lock<std::mutex> lock(wakeMutex);
+                while (!stopping)
+                {
+                    wake.wait_for(lock, interval, [this]{return stopping || requested;});
+                    requested = false;
+                    publish(source);
+                }
+            });
+        }
+
+        // Publishes without waiting out the interval, e.g. when a pass is done.
+        void publishSoon()
+        {
+            if (!worker.joinable())
+            {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(wakeMutex);
+                requested = true;
+            }
+            wake.notify_one();
+        }
+
+        // Final frame goes out after the render threads are done with source.
+        void stop()
+        {
+            if (!worker.joinable())
+            {
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> lock(wakeMutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            worker.join();
+        }
+
+        void finish(const framebuffer& source)
+        {
+            stop();
+            if (!base)
+            {
+                return;
+            }
+            publish(source);
+            header()->finished.store(1, std::memory_order_release);
+        }
+
+        // Resolves the tiles that changed since this slot was last written.
+        // Tiles nothing has been rendered into yet stay black (the segment
+        // starts zero filled), their memory may not even be cleared yet.
+        // Pixels of a tile still being rendered may be caught mid pass, which
+        // for a preview only means they show up a frame later.
+        void publish(const framebuffer& source)
+        {
+            TRACE_ZONE("preview publish");
+            auto head = header();
+            uint64_t frame = head->published.load(std::memory_order_relaxed) + 1;
+
+            bool anyDirty = false;
+            for (uint32_t word = 0; word < bitmapWords; word++)
+            {
+                uint64_t bits = dirtyTiles[word].exchange(0, std::memory_order_acquire);
+                anyDirty |= bits != 0;
+                while (bits)
+                {
+                    tileVersion[word * 64 + preview::lowestBit(bits)] = frame;
+                    bits &= bits - 1;
+                }
+            }
+            if (!anyDirty)
+            {
+                return;
+            }
+
+            uint32_t s = uint32_t((frame - 1) % slotCount);
+            auto target = slot(s);
+            preview::layout sizes = layoutFor();
+            uint8_t* slotBase = reinterpret_cast<uint8_t*>(target);
+            uint64_t* bitmap = reinterpret_cast<uint64_t*>(slotBase + sizes.bitmapOffset);
+            float* planes[3];
+            for (int c = 0; c < 3; c++)
+            {
+                planes[c] = reinterpret_cast<float*>(slotBase + sizes.planeOffset + c * sizes.planeBytes);
+            }
+            uint32_t minSamples = UINT32_MAX, maxSamples = 0;
+
+            uint64_t sequence = target->sequence.load(std::memory_order_relaxed);
+            target->sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            std::memset(bitmap, 0, bitmapWords * sizeof(uint64_t));
+            for (int tile = 0; tile < tilesX * tilesY; tile++)
+            {
+                if (tileVersion[tile] == frame)
+                {
+                    bitmap[tile / 64] |= uint64_t(1) << (tile % 64);
+                }
+                if (tileVersion[tile] > slotFrame[s])
+                {
+                    resolveTile(source, tile, planes, minSamples, maxSamples);
+                }
+                if (tileVersion[tile] == 0)
+                {
+                    minSamples = 0;
+                }
+            }
+            target->frame = frame;
+            target->minSamples = minSamples == UINT32_MAX ? 0 : minSamples;
+            target->maxSamples = maxSamples;
+            slotFrame[s] = frame;
+
+            target->sequence.store(sequence + 2, std::memory_order_release);
+            head->published.store(frame, std::memory_order_release);
+        }
+
+    private:
+        uint8_t* base = nullptr;
+        size_t mappedBytes = 0;
+        // Allocated by openLocal rather than mapped.
+        bool local = false;
+        std::atomic<const uint8_t*> ready{nullptr};
+        std::string name;
+        int width = 0, height = 0, tilesX = 0, tilesY = 0;
+        uint32_t bitmapWords = 0;
+
+        std::vector<std::atomic<uint64_t>> dirtyTiles;
+        // Publisher only: frame each tile last changed in, and frame each slot holds.
+        std::vector<uint64_t> tileVersion;
+        std::vector<uint64_t> slotFrame;
+
+        std::thread worker;
+        std::mutex wakeMutex;
+        std::condition_variable wake;
+        bool stopping = false;
+        bool requested = false;
+
+        preview::header* header() const {return reinterpret_cast<preview::header*>(base);}
+        preview::layout layoutFor() const {return preview::layout(width, height, bitmapWords, slotCount);}
+
+        preview::layout resize(int w, int h)
+        {
+            width = w;
+            height = h;
+            tilesX = (width + tileSize - 1) / tileSize;
+            tilesY = (height + tileSize - 1) / tileSize;
+            bitmapWords = uint32_t((tilesX * tilesY + 63) / 64);
+            return layoutFor();
+        }
+
+        void initialize(const preview::layout& sizes)
+        {
+            // Readers check magic, which is written last.
+            auto head = header();
+            head->version = preview::version;
+            head->width = width;
+            head->height = height;
+            head->tileSize = tileSize;
+            head->tilesX = tilesX;
+            head->tilesY = tilesY;
+            head->slotCount = slotCount;
+            head->bitmapWords = bitmapWords;
+            head->slotBytes = sizes.slotBytes;
+            head->firstSlot = sizes.firstSlot;
+            head->published.store(0, std::memory_order_relaxed);
+            head->finished.store(0, std::memory_order_relaxed);
+            for (uint32_t s = 0; s < slotCount; s++)
+            {
+                slot(s)->sequence.store(0, std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_release);
+            head->magic = preview::magic;
+
+            dirtyTiles = std::vector<std::atomic<uint64_t>>(bitmapWords);
+            tileVersion.assign(size_t(tilesX) * tilesY, 0);
+            slotFrame.assign(slotCount, 0);
+            ready.store(base, std::memory_order_release);
+        }
+
+        preview::slotHeader* slot(uint32_t s) const
+        {
+            preview::layout sizes = layoutFor();
+            return reinterpret_cast<preview::slotHeader*>(base + sizes.firstSlot + s * sizes.slotBytes);
+        }
+
+        // The 4 pixel grid first, then the 16 pixel one.
+        size_t coarseSource(const framebuffer& source, int x, int y) const
+        {
+            for (int mask : {~3, ~15})
+            {
+                size_t i = size_t(y & mask) * width + (x & mask);
+                if (source.samples[i] > 0)
+                {
+                    return i;
+                }
+            }
+            return size_t(y) * width + x;
+        }
+
+        void resolveTile(const framebuffer& source, int tile, float* planes[3], uint32_t& minSamples, uint32_t& maxSamples) const
+        {
+            int x0 = (tile % tilesX) * tileSize;
+            int y0 = (tile / tilesX) * tileSize;
+            int x1 = std::min(x0 + tileSize, width);
+            int y1 = std::min(y0 + tileSize, height);
+            for (int y = y0; y < y1; y++)
+            {
+                for (int x = x0; x < x1; x++)
+                {
+                    size_t i = size_t(y) * width + x;
+                    uint32_t count = source.samples[i];
+                    size_t from = count > 0 || !fillFromCoarse ? i : coarseSource(source, x, y);
+                    uint32_t fromCount = source.samples[from];
+                    float scale = fromCount > 0 ? 1.0f / fromCount : 0.0f;
+                    planes[0][i] = source.sumR[from] * scale;
+                    planes[1][i] = source.sumG[from] * scale;
+                    planes[2][i] = source.sumB[from] * scale;
+                    minSamples = std::min(minSamples, count);
+                    maxSamples = std::max(maxSamples, count);
+                }
+            }
+        }
+};
+
+// Read-only side, for the GUI or any other process.
+class previewReader
+{
+    public:
+        previewReader() {}
+        previewReader(const previewReader&) = delete;
+        previewReader& operator=(const previewReader&) = delete;
+        ~previewReader() {close();}
+
+        bool open(const std::string& segmentName)
+        {
+#ifdef __linux__
+            close();
+            int fd = shm_open(segmentName.c_str(), O_RDONLY, 0);
+            if (fd < 0)
+            {
+                return false;
+            }
+            struct stat info;
+            if (fstat(fd, &info) != 0 || size_t(info.st_size) < sizeof(preview::header))
+            {
+                ::close(fd);
+                return false;
+            }
+            void* mapping = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (mapping == MAP_FAILED)
+            {
+                return false;
+            }
+            base = static_cast<const uint8_t*>(mapping);
+            mappedBytes = size_t(info.st_size);
+
+            auto head = header();
+            if (head->magic != preview::magic || head->version != preview::version ||
+                preview::layout(head->width, head->height, head->bitmapWords, head->slotCount).totalBytes > mappedBytes)
+            {
+                close();
+                return false;
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return true;
+#else
+            return false;
+#endif
+        }
+
+        // Reads a publisher of this process without mapping anything, e.g. one
+        // from openLocal. The publisher has to stay open until close().
+        bool attach(const previewPublisher& publisher)
+        {
+            close();
+            base = publisher.segment();
+            return base != nullptr;
+        }
+
+        void close()
+        {
+#ifdef __linux__
+            if (base && mappedBytes > 0)
+            {
+                munmap(const_cast<uint8_t*>(base), mappedBytes);
+            }
+#endif
+            base = nullptr;
+            mappedBytes = 0;
+        }
+
+        bool isOpen() const {return base != nullptr;}
+        uint64_t published() const {return header()->published.load(std::memory_order_acquire);}
+        bool finished() const {return header()->finished.load(std::memory_order_acquire) != 0;}
+
+        // Calls use(view) on the newest frame without copying it. Returns false
+        // when nothing is published yet, or the publisher lapped the ring while
+        // use ran; whatever use read is then suspect and should be dropped.
+        template <typename Use>
+        bool read(Use&& use) const
+        {
+            auto head = header();
+            uint64_t frame = head->published.load(std::memory_order_acquire);
+            if (frame == 0)
+            {
+                return false;
+            }
+            preview::layout sizes(head->width, head->height, head->bitmapWords, head->slotCount);
+            const uint8_t* slotBase = base + sizes.firstSlot + ((frame - 1) % head->slotCount) * sizes.slotBytes;
+            auto slot = reinterpret_cast<const preview::slotHeader*>(slotBase);
+
+            uint64_t before = slot->sequence.load(std::memory_order_acquire);
+            if (before & 1)
+            {
+                return false;
+            }
+            previewView view;
+            view.width = head->width;
+            view.height = head->height;
+            view.tileSize = head->tileSize;
+            view.tilesX = head->tilesX;
+            view.tilesY = head->tilesY;
+            view.frame = slot->frame;
+            view.minSamples = slot->minSamples;
+            view.maxSamples = slot->maxSamples;
+            view.dirty = reinterpret_cast<const uint64_t*>(slotBase + sizes.bitmapOffset);
+            view.r = reinterpret_cast<const float*>(slotBase + sizes.planeOffset);
+            view.g = reinterpret_cast<const float*>(slotBase + sizes.planeOffset + sizes.planeBytes);
+            view.b = reinterpret_cast<const float*>(slotBase + sizes.planeOffset + 2 * sizes.planeBytes);
+            use(static_cast<const previewView&>(view));
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            return slot->sequence.load(std::memory_order_relaxed) == before;
+        }
+
+    private:
+        const uint8_t* base = nullptr;
+        // 0 when attached rather than mapped.
+        size_t mappedBytes = 0;
+
+        const preview::header* header() const {return reinterpret_cast<const preview::header*>(base);}
+};
+
+#endif
@@ -10,8 +10,15 @@ class ray
 
         ray(const point3& origin, const vec3& direction) : orig(origin), dir(direction) {}
 
+        // A ray cone: width at the origin, growing by spread per unit of
+        // distance. Only texture filtering looks at it.
+        ray(const point3& origin, const vec3& direction, double width, double spread)
+            : orig(origin), dir(direction), width(width), spread(spread) {}
+
         const point3& origin() const {return orig;}
         const vec3& direction() const {return dir;}
+        double coneWidth() const {return width;}
+        double coneSpread() const {return spread;}
 
         point3 at(double t) const
         {
@@ -21,6 +28,8 @@ class ray
     private:
     point3 orig;
     vec3 dir;
+    double width = 0;
+    double spread = 0;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,138 @@
+#ifndef RENDER_CACHE_H
+#define RENDER_CACHE_H
+
+#include "framebuffer.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+// On disk store of framebuffers keyed by a hash of everything that
+// went into them (scene, camera, sampling settings and seed). Loading an
+// entry lets the camera trace only the samples it doesn't have yet.
+class renderCache
+{
+    public:
+        explicit renderCache(std::string directory = "renderCache") : directory(directory) {}
+
+        bool load(uint64_t key, int width, int height, framebuffer& buffer) const
+        {
+            std::ifstream file(pathFor(key), std::ios::binary);
+            if (!file)
+            {
+                return false;
+            }
+
+            header stored;
+            file.read(reinterpret_cast<char*>(&stored), sizeof(stored));
+            if (!file || stored.magic != magic || stored.key != key || stored.width != width || stored.height != height)
+            {
+                std::cerr << "Ignoring stale render cache entry: " << pathFor(key) << std::endl;
+                return false;
+            }
+
+            buffer.resize(width, height);
+            for (float* plane : {buffer.sumR.data(), buffer.sumG.data(), buffer.sumB.data(), buffer.sumLuminanceSq.data()})
+            {
+                file.read(reinterpret_cast<char*>(plane), buffer.pixelCount() * sizeof(float));
+            }
+            file.read(reinterpret_cast<char*>(buffer.samples.data()), buffer.pixelCount() * sizeof(uint32_t));
+            if (!file)
+            {
+                std::cerr << "Truncated render cache entry: " << pathFor(key) << std::endl;
+                buffer.resize(width, height);
+                return false;
+            }
+            return true;
+        }
+
+        // Written to a temporary file first so readers never see half an entry.
+        // The temporary name is unique to the writing process and thread, so
+        // two writers of the same key don't interleave; the last rename wins.
+        bool store(uint64_t key, const framebuffer& buffer) const
+        {
+            std::error_code error;
+            std::filesystem::create_directories(directory, error);
+
+            std::string path = pathFor(key);
+            std::string temporary = temporaryPathFor(path);
+            {
+                std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+                if (!file)
+                {
+                    std::cerr << "Fails to Write Render Cache: " << temporary << std::endl;
+                    return false;
+                }
+
+                header stored{magic, key, buffer.width, buffer.height};
+                file.write(reinterpret_cast<const char*>(&stored), sizeof(stored));
+                for (const float* plane : {buffer.sumR.data(), buffer.sumG.data(), buffer.sumB.data(), buffer.sumLuminanceSq.data()})
+                {
+                    file.write(reinterpret_cast<const char*>(plane), buffer.pixelCount() * sizeof(float));
+                }
+                file.write(reinterpret_cast<const char*>(buffer.samples.data()), buffer.pixelCount() * sizeof(uint32_t));
+                if (!file)
+                {
+                    std::cerr << "Fails to Write Render Cache: " << temporary << std::endl;
+                    return false;
+                }
+            }
+            // std::filesystem::rename replaces an existing entry, std::rename
+            // doesn't on Windows.
+            std::filesystem::rename(temporary, path, error);
+            if (error)
+            {
+                std::cerr << "Fails to Write Render Cache: " << path << " (" << error.message() << ")" << std::endl;
+                std::filesystem::remove(temporary, error);
+                return false;
+            }
+            return true;
+        }
+
+        std::string pathFor(uint64_t key) const
+        {
+            char name[32];
+            std::snprintf(name, sizeof(name), "%016llx.rcache", (unsigned long long)key);
+            return directory + "/" + name;
+        }
+
+    private:
+        static std::string temporaryPathFor(const std::string& path)
+        {
+#ifdef _WIN32
+            long long process = _getpid();
+#else
+            long long process = getpid();
+#endif
+            size_t thread = std::hash<std::thread::id>()(std::this_thread::get_id());
+            char suffix[64];
+            std::snprintf(suffix, sizeof(suffix), ".%lld.%zx.tmp", process, thread);
+            return path + suffix;
+        }
+
+        // Version 2 stores planar sums, 3 adds squared luminance, 4 has bounce
+        // rays skip hits at their own origin, which brightens every image.
+        static constexpr uint64_t magic = 0x3448434143545200ull; // "\0RTCACH4"
+
+        struct header
+        {
+            uint64_t magic;
+            uint64_t key;
+            int32_t width;
+            int32_t height;
+        };
+
+        std::string directory;
+};
+
+#endif
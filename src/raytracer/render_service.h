@@ -0,0 +1,559 @@
+#ifndef RENDER_SERVICE_H
+#define RENDER_SERVICE_H
+
+#include "rtweekend.h"
+#include "camera.h"
+#include "scene.h"
+#include "scenes.h"
+#include "sphere_list.h"
+
+// TBB
+#include <tbb/task_arena.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Long running side of the renderer: jobs come in, wait in a priority queue
+// and run one after another on a single shared TBB arena, against scenes that
+// stay resident between jobs. The socket front end is tools/render_daemon.cpp.
+
+// Everything a job needs, all of it settable from a "key=value ..." line.
+struct renderJob
+{
+    int priority = 0;
+    std::string sceneName = "randomSpheres";
+    uint64_t sceneSeed = 0;
+
+    double aspectRatio = 16.0 / 9.0;
+    int imagePlaneWidth = 400;
+    int samplesPerPixel = 10;
+    // Seconds to render for, 0 renders to samplesPerPixel instead.
+    double timeBudget = 0;
+    int maxDepth = 10;
+    double viewFov = 20;
+    point3 lookFrom = point3(13,2,3);
+    point3 lookAt = point3(0,0,0);
+    vec3 vUp = vec3(0,1,0);
+    double defocusAngle = 0;
+    double focusDist = 10;
+    uint64_t seed = 0;
+    bool denoise = false;
+    bool pathGuiding = false;
+    std::string outputPath = "output.exr";
+
+    void applyTo(camera& cam) const
+    {
+        cam.aspectRatio = aspectRatio;
+        cam.imagePlaneWidth = imagePlaneWidth;
+        cam.samplesPerPixel = samplesPerPixel;
+        cam.timeBudget = timeBudget;
+        cam.maxDepth = maxDepth;
+        cam.viewFov = viewFov;
+        cam.lookFrom = lookFrom;
+        cam.lookAt = lookAt;
+        cam.vUp = vUp;
+        cam.defocusAngle = defocusAngle;
+        cam.focusDist = focusDist;
+        cam.seed = seed;
+        cam.denoise = denoise;
+        cam.pathGuiding = pathGuiding;
+        cam.outputPath = outputPath;
+    }
+
+    // Unknown keys and malformed values are errors, not silently ignored.
+    bool parse(const std::string& line, std::string& error)
+    {
+        std::istringstream tokens(line);
+        std::string token;
+        while (tokens >> token)
+        {
+            auto equals = token.find('=');
+            if (equals == std::string::npos)
+            {
+                error = "expected key=value, got " + token;
+                return false;
+            }
+            std::string key = token.substr(0, equals);
+            std::string value = token.substr(equals + 1);
+            if (!set(key, value))
+            {
+                error = "bad setting " + token;
+                return false;
+            }
+        }
+        if (imagePlaneWidth < 1 || samplesPerPixel < 1 || maxDepth < 1 || aspectRatio <= 0)
+        {
+            error = "width, spp, depth and aspect must be positive";
+            return false;
+        }
+        if (timeBudget < 0)
+        {
+            error = "budget can't be negative";
+            return false;
+        }
+        return true;
+    }
+
+    std::string sceneKey() const {return sceneName + ":" + std::to_string(sceneSeed);}
+
+    // One setting; false for unknown keys or values that don't parse whole.
+    bool set(const std::string& key, const std::string& value)
+    {
+        std::istringstream in(value);
+        auto read = [&](auto& field){ return bool(in >> field) && in.peek() == EOF; };
+        auto readVec = [&](vec3& field){
+            char comma1, comma2;
+            double x, y, z;
+            if (!(in >> x >> comma1 >> y >> comma2 >> z) || comma1 != ',' || comma2 != ',' || in.peek() != EOF)
+            {
+                return false;
+            }
+            field = vec3(x, y, z);
+            return true;
+        };
+
+        if (key == "priority") return read(priority);
+        if (key == "scene") {sceneName = value; return !value.empty();}
+        if (key == "sceneSeed") return read(sceneSeed);
+        if (key == "aspect") return read(aspectRatio);
+        if (key == "width") return read(imagePlaneWidth);
+        if (key == "spp") return read(samplesPerPixel);
+        if (key == "budget") return read(timeBudget);
+        if (key == "depth") return read(maxDepth);
+        if (key == "fov") return read(viewFov);
+        if (key == "from") return readVec(lookFrom);
+        if (key == "at") return readVec(lookAt);
+        if (key == "up") return readVec(vUp);
+        if (key == "defocus") return read(defocusAngle);
+        if (key == "focus") return read(focusDist);
+        if (key == "seed") return read(seed);
+        if (key == "denoise") return read(denoise);
+        if (key == "guiding") return read(pathGuiding);
+        if (key == "output") {outputPath = value; return !value.empty();}
+        return false;
+    }
+};
+
+// A built scene plus its flattened form, kept alive between jobs.
+struct residentScene
+{
+    scene source;
+    sphere_list flat;
+    bool isFlat = false;
+    double buildSeconds = 0;
+
+    const hittable& world() const {return isFlat ? static_cast<const hittable&>(flat) : source;}
+    size_t bytesUsed() const {return source.bytesUsed() + flat.bytesUsed();}
+};
+
+// Scenes by "name:seed", least recently used dropped first once the total
+// goes over budgetBytes. Jobs hold a shared_ptr, so dropping one that is still
+// rendering only frees it when that job ends.
+class sceneCache
+{
+    public:
+        using builder = std::function<void(scene&, uint64_t seed)>;
+
+        size_t budgetBytes = size_t(512) << 20;
+
+        sceneCache()
+        {
+            builders["randomSpheres"] = [](scene& world, uint64_t seed){ buildRandomSpheres(world, seed); };
+            builders["glassSpheres"] = [](scene& world, uint64_t seed){ buildGlassSpheres(world, seed); };
+        }
+
+        void registerScene(const std::string& name, builder build)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            builders[name] = std::move(build);
+        }
+
+        // Builds outside the lock, so a big scene doesn't hold up jobs on
+        // other scenes. Jobs asking for one that is being built wait for that
+        // build instead of starting their own.
+        std::shared_ptr<const residentScene> acquire(const std::string& name, uint64_t seed, bool& hit)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            std::string key = name + ":" + std::to_string(seed);
+            auto found = entries.find(key);
+            if (found != entries.end())
+            {
+                recent.splice(recent.begin(), recent, found->second.position);
+                hit = true;
+                return found->second.resident;
+            }
+            auto building = inFlight.find(key);
+            if (building != inFlight.end())
+            {
+                auto pending = building->second;
+                lock.unlock();
+                hit = true;
+                return pending.get();
+            }
+
+            hit = false;
+            auto build = builders.find(name);
+            if (build == builders.end())
+            {
+                return nullptr;
+            }
+            builder make = build->second;
+            std::promise<std::shared_ptr<residentScene>> promise;
+            inFlight[key] = promise.get_future().share();
+            lock.unlock();
+
+            auto resident = std::make_shared<residentScene>();
+            try
+            {
+                TRACE_ZONE("scene build");
+                auto start = std::chrono::steady_clock::now();
+                make(resident->source, seed);
+                resident->isFlat = sphere_list::flatten(resident->source.world(), resident->flat);
+                resident->buildSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            } catch (...) {
+                lock.lock();
+                inFlight.erase(key);
+                promise.set_exception(std::current_exception());
+                throw;
+            }
+
+            lock.lock();
+            inFlight.erase(key);
+            recent.push_front(key);
+            entries[key] = {resident, recent.begin(), resident->bytesUsed()};
+            totalBytes += resident->bytesUsed();
+            evict();
+            promise.set_value(resident);
+            return resident;
+        }
+
+        // One line per resident scene, most recently used first.
+        std::string describe() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::ostringstream out;
+            for (const auto& key : recent)
+            {
+                const auto& entry = entries.at(key);
+                out << key << " bytes=" << entry.bytes << " build=" << entry.resident->buildSeconds
+                    << "s flat=" << entry.resident->isFlat << "\n";
+            }
+            out << "total=" << totalBytes << " budget=" << budgetBytes << "\n";
+            return out.str();
+        }
+
+    private:
+        struct entry
+        {
+            std::shared_ptr<residentScene> resident;
+            std::list<std::string>::iterator position;
+            size_t bytes;
+        };
+
+        mutable std::mutex mutex;
+        std::map<std::string, builder> builders;
+        std::unordered_map<std::string, entry> entries;
+        // Scenes being built, for jobs that ask for them meanwhile.
+        std::unordered_map<std::string, std::shared_future<std::shared_ptr<residentScene>>> inFlight;
+        std::list<std::string> recent;
+        size_t totalBytes = 0;
+
+        // Never drops the newest entry, even when it alone is over budget.
+        void evict()
+        {
+            while (totalBytes > budgetBytes && recent.size() > 1)
+            {
+                auto& key = recent.back();
+                totalBytes -= entries[key].bytes;
+                entries.erase(key);
+                recent.pop_back();
+            }
+        }
+};
+
+enum class jobState { queued, rendering, done, failed };
+
+inline const char* jobStateName(jobState state)
+{
+    switch (state)
+    {
+        case jobState::queued: return "queued";
+        case jobState::rendering: return "rendering";
+        case jobState::done: return "done";
+        case jobState::failed: return "failed";
+    }
+    return "unknown";
+}
+
+class renderService
+{
+    public:
+        // maxConcurrency 0 lets the arena use every core. runners is how many
+        // jobs may be in flight at once; they share the arena's threads.
+        explicit renderService(int maxConcurrency = 0, int runners = 1)
+            : arena(concurrencyPerArena(maxConcurrency, 1))
+        {
+            for (int i = 0; i < (runners < 1 ? 1 : runners); i++)
+            {
+                workers.emplace_back([this]{ runJobs(); });
+            }
+        }
+
+        ~renderService() {shutdown();}
+
+        sceneCache& scenes() {return residentScenes;}
+
+        uint64_t submit(const renderJob& job)
+        {
+            auto record = std::make_shared<jobRecord>();
+            record->job = job;
+            record->submitted = std::chrono::steady_clock::now();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                record->id = ++lastId;
+                records[record->id] = record;
+                queue.push(record);
+                trimHistory();
+            }
+            wake.notify_one();
+            return record->id;
+        }
+
+        // "job=3 state=rendering priority=0 progress=0.42 ..." or empty if unknown.
+        std::string status(uint64_t id) const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = records.find(id);
+            return found == records.end() ? std::string() : describe(*found->second);
+        }
+
+        std::string list() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::string out;
+            for (const auto& record : records)
+            {
+                out += describe(*record.second) + "\n";
+            }
+            return out;
+        }
+
+        // Blocks until the job is done or failed.
+        std::string wait(uint64_t id)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto found = records.find(id);
+            if (found == records.end())
+            {
+                return std::string();
+            }
+            auto record = found->second;
+            finished.wait(lock, [&]{ return record->state == jobState::done || record->state == jobState::failed; });
+            return describe(*record);
+        }
+
+        // Lets running jobs finish, drops the ones still queued.
+        void shutdown()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopping)
+                {
+                    return;
+                }
+                stopping = true;
+            }
+            wake.notify_all();
+            for (auto& worker : workers)
+            {
+                worker.join();
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            while (!queue.empty())
+            {
+                queue.top()->state = jobState::failed;
+                queue.top()->error = "service shut down";
+                queue.pop();
+            }
+            finished.notify_all();
+        }
+
+    private:
+        using clock = std::chrono::steady_clock;
+
+        struct jobRecord
+        {
+            uint64_t id = 0;
+            renderJob job;
+            // Written by the runner under the service mutex, except the row count.
+            jobState state = jobState::queued;
+            std::string error;
+            bool sceneHit = false;
+            clock::time_point submitted, started, ended;
+            double sceneSeconds = 0;
+            std::atomic<int> finishedRows{0};
+            std::atomic<int> totalRows{0};
+        };
+
+        // Highest priority first, oldest first within a priority.
+        struct laterFirst
+        {
+            bool operator()(const std::shared_ptr<jobRecord>& a, const std::shared_ptr<jobRecord>& b) const
+            {
+                return a->job.priority != b->job.priority ? a->job.priority < b->job.priority : a->id > b->id;
+            }
+        };
+
+        // Finished jobs kept around for status queries.
+        static constexpr size_t historyLimit = 1024;
+
+        tbb::task_arena arena;
+        sceneCache residentScenes;
+
+        mutable std::mutex mutex;
+        std::condition_variable wake;
+        std::condition_variable finished;
+        std::priority_queue<std::shared_ptr<jobRecord>, std::vector<std::shared_ptr<jobRecord>>, laterFirst> queue;
+        std::map<uint64_t, std::shared_ptr<jobRecord>> records;
+        uint64_t lastId = 0;
+        bool stopping = false;
+        std::vector<std::thread> workers;
+
+        void runJobs()
+        {
+            for (;;)
+            {
+                std::shared_ptr<jobRecord> record;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    wake.wait(lock, [&]{ return stopping || !queue.empty(); });
+                    if (stopping)
+                    {
+                        return;
+                    }
+                    record = queue.top();
+                    queue.pop();
+                    record->state = jobState::rendering;
+                    record->started = clock::now();
+                }
+                run(*record);
+                finished.notify_all();
+            }
+        }
+
+        void run(jobRecord& record)
+        {
+            TRACE_ZONE_VALUE("job", record.id);
+            bool hit = false;
+            auto sceneStart = clock::now();
+            std::shared_ptr<const residentScene> resident;
+            std::string sceneError;
+            try
+            {
+                resident = residentScenes.acquire(record.job.sceneName, record.job.sceneSeed, hit);
+            } catch (const std::exception& e) {
+                // A builder that throws (bad_alloc on a large field) fails
+                // this job and every job waiting on the same build, not the daemon.
+                sceneError = std::string("fails to build scene ") + record.job.sceneName + ": " + e.what();
+            }
+            double sceneSeconds = std::chrono::duration<double>(clock::now() - sceneStart).count();
+            if (!resident)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                record.state = jobState::failed;
+                record.error = sceneError.empty() ? "unknown scene " + record.job.sceneName : sceneError;
+                record.sceneSeconds = sceneSeconds;
+                record.ended = clock::now();
+                return;
+            }
+
+            camera cam;
+            record.job.applyTo(cam);
+            cam.sharedArena = &arena;
+            cam.logProgress = false;
+            cam.writeDebugFrame = false;
+            cam.onProgress = [&record](int finishedRows, int totalRows){
+                record.totalRows.store(totalRows, std::memory_order_relaxed);
+                record.finishedRows.store(finishedRows, std::memory_order_relaxed);
+            };
+
+            std::string error;
+            try
+            {
+                cam.parallelRender(resident->world());
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+            if (error.empty() && cam.outputWriteFailed())
+            {
+                error = "fails to write " + cam.outputPath;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            record.sceneHit = hit;
+            record.sceneSeconds = sceneSeconds;
+            record.ended = clock::now();
+            record.error = error;
+            record.state = error.empty() ? jobState::done : jobState::failed;
+        }
+
+        std::string describe(const jobRecord& record) const
+        {
+            auto seconds = [](clock::time_point from, clock::time_point to){
+                return std::chrono::duration<double>(to - from).count();
+            };
+            auto now = clock::now();
+            std::ostringstream out;
+            out << "job=" << record.id << " state=" << jobStateName(record.state)
+                << " priority=" << record.job.priority << " scene=" << record.job.sceneKey();
+
+            int totalRows = record.totalRows.load(std::memory_order_relaxed);
+            double progress = record.state == jobState::done ? 1.0
+                : (totalRows > 0 ? double(record.finishedRows.load(std::memory_order_relaxed)) / totalRows : 0.0);
+            out << " progress=" << progress;
+
+            if (record.state == jobState::queued)
+            {
+                out << " queued=" << seconds(record.submitted, now) << "s";
+            } else {
+                out << " queued=" << seconds(record.submitted, record.started) << "s";
+                bool ended = record.state == jobState::done || record.state == jobState::failed;
+                out << " elapsed=" << seconds(record.started, ended ? record.ended : now) << "s";
+            }
+            if (record.state == jobState::done)
+            {
+                out << " sceneCache=" << (record.sceneHit ? "hit" : "miss") << " sceneTime=" << record.sceneSeconds << "s"
+                    << " output=" << record.job.outputPath;
+            }
+            if (!record.error.empty())
+            {
+                out << " error=\"" << record.error << "\"";
+            }
+            return out.str();
+        }
+
+        // Drops the oldest finished jobs past historyLimit; records map is by id.
+        void trimHistory()
+        {
+            for (auto it = records.begin(); records.size() > historyLimit && it != records.end(); )
+            {
+                bool ended = it->second->state == jobState::done || it->second->state == jobState::failed;
+                it = ended ? records.erase(it) : std::next(it);
+            }
+        }
+};
+
+#endif
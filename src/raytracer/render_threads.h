@@ -0,0 +1,83 @@
+#ifndef RENDER_THREADS_H
+#define RENDER_THREADS_H
+
+// TBB
+#include <tbb/info.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_scheduler_observer.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <vector>
+
+// Pins every thread that joins an arena to one cpu of the set, round robin
+// by arena slot, and puts back the thread's old affinity when it leaves.
+class pinningObserver : public tbb::task_scheduler_observer
+{
+    public:
+        pinningObserver(tbb::task_arena& arena, const std::vector<int>& cpus)
+            : tbb::task_scheduler_observer(arena), cpus(cpus)
+        {
+            if (!cpus.empty())
+            {
+                observe(true);
+            }
+        }
+
+        ~pinningObserver()
+        {
+            observe(false);
+        }
+
+#ifdef __linux__
+        void on_scheduler_entry(bool) override
+        {
+            int slot = tbb::this_task_arena::current_thread_index();
+            pthread_getaffinity_np(pthread_self(), sizeof(previousMask()), &previousMask());
+
+            cpu_set_t mask;
+            CPU_ZERO(&mask);
+            CPU_SET(cpus[slot % cpus.size()], &mask);
+            pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+        }
+
+        void on_scheduler_exit(bool) override
+        {
+            pthread_setaffinity_np(pthread_self(), sizeof(previousMask()), &previousMask());
+        }
+#endif
+
+    private:
+        std::vector<int> cpus;
+
+#ifdef __linux__
+        static cpu_set_t& previousMask()
+        {
+            thread_local cpu_set_t mask;
+            return mask;
+        }
+#endif
+};
+
+// NUMA nodes TBB can see. Without hwloc support (tbbbind) this is a single
+// entry for "anywhere", and callers fall back to one arena.
+inline std::vector<tbb::numa_node_id> renderNumaNodes()
+{
+    return tbb::info::numa_nodes();
+}
+
+// Splits maxConcurrency (0 = everything) evenly between count arenas.
+inline int concurrencyPerArena(int maxConcurrency, int count)
+{
+    if (maxConcurrency <= 0)
+    {
+        return tbb::task_arena::automatic;
+    }
+    int share = maxConcurrency / count;
+    return share < 1 ? 1 : share;
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define RTWEEKEND_H
 
 #include <cmath>
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
 #include <limits>
@@ -18,15 +19,44 @@ inline double degreesToRadians(double degrees)
     return degrees * pi / 180.0;
 }
 
+// Each thread draws from its own SplitMix64 stream. Seeding it per sample
+// makes every sample reproducible regardless of which thread traces it.
+inline uint64_t& randomState()
+{
+    thread_local uint64_t state = 0x853c49e6748fea9bull;
+    return state;
+}
+
+inline uint64_t mixBits(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+inline void seedRandom(uint64_t seed)
+{
+    randomState() = mixBits(seed);
+}
+
 inline double randomDouble()
 {
-    return std::rand() / (RAND_MAX + 1.0);
+    uint64_t& state = randomState();
+    state += 0x9e3779b97f4a7c15ull;
+    return (mixBits(state) >> 11) * 0x1.0p-53;
 }
 inline double randomDouble(double min, double max)
 {
     return min + (max-min)*randomDouble();
 }
 
+// Sample source for the camera's render kernels: one reseeded stream per sample.
+struct independentSampler
+{
+    static void seed(uint64_t s) {seedRandom(s);}
+    static double next() {return randomDouble();}
+};
+
 #include "color.h"
 #include "interval.h"
 #include "ray.h"
@@ -0,0 +1,112 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "rtweekend.h"
+#include "arena.h"
+#include "hittable.h"
+#include "hittable_list.h"
+
+#include <functional>
+#include <typeindex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Owns every primitive and material of a world. Each type gets its own arena
+// so objects of one kind sit next to each other in memory, and tearing the
+// scene down frees a handful of blocks instead of one allocation per object.
+// Destructors are never run, so only types that own no resources belong here.
+class scene : public hittable
+{
+    public:
+        scene() {}
+
+        scene(const scene&) = delete;
+        scene& operator=(const scene&) = delete;
+
+        template <typename T, typename... Args>
+        T* make(Args&&... args)
+        {
+            void* memory = storageFor<T>().allocate(sizeof(T), alignof(T));
+            return new (memory) T(std::forward<Args>(args)...);
+        }
+
+        // For the few objects that do own memory, like a sphere_set. They are
+        // destroyed with the scene and need a bytesUsed() of their own.
+        template <typename T, typename... Args>
+        T* makeOwned(Args&&... args)
+        {
+            auto object = std::make_shared<T>(std::forward<Args>(args)...);
+            T* raw = object.get();
+            owned.push_back({std::move(object), [raw]{ return raw->bytesUsed(); }});
+            return raw;
+        }
+
+        void add(const hittable* object) {objects.add(object);}
+
+        void reserve(size_t count) {objects.objects.reserve(count);}
+
+        void clear()
+        {
+            objects.clear();
+            owned.clear();
+            pools.clear();
+        }
+
+        size_t size() const {return objects.objects.size();}
+
+        size_t bytesUsed() const
+        {
+            size_t bytes = objects.objects.capacity() * sizeof(const hittable*);
+            for (const auto& pool : pools)
+            {
+                bytes += pool.second.bytesUsed();
+            }
+            for (const auto& object : owned)
+            {
+                bytes += object.bytesUsed();
+            }
+            return bytes;
+        }
+
+        const hittable_list& world() const {return objects;}
+
+        bool intersect(const ray& r, interval rayT, hitCandidate& candidate) const override
+        {
+            return objects.intersect(r, rayT, candidate);
+        }
+
+        void finalize(const ray& r, const hitCandidate& candidate, hitRecord& rec) const override
+        {
+            candidate.object->finalize(r, candidate, rec);
+        }
+
+        bool occluded(const ray& r, interval rayT) const override
+        {
+            return objects.occluded(r, rayT);
+        }
+
+        void fingerprint(hasher& h) const override
+        {
+            objects.fingerprint(h);
+        }
+
+    private:
+        hittable_list objects;
+        std::unordered_map<std::type_index, arena> pools;
+
+        struct ownedObject
+        {
+            std::shared_ptr<void> object;
+            std::function<size_t()> bytesUsed;
+        };
+        std::vector<ownedObject> owned;
+
+        template <typename T>
+        arena& storageFor()
+        {
+            return pools[std::type_index(typeid(T))];
+        }
+};
+
+#endif
@@ -0,0 +1,234 @@
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "rtweekend.h"
+#include "accelerator.h"
+#include "material.h"
+#include "scene.h"
+#include "paged_sphere_set.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "texture.h"
+
+// TBB
+#include <tbb/parallel_for.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <vector>
+
+// The final scene from Ray Tracing in One Weekend: a jittered 22x22 grid of
+// small spheres around three large ones. Seeded, so every call (on any
+// thread) builds the same world. groundTexture, if given, replaces the grey
+// of the ground sphere. The small spheres are diffuse when a uniform draw is
+// below diffuseBelow, metal below metalBelow and glass otherwise.
+inline void buildSphereGrid(scene& world, uint64_t seed, const texture* groundTexture, double diffuseBelow, double metalBelow)
+{
+    seedRandom(seed);
+    world.reserve(22 * 22 + 4);
+
+    const material* groundMaterial = groundTexture ? world.make<diffuse>(groundTexture)
+                                                   : world.make<diffuse>(color(0.5,0.5,0.5));
+    world.add(world.make<sphere>(point3(0, -1000, 0), 1000, groundMaterial));
+
+    for (int a = -11; a < 11; a++)
+    {
+        for (int b = -11; b < 11; b++)
+        {
+            auto chooseMat = randomDouble();
+            point3 center(a + 0.9*randomDouble(), 0.2, b + 0.9*randomDouble());
+            if ((center - point3(4, 0.2, 0)).length() > 0.9)
+            {
+                const material* sphereMaterial;
+
+                if (chooseMat < diffuseBelow)
+                {
+                    auto albedo = color::random() * color::random();
+                    sphereMaterial = world.make<diffuse>(albedo);
+                } else if (chooseMat < metalBelow){
+                    auto albedo = color::random();
+                    auto fuzz = randomDouble(0, 0.5);
+                    sphereMaterial = world.make<metal>(albedo, fuzz);
+                } else {
+                    sphereMaterial = world.make<glass>(1.5);
+                }
+                world.add(world.make<sphere>(center, 0.2, sphereMaterial));
+            }
+        }
+    }
+
+    auto material1 = world.make<glass>(1.5);
+    world.add(world.make<sphere>(point3(0,1,0), 1.0, material1));
+
+    auto material2 = world.make<diffuse>(color(0.4, 0.2, 0.1));
+    world.add(world.make<sphere>(point3(-4,1,0), 1.0, material2));
+
+    auto material3 = world.make<metal>(color(0.7, 0.6, 0.5), 0.0);
+    world.add(world.make<sphere>(point3(4,1,0), 1.0, material3));
+}
+
+inline void buildRandomSpheres(scene& world, uint64_t seed = 0, const texture* groundTexture = nullptr)
+{
+    buildSphereGrid(world, seed, groundTexture, 0.8, 0.95);
+}
+
+// Same layout, but 80% of the small spheres are glass. Long specular chains
+// make it the slow converging case.
+inline void buildGlassSpheres(scene& world, uint64_t seed = 0, const texture* groundTexture = nullptr)
+{
+    buildSphereGrid(world, seed, groundTexture, 0.1, 0.2);
+}
+
+// Same layout under a diffuse ceiling 2.6 units up, so the sky only comes in
+// through the thin gap at the horizon and nearly all light is indirect. The
+// case path guiding is for: unguided bounces rarely find the gap.
+inline void buildCoveredSpheres(scene& world, uint64_t seed = 0, const texture* groundTexture = nullptr)
+{
+    buildRandomSpheres(world, seed, groundTexture);
+    auto ceiling = world.make<diffuse>(color(0.8, 0.8, 0.8));
+    world.add(world.make<sphere>(point3(0,1002.6,0), 1000, ceiling));
+}
+
+// Stress scene: count small spheres in a sphere_set, with the same mix of
+// materials as buildRandomSpheres drawn from a shared palette. They sit on a
+// jittered grid at most 1024 cells wide that follows the ground sphere, and
+// pile up in layers once a layer is full, so 10^8 spheres stay within reach
+// of the camera. Every sphere is a function of seed and its index alone.
+struct sphereFieldLayout
+{
+    static constexpr double groundRadius = 1000;
+    static constexpr uint32_t paletteSize = 256;
+
+    size_t count;
+    uint64_t seed;
+    size_t columns;
+    size_t perLayer;
+
+    sphereFieldLayout(size_t count, uint64_t seed)
+        : count(count), seed(seed),
+          columns(std::min<size_t>(1024, size_t(std::ceil(std::sqrt(double(count)))))),
+          perLayer(columns * columns) {}
+
+    compactSphere at(size_t i) const
+    {
+        auto random = [&](uint64_t k){
+            return (mixBits(seed ^ mixBits(i * 4 + k)) >> 11) * 0x1.0p-53;
+        };
+        size_t layer = i / perLayer;
+        size_t cell = i % perLayer;
+        double x = double(cell / columns) - double(columns / 2) + 0.9 * random(0);
+        double z = double(cell % columns) - double(columns / 2) + 0.9 * random(1);
+        double groundHeight = std::sqrt(std::fmax(0.0, groundRadius * groundRadius - x * x - z * z)) - groundRadius;
+        double y = groundHeight + 0.2 + double(layer);
+        auto material = std::min<uint32_t>(paletteSize - 1, uint32_t(random(2) * paletteSize));
+        return {{float(x), float(y), float(z)}, 0.2f, material};
+    }
+
+    // Adds the ground and returns the palette, both made in world.
+    std::vector<const material*> addGroundAndPalette(scene& world, const texture* groundTexture) const
+    {
+        const material* groundMaterial = groundTexture ? world.make<diffuse>(groundTexture)
+                                                       : world.make<diffuse>(color(0.5,0.5,0.5));
+        world.add(world.make<sphere>(point3(0, -groundRadius, 0), groundRadius, groundMaterial));
+
+        seedRandom(seed);
+        std::vector<const material*> palette;
+        for (uint32_t i = 0; i < paletteSize; i++)
+        {
+            auto chooseMat = randomDouble();
+            if (chooseMat < 0.8)
+            {
+                palette.push_back(world.make<diffuse>(color::random() * color::random()));
+            } else if (chooseMat < 0.95) {
+                auto albedo = color::random();
+                palette.push_back(world.make<metal>(albedo, randomDouble(0, 0.5)));
+            } else {
+                palette.push_back(world.make<glass>(1.5));
+            }
+        }
+        return palette;
+    }
+};
+
+// The spheres go under accelerator, by default whichever suits the count.
+inline void buildSphereField(scene& world, size_t count, uint64_t seed = 0, const texture* groundTexture = nullptr,
+    acceleratorKind accelerator = acceleratorKind::automatic)
+{
+    sphereFieldLayout layout(count, seed);
+    auto start = std::chrono::steady_clock::now();
+    std::vector<const material*> palette = layout.addGroundAndPalette(world, groundTexture);
+
+    std::vector<compactSphere> spheres(count);
+    tbb::parallel_for(size_t(0), count, [&](size_t i){
+        spheres[i] = layout.at(i);
+    });
+    auto generated = std::chrono::steady_clock::now();
+
+    size_t before = world.bytesUsed();
+    acceleratorKind built = accelerator;
+    world.add(buildAccelerator(world, accelerator, std::move(spheres), std::move(palette), &built));
+    auto finished = std::chrono::steady_clock::now();
+
+    auto ms = [](std::chrono::steady_clock::duration d){
+        return std::chrono::duration<double, std::milli>(d).count();
+    };
+    double bytes = double(world.bytesUsed() - before);
+    double perSphere = count ? bytes / count : 0.0;
+    std::clog << "Sphere field: " << count << " spheres under a " << acceleratorName(built)
+              << (accelerator == acceleratorKind::automatic ? " (auto), " : ", ")
+              << bytes / (1 << 20) << " MB, " << perSphere << " bytes per sphere, generated in "
+              << ms(generated - start) << "ms, " << acceleratorName(built) << " built in " << ms(finished - generated) << "ms" << std::endl;
+}
+
+// The same field written to a paged sphere file, one chunk in memory at a
+// time. Consecutive indices are neighbouring cells, so each chunk is a strip
+// of rows from one layer.
+inline bool writeSphereFieldFile(const std::string& path, size_t count, uint64_t seed = 0,
+    size_t chunkSpheres = paged::maxChunkSpheres)
+{
+    sphereFieldLayout layout(count, seed);
+    auto start = std::chrono::steady_clock::now();
+    pagedSphereWriter writer;
+    if (!writer.open(path))
+    {
+        return false;
+    }
+    std::vector<compactSphere> chunk;
+    for (size_t first = 0; first < count; first += chunkSpheres)
+    {
+        chunk.resize(std::min(chunkSpheres, count - first));
+        tbb::parallel_for(size_t(0), chunk.size(), [&](size_t i){
+            chunk[i] = layout.at(first + i);
+        });
+        if (!writer.addChunk(chunk))
+        {
+            std::cerr << "Fails to Write Sphere File: " << path << std::endl;
+            return false;
+        }
+    }
+    bool ok = writer.finish();
+    std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - start;
+    std::clog << "Sphere field file: " << count << " spheres written to " << path << " in " << took.count() << "ms" << std::endl;
+    return ok;
+}
+
+// Renders a field written by writeSphereFieldFile without loading it: chunks
+// are paged in under budgetBytes. seed must be the one the file was written with.
+inline bool buildPagedSphereField(scene& world, const std::string& path, size_t count, uint64_t seed = 0,
+    size_t budgetBytes = size_t(1) << 30, const texture* groundTexture = nullptr)
+{
+    sphereFieldLayout layout(count, seed);
+    auto& field = *world.makeOwned<paged_sphere_set>(budgetBytes);
+    if (!field.open(path, layout.addGroundAndPalette(world, groundTexture)))
+    {
+        return false;
+    }
+    world.add(&field);
+    std::clog << "Paged sphere field: " << field.size() << " spheres in " << field.chunkCount() << " chunks, "
+              << field.bytesUsed() << " bytes resident up front, budget " << (budgetBytes >> 20) << " MB" << std::endl;
+    return true;
+}
+
+#endif
@@ -4,13 +4,13 @@
 #include "rtweekend.h"
 #include "hittable.h"
 
-class sphere : public hittable
+class sphere final : public hittable
 {
     public:
-        sphere(const point3& center, double radius, shared_ptr<material> mat) 
+        sphere(const point3& center, double radius, const material* mat) 
             : center(center), radius(std::fmax(0, radius)), mat(mat) {}
         
-        bool hit(const ray& r, interval rayT, hitRecord& rec) const override
+        bool intersect(const ray& r, interval rayT, hitCandidate& candidate) const override
         {
             vec3 oc = center - r.origin();
             auto a = r.direction().lengthSquared();
@@ -35,18 +35,68 @@ class sphere : public hittable
                 }
             }
 
-            rec.t = root;
+            candidate.t = root;
+            candidate.object = this;
+            candidate.primitive = 0;
+            return true;
+        }
+
+        void finalize(const ray& r, const hitCandidate& candidate, hitRecord& rec) const override
+        {
+            rec.t = candidate.t;
             rec.p = r.at(rec.t);
             vec3 outwardNormal = (rec.p - center) / radius;
             rec.setFaceNormals(r, outwardNormal); 
             rec.mat = mat;
+            rec.uvPoint = outwardNormal;
+            rec.coneWidth = r.coneWidth() + rec.t * r.direction().length() * r.coneSpread();
+            // A meridian, pi * radius long, spans v in [0, 1].
+            rec.uvScale = 1.0 / (pi * radius);
+        }
 
+        bool hit(const ray& r, interval rayT, hitRecord& rec) const override
+        {
+            hitCandidate candidate;
+            if (!intersect(r, rayT, candidate))
+            {
+                return false;
+            }
+            finalize(r, candidate, rec);
             return true;
         }
+
+        bool occluded(const ray& r, interval rayT) const override
+        {
+            vec3 oc = center - r.origin();
+            auto a = r.direction().lengthSquared();
+            auto h = dot(r.direction(), oc);
+            auto c = oc.lengthSquared() - radius * radius;
+
+            auto discriminant = h*h - a*c;
+            if (discriminant < 0)
+            {
+                return false;
+            }
+
+            auto sqrtd = std::sqrt(discriminant);
+            return rayT.surrounds((h - sqrtd) / a) || rayT.surrounds((h + sqrtd) / a);
+        }
+
+        void fingerprint(hasher& h) const override
+        {
+            h.add("sphere");
+            h.add(center);
+            h.add(radius);
+            mat->fingerprint(h);
+        }
+
     private:
+        // sphere_list copies centers and radii out into its SIMD blocks.
+        friend class sphere_list;
+
         point3 center;
         double radius;
-        shared_ptr<material> mat;
+        const material* mat;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,330 @@
+#ifndef SPHERE_GRID_H
+#define SPHERE_GRID_H
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "material.h"
+#include "sphere_set.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// The spheres of a sphere_set under a uniform grid instead of a BVH. Each
+// cell lists the spheres whose bounds overlap it, and rays walk the cells
+// they cross in order with a 3D-DDA, stopping at the first cell that holds a
+// hit closer than its far side. build() is two linear passes, and for dense,
+// evenly spread spheres the walk beats descending a tree. Where spheres
+// cluster, most cells are empty and the walk crosses them one by one, a BVH
+// is better there, see accelerator.h.
+//
+// Hits are tested with the same arithmetic as sphere_set, so both find the
+// same ones. Fill spheres and materials, then build().
+class sphere_grid final : public hittable
+{
+    public:
+        // build() aims for about this many cells per sphere.
+        static constexpr double cellsPerSphere = 1.0;
+        static constexpr int maxCellsPerAxis = 4096;
+
+        std::vector<compactSphere> spheres;
+        std::vector<const material*> materials;
+
+        uint32_t addMaterial(const material* mat)
+        {
+            materials.push_back(mat);
+            return uint32_t(materials.size() - 1);
+        }
+
+        void add(const point3& center, double radius, uint32_t material)
+        {
+            spheres.push_back({{float(center.x()), float(center.y()), float(center.z())}, float(std::fmax(0, radius)), material});
+        }
+
+        // Cells per axis for count spheres within [lo, hi]: cubes, sized so
+        // there are about cellsPerSphere of them per sphere.
+        static std::array<int, 3> resolution(const double* lo, const double* hi, size_t count)
+        {
+            double extent[3];
+            double volume = 1;
+            for (int a = 0; a < 3; a++)
+            {
+                extent[a] = std::fmax(hi[a] - lo[a], 1e-9);
+                volume *= extent[a];
+            }
+            double cellSize = std::cbrt(volume / (cellsPerSphere * double(std::max<size_t>(count, 1))));
+            std::array<int, 3> dims;
+            for (int a = 0; a < 3; a++)
+            {
+                dims[a] = int(std::clamp(std::ceil(extent[a] / cellSize), 1.0, double(maxCellsPerAxis)));
+            }
+            return dims;
+        }
+
+        // Bounds of every sphere, rounded outwards like sphere_set's nodes.
+        static void bounds(const std::vector<compactSphere>& spheres, double* lo, double* hi)
+        {
+            std::fill(lo, lo + 3, infinity);
+            std::fill(hi, hi + 3, -infinity);
+            for (const auto& s : spheres)
+            {
+                for (int a = 0; a < 3; a++)
+                {
+                    lo[a] = std::fmin(lo[a], std::nextafter(s.center[a] - s.radius, -infinityF));
+                    hi[a] = std::fmax(hi[a], std::nextafter(s.center[a] + s.radius, infinityF));
+                }
+            }
+        }
+
+        // Counts, prefix sums, then fills the cell lists in sphere order.
+        void build()
+        {
+            cellStart.clear();
+            cellSpheres.clear();
+            if (spheres.empty())
+            {
+                return;
+            }
+            bounds(spheres, lo, hi);
+            dims = resolution(lo, hi, spheres.size());
+            for (int a = 0; a < 3; a++)
+            {
+                cellSize[a] = (hi[a] - lo[a]) / dims[a];
+                inverseCellSize[a] = cellSize[a] > 0 ? 1.0 / cellSize[a] : 0.0;
+            }
+
+            cellStart.assign(cellCount() + 1, 0);
+            for (const auto& s : spheres)
+            {
+                forEachCell(s, [&](size_t cell){ cellStart[cell + 1]++; });
+            }
+            for (size_t c = 0; c < cellCount(); c++)
+            {
+                cellStart[c + 1] += cellStart[c];
+            }
+            cellSpheres.resize(cellStart.back());
+            std::vector<uint32_t> filled(cellStart.begin(), cellStart.end() - 1);
+            for (size_t i = 0; i < spheres.size(); i++)
+            {
+                forEachCell(spheres[i], [&](size_t cell){ cellSpheres[filled[cell]++] = uint32_t(i); });
+            }
+        }
+
+        size_t size() const {return spheres.size();}
+        size_t cellCount() const {return size_t(dims[0]) * dims[1] * dims[2];}
+        // Entries in all cell lists, spheres overlapping several cells count once per cell.
+        size_t references() const {return cellSpheres.size();}
+
+        size_t bytesUsed() const
+        {
+            return spheres.capacity() * sizeof(compactSphere) + cellStart.capacity() * sizeof(uint32_t)
+                 + cellSpheres.capacity() * sizeof(uint32_t) + materials.capacity() * sizeof(const material*);
+        }
+
+        bool intersect(const ray& r, interval rayT, hitCandidate& candidate) const override
+        {
+            bool hitAnything = false;
+            double closest = rayT.max;
+            walk(r, rayT, [&](size_t cell, double exit){
+                for (uint32_t k = cellStart[cell]; k < cellStart[cell + 1]; k++)
+                {
+                    uint32_t i = cellSpheres[k];
+                    double t;
+                    if (intersectCompactSphere(spheres[i], r, interval(rayT.min, closest), t))
+                    {
+                        hitAnything = true;
+                        closest = t;
+                        candidate.primitive = i;
+                    }
+                }
+                // Anything nearer would overlap this cell or one already walked.
+                return hitAnything && closest <= exit;
+            });
+
+            if (hitAnything)
+            {
+                candidate.t = closest;
+                candidate.object = this;
+            }
+            return hitAnything;
+        }
+
+        void finalize(const ray& r, const hitCandidate& candidate, hitRecord& rec) const override
+        {
+            const compactSphere& s = spheres[candidate.primitive];
+            finalizeCompactSphere(s, materials[s.material], r, candidate.t, rec);
+        }
+
+        bool hit(const ray& r, interval rayT, hitRecord& rec) const override
+        {
+            hitCandidate candidate;
+            if (!intersect(r, rayT, candidate))
+            {
+                return false;
+            }
+            finalize(r, candidate, rec);
+            return true;
+        }
+
+        bool occluded(const ray& r, interval rayT) const override
+        {
+            return walk(r, rayT, [&](size_t cell, double){
+                for (uint32_t k = cellStart[cell]; k < cellStart[cell + 1]; k++)
+                {
+                    double t;
+                    if (intersectCompactSphere(spheres[cellSpheres[k]], r, rayT, t))
+                    {
+                        return true;
+                    }
+                }
+                return false;
+            });
+        }
+
+        void fingerprint(hasher& h) const override
+        {
+            h.add("sphere_grid");
+            h.add(spheres.size());
+            h.add(spheres.data(), spheres.size() * sizeof(compactSphere));
+            h.add(materials.size());
+            for (auto mat : materials)
+            {
+                mat->fingerprint(h);
+            }
+        }
+
+    private:
+        double lo[3] = {0, 0, 0};
+        double hi[3] = {0, 0, 0};
+        double cellSize[3] = {0, 0, 0};
+        double inverseCellSize[3] = {0, 0, 0};
+        std::array<int, 3> dims = {0, 0, 0};
+        // Cell c lists cellSpheres[cellStart[c], cellStart[c + 1]).
+        std::vector<uint32_t> cellStart;
+        std::vector<uint32_t> cellSpheres;
+
+        size_t cellIndex(const int* cell) const
+        {
+            return (size_t(cell[2]) * dims[1] + cell[1]) * dims[0] + cell[0];
+        }
+
+        // Clamped into the grid, as a comparison before the conversion so
+        // nothing out of int's range is ever converted.
+        int cellOf(double x, int a) const
+        {
+            double cell = (x - lo[a]) * inverseCellSize[a];
+            if (!(cell > 0))
+            {
+                return 0;
+            }
+            return cell < dims[a] ? int(cell) : dims[a] - 1;
+        }
+
+        // Every cell the sphere's bounds overlap. The bounds are padded by a
+        // sliver of a cell, so rounding never leaves out a cell the walk
+        // would find the sphere's surface in.
+        template <typename Visit>
+        void forEachCell(const compactSphere& s, Visit&& visit) const
+        {
+            int first[3];
+            int last[3];
+            for (int a = 0; a < 3; a++)
+            {
+                double pad = 1e-6 * cellSize[a];
+                first[a] = cellOf(double(s.center[a]) - s.radius - pad, a);
+                last[a] = cellOf(double(s.center[a]) + s.radius + pad, a);
+            }
+            int cell[3];
+            for (cell[2] = first[2]; cell[2] <= last[2]; cell[2]++)
+            {
+                for (cell[1] = first[1]; cell[1] <= last[1]; cell[1]++)
+                {
+                    for (cell[0] = first[0]; cell[0] <= last[0]; cell[0]++)
+                    {
+                        visit(cellIndex(cell));
+                    }
+                }
+            }
+        }
+
+        // 3D-DDA (Amanatides and Woo): the cells r crosses within rayT, near
+        // to far. visit(cell, exit) gets the t the ray leaves the cell at and
+        // returns true to stop. True if a visit did.
+        template <typename Visit>
+        bool walk(const ray& r, interval rayT, Visit&& visit) const
+        {
+            if (cellStart.empty())
+            {
+                return false;
+            }
+            double origin[3];
+            double direction[3];
+            double inverse[3];
+            double tEnter = rayT.min;
+            double tLeave = rayT.max;
+            for (int a = 0; a < 3; a++)
+            {
+                origin[a] = r.origin()[a];
+                direction[a] = r.direction()[a];
+                inverse[a] = 1.0 / direction[a];
+                // Dropping the NaN of 0 * inf, as in sphere_set.
+                double t0 = (lo[a] - origin[a]) * inverse[a];
+                double t1 = (hi[a] - origin[a]) * inverse[a];
+                tEnter = maxNumber(tEnter, minNumber(t0, t1));
+                tLeave = minNumber(tLeave, maxNumber(t0, t1));
+            }
+            if (tEnter > tLeave)
+            {
+                return false;
+            }
+
+            int cell[3];
+            int step[3];
+            double next[3];
+            double delta[3];
+            for (int a = 0; a < 3; a++)
+            {
+                cell[a] = cellOf(origin[a] + tEnter * direction[a], a);
+                if (direction[a] > 0)
+                {
+                    step[a] = 1;
+                    next[a] = (lo[a] + (cell[a] + 1) * cellSize[a] - origin[a]) * inverse[a];
+                    delta[a] = cellSize[a] * inverse[a];
+                } else if (direction[a] < 0) {
+                    step[a] = -1;
+                    next[a] = (lo[a] + cell[a] * cellSize[a] - origin[a]) * inverse[a];
+                    delta[a] = -cellSize[a] * inverse[a];
+                } else {
+                    step[a] = 0;
+                    next[a] = infinity;
+                    delta[a] = infinity;
+                }
+            }
+
+            while (true)
+            {
+                int axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+                double exit = next[axis] < tLeave ? next[axis] : tLeave;
+                if (visit(cellIndex(cell), exit))
+                {
+                    return true;
+                }
+                if (next[axis] > tLeave)
+                {
+                    return false;
+                }
+                cell[axis] += step[axis];
+                if (cell[axis] < 0 || cell[axis] >= dims[axis])
+                {
+                    return false;
+                }
+                next[axis] += delta[axis];
+            }
+        }
+
+        static constexpr float infinityF = std::numeric_limits<float>::infinity();
+};
+
+#endif
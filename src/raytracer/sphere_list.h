@@ -0,0 +1,224 @@
+#ifndef SPHERE_LIST_H
+#define SPHERE_LIST_H
+
+#include "rtweekend.h"
+#include "double_lanes.h"
+#include "hittable_list.h"
+#include "sphere.h"
+
+#include <limits>
+#include <vector>
+
+// Spheres stored by value, back to back, for finalize(). intersect() and
+// occluded() run on a structure of arrays copy of the centers and radii
+// instead, double_lanes::width spheres per SIMD operation. Each lane does the
+// arithmetic of sphere::intersect in the same order, so the hits are the same
+// ones, to the bit.
+//
+// flatten() fills both. Code that fills spheres itself calls pack() after.
+class sphere_list final : public hittable
+{
+    public:
+        std::vector<sphere> spheres;
+
+        // Copies list into out if it holds nothing but spheres.
+        static bool flatten(const hittable_list& list, sphere_list& out)
+        {
+            out.spheres.clear();
+            out.spheres.reserve(list.objects.size());
+            for (const auto& object : list.objects)
+            {
+                auto s = dynamic_cast<const sphere*>(object);
+                if (!s)
+                {
+                    out.spheres.clear();
+                    return false;
+                }
+                out.spheres.push_back(*s);
+            }
+            out.pack();
+            return true;
+        }
+
+        size_t bytesUsed() const
+        {
+            return spheres.capacity() * sizeof(sphere) + blocks.capacity() * sizeof(block);
+        }
+
+        void pack()
+        {
+            blocks.assign((spheres.size() + width - 1) / width, block{});
+            for (size_t i = 0; i < blocks.size() * width; i++)
+            {
+                block& b = blocks[i / width];
+                size_t lane = i % width;
+                if (i < spheres.size())
+                {
+                    const sphere& s = spheres[i];
+                    b.x[lane] = s.center.x();
+                    b.y[lane] = s.center.y();
+                    b.z[lane] = s.center.z();
+                    b.radiusSquared[lane] = s.radius * s.radius;
+                } else {
+                    // c comes out infinite, the discriminant -infinity: never a hit.
+                    b.x[lane] = b.y[lane] = b.z[lane] = 0;
+                    b.radiusSquared[lane] = -std::numeric_limits<double>::infinity();
+                }
+            }
+        }
+
+        bool intersect(const ray& r, interval rayT, hitCandidate& candidate) const override
+        {
+            bool hitAnything = false;
+            auto closetSoFar = rayT.max;
+            const rayLanes lanes(r);
+
+            alignas(double_lanes) double discriminant[width];
+            alignas(double_lanes) double nearRoot[width];
+            alignas(double_lanes) double farRoot[width];
+            for (size_t b = 0; b < blocks.size(); b++)
+            {
+                if (!lanes.roots(blocks[b], discriminant, nearRoot, farRoot))
+                {
+                    continue;
+                }
+                for (size_t lane = 0; lane < width; lane++)
+                {
+                    if (discriminant[lane] < 0)
+                    {
+                        continue;
+                    }
+                    interval range(rayT.min, closetSoFar);
+                    auto root = nearRoot[lane];
+                    if (!range.surrounds(root))
+                    {
+                        root = farRoot[lane];
+                        if (!range.surrounds(root))
+                        {
+                            continue;
+                        }
+                    }
+                    hitAnything = true;
+                    closetSoFar = root;
+                    candidate.t = root;
+                    candidate.primitive = uint32_t(b * width + lane);
+                }
+            }
+            if (hitAnything)
+            {
+                candidate.object = this;
+            }
+            return hitAnything;
+        }
+
+        void finalize(const ray& r, const hitCandidate& candidate, hitRecord& rec) const override
+        {
+            spheres[candidate.primitive].finalize(r, candidate, rec);
+        }
+
+        // Kept here so the kernels' calls through a sphere_list stay direct.
+        bool hit(const ray& r, interval rayT, hitRecord& rec) const override
+        {
+            hitCandidate candidate;
+            if (!intersect(r, rayT, candidate))
+            {
+                return false;
+            }
+            finalize(r, candidate, rec);
+            return true;
+        }
+
+        bool occluded(const ray& r, interval rayT) const override
+        {
+            const rayLanes lanes(r);
+
+            alignas(double_lanes) double discriminant[width];
+            alignas(double_lanes) double nearRoot[width];
+            alignas(double_lanes) double farRoot[width];
+            for (const auto& b : blocks)
+            {
+                if (!lanes.roots(b, discriminant, nearRoot, farRoot))
+                {
+                    continue;
+                }
+                for (size_t lane = 0; lane < width; lane++)
+                {
+                    if (discriminant[lane] >= 0 && (rayT.surrounds(nearRoot[lane]) || rayT.surrounds(farRoot[lane])))
+                    {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        void fingerprint(hasher& h) const override
+        {
+            h.add(spheres.size());
+            for (const auto& s : spheres)
+            {
+                s.fingerprint(h);
+            }
+        }
+
+        // Only what decides where rays hit, for the look-dev G-buffer:
+        // materials can change without moving a single hit.
+        void geometryFingerprint(hasher& h) const
+        {
+            h.add(spheres.size());
+            for (const auto& s : spheres)
+            {
+                h.add(s.center);
+                h.add(s.radius);
+            }
+        }
+
+    private:
+        static constexpr size_t width = double_lanes::width;
+
+        struct alignas(double_lanes) block
+        {
+            double x[width];
+            double y[width];
+            double z[width];
+            double radiusSquared[width];
+        };
+
+        std::vector<block> blocks;
+
+        // One ray broadcast to every lane.
+        struct rayLanes
+        {
+            double_lanes originX, originY, originZ;
+            double_lanes directionX, directionY, directionZ;
+            double_lanes a;
+
+            explicit rayLanes(const ray& r)
+                : originX(r.origin().x()), originY(r.origin().y()), originZ(r.origin().z()),
+                  directionX(r.direction().x()), directionY(r.direction().y()), directionZ(r.direction().z()),
+                  a(r.direction().lengthSquared()) {}
+
+            // sphere::intersect's quadratic on a block. Returns false when it
+            // misses every sphere in it, before the square roots.
+            bool roots(const block& b, double* discriminant, double* nearRoot, double* farRoot) const
+            {
+                double_lanes ocX = double_lanes::load(b.x) - originX;
+                double_lanes ocY = double_lanes::load(b.y) - originY;
+                double_lanes ocZ = double_lanes::load(b.z) - originZ;
+                double_lanes h = directionX * ocX + directionY * ocY + directionZ * ocZ;
+                double_lanes c = (ocX * ocX + ocY * ocY + ocZ * ocZ) - double_lanes::load(b.radiusSquared);
+                double_lanes d = h * h - a * c;
+                if (!d.anyNonNegative())
+                {
+                    return false;
+                }
+                double_lanes sqrtd = sqrt(d);
+                d.store(discriminant);
+                ((h - sqrtd) / a).store(nearRoot);
+                ((h + sqrtd) / a).store(farRoot);
+                return true;
+            }
+        };
+};
+
+#endif
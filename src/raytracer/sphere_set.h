@@ -0,0 +1,400 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "material.h"
+#include "sphere.h"
+
+// TBB
+#include <tbb/parallel_invoke.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// A sphere in 20 bytes: float center and radius, and its material as an index
+// into the owning sphere_set's material table.
+struct compactSphere
+{
+    float center[3];
+    float radius;
+    uint32_t material;
+};
+static_assert(sizeof(compactSphere) == 20, "compactSphere is meant to pack to 20 bytes");
+
+// std::fmin and std::fmax, a NaN argument dropped, without the libm call GCC
+// makes for them. Box tests run several per node or cell.
+inline double minNumber(double a, double b) {return (b < a || a != a) ? b : a;}
+inline double maxNumber(double a, double b) {return (b > a || a != a) ? b : a;}
+
+// Same quadratic as sphere::intersect. Shared by everything that stores
+// compactSpheres, so they all find the same hits.
+inline bool intersectCompactSphere(const compactSphere& s, const ray& r, interval rayT, double& t)
+{
+    vec3 oc = point3(s.center[0], s.center[1], s.center[2]) - r.origin();
+    auto a = r.direction().lengthSquared();
+    auto h = dot(r.direction(), oc);
+    auto c = oc.lengthSquared() - double(s.radius) * s.radius;
+
+    auto discriminant = h*h - a*c;
+    if (discriminant < 0)
+    {
+        return false;
+    }
+
+    auto sqrtd = std::sqrt(discriminant);
+    auto root = (h - sqrtd) / a;
+    if (!rayT.surrounds(root))
+    {
+        root = (h + sqrtd) / a;
+        if (!rayT.surrounds(root))
+        {
+            return false;
+        }
+    }
+    t = root;
+    return true;
+}
+
+inline void finalizeCompactSphere(const compactSphere& s, const material* mat, const ray& r, double t, hitRecord& rec)
+{
+    point3 center(s.center[0], s.center[1], s.center[2]);
+    rec.t = t;
+    rec.p = r.at(rec.t);
+    vec3 outwardNormal = (rec.p - center) / s.radius;
+    rec.setFaceNormals(r, outwardNormal);
+    rec.mat = mat;
+    rec.uvPoint = outwardNormal;
+    rec.coneWidth = r.coneWidth() + rec.t * r.direction().length() * r.coneSpread();
+    rec.uvScale = 1.0 / (pi * s.radius);
+}
+
+// Many spheres sharing a small table of materials, under a BVH. Meant for
+// scenes with millions of spheres, where a sphere object and material each
+// would not fit in memory. Intersection still runs in double precision, only
+// storage is float.
+//
+// Fill spheres and materials, then build(). build() reorders spheres.
+class sphere_set final : public hittable
+{
+    public:
+        static constexpr size_t leafSize = 4;
+
+        // Leaves (count > 0) hold spheres [index, index + count). Interior nodes
+        // have their first child right after them and the second at index.
+        struct node
+        {
+            float lo[3];
+            float hi[3];
+            uint32_t index;
+            uint16_t count;
+            uint16_t axis;
+        };
+
+        std::vector<compactSphere> spheres;
+        std::vector<const material*> materials;
+
+        uint32_t addMaterial(const material* mat)
+        {
+            materials.push_back(mat);
+            return uint32_t(materials.size() - 1);
+        }
+
+        void add(const point3& center, double radius, uint32_t material)
+        {
+            spheres.push_back({{float(center.x()), float(center.y()), float(center.z())}, float(std::fmax(0, radius)), material});
+        }
+
+        // Median split on the longest centroid axis. Every node's place in the
+        // node array follows from its sphere count alone, so large subtrees are
+        // built in parallel straight into their final slots.
+        void build()
+        {
+            nodes.clear();
+            if (spheres.empty())
+            {
+                return;
+            }
+            nodes.resize(subtreeNodes(spheres.size()));
+            nodes.shrink_to_fit();
+            std::array<float, 6> centers = {infinityF, infinityF, infinityF, -infinityF, -infinityF, -infinityF};
+            for (const auto& s : spheres)
+            {
+                for (int a = 0; a < 3; a++)
+                {
+                    centers[a] = std::fmin(centers[a], s.center[a]);
+                    centers[3 + a] = std::fmax(centers[3 + a], s.center[a]);
+                }
+            }
+            buildNode(0, 0, spheres.size(), centers);
+        }
+
+        size_t size() const {return spheres.size();}
+        size_t nodeCount() const {return nodes.size();}
+
+        // A built tree, for saving it and putting it back without a rebuild.
+        const std::vector<node>& bvh() const {return nodes;}
+        void restore(std::vector<node> built) {nodes = std::move(built);}
+
+        size_t bytesUsed() const
+        {
+            return spheres.capacity() * sizeof(compactSphere) + nodes.capacity() * sizeof(node)
+                 + materials.capacity() * sizeof(const material*);
+        }
+
+        bool intersect(const ray& r, interval rayT, hitCandidate& candidate) const override
+        {
+            if (nodes.empty())
+            {
+                return false;
+            }
+            const traversal ray3(r);
+            bool hitAnything = false;
+            double closest = rayT.max;
+
+            uint32_t stack[64];
+            int top = 0;
+            stack[top++] = 0;
+            while (top > 0)
+            {
+                const node& n = nodes[stack[--top]];
+                if (!ray3.overlaps(n, rayT.min, closest))
+                {
+                    continue;
+                }
+                if (n.count > 0)
+                {
+                    for (uint32_t i = n.index; i < n.index + n.count; i++)
+                    {
+                        double t;
+                        if (intersectCompactSphere(spheres[i], r, interval(rayT.min, closest), t))
+                        {
+                            hitAnything = true;
+                            closest = t;
+                            candidate.primitive = i;
+                        }
+                    }
+                    continue;
+                }
+                pushChildren(n, stack, top, ray3);
+            }
+
+            if (hitAnything)
+            {
+                candidate.t = closest;
+                candidate.object = this;
+            }
+            return hitAnything;
+        }
+
+        void finalize(const ray& r, const hitCandidate& candidate, hitRecord& rec) const override
+        {
+            const compactSphere& s = spheres[candidate.primitive];
+            finalizeCompactSphere(s, materials[s.material], r, candidate.t, rec);
+        }
+
+        bool hit(const ray& r, interval rayT, hitRecord& rec) const override
+        {
+            hitCandidate candidate;
+            if (!intersect(r, rayT, candidate))
+            {
+                return false;
+            }
+            finalize(r, candidate, rec);
+            return true;
+        }
+
+        bool occluded(const ray& r, interval rayT) const override
+        {
+            if (nodes.empty())
+            {
+                return false;
+            }
+            const traversal ray3(r);
+            uint32_t stack[64];
+            int top = 0;
+            stack[top++] = 0;
+            while (top > 0)
+            {
+                const node& n = nodes[stack[--top]];
+                if (!ray3.overlaps(n, rayT.min, rayT.max))
+                {
+                    continue;
+                }
+                if (n.count > 0)
+                {
+                    for (uint32_t i = n.index; i < n.index + n.count; i++)
+                    {
+                        double t;
+                        if (intersectCompactSphere(spheres[i], r, rayT, t))
+                        {
+                            return true;
+                        }
+                    }
+                    continue;
+                }
+                pushChildren(n, stack, top, ray3);
+            }
+            return false;
+        }
+
+        // The packed data as is, so the order build() left it in counts too.
+        void fingerprint(hasher& h) const override
+        {
+            h.add("sphere_set");
+            h.add(spheres.size());
+            h.add(spheres.data(), spheres.size() * sizeof(compactSphere));
+            h.add(materials.size());
+            for (auto mat : materials)
+            {
+                mat->fingerprint(h);
+            }
+        }
+
+    private:
+        std::vector<node> nodes;
+
+        struct traversal
+        {
+            double origin[3];
+            double inverse[3];
+            bool negative[3];
+
+            explicit traversal(const ray& r)
+            {
+                for (int a = 0; a < 3; a++)
+                {
+                    origin[a] = r.origin()[a];
+                    inverse[a] = 1.0 / r.direction()[a];
+                    negative[a] = r.direction()[a] < 0;
+                }
+            }
+
+            // minNumber/maxNumber drop the NaN of 0 * inf, an axis the ray
+            // runs along then simply doesn't constrain it.
+            bool overlaps(const node& n, double tMin, double tMax) const
+            {
+                for (int a = 0; a < 3; a++)
+                {
+                    double t0 = (n.lo[a] - origin[a]) * inverse[a];
+                    double t1 = (n.hi[a] - origin[a]) * inverse[a];
+                    tMin = maxNumber(tMin, minNumber(t0, t1));
+                    tMax = minNumber(tMax, maxNumber(t0, t1));
+                }
+                return tMin <= tMax;
+            }
+        };
+
+        // Near child on top, so it is visited first and shrinks closest early.
+        void pushChildren(const node& n, uint32_t* stack, int& top, const traversal& ray3) const
+        {
+            uint32_t first = uint32_t(&n - nodes.data()) + 1;
+            uint32_t second = n.index;
+            if (ray3.negative[n.axis])
+            {
+                std::swap(first, second);
+            }
+            stack[top++] = second;
+            stack[top++] = first;
+        }
+
+        // Leaves under a node of n spheres, and under one of n + 1. Splitting
+        // n in halves of n / 2 and n - n / 2 only ever needs these two counts
+        // one level down, so this is O(log n) without a table.
+        static std::pair<size_t, size_t> leafCounts(size_t n)
+        {
+            if (n < leafSize)
+            {
+                return {1, 1};
+            }
+            if (n == leafSize)
+            {
+                return {1, 2};
+            }
+            auto half = leafCounts(n / 2);
+            return n % 2 == 0 ? std::make_pair(2 * half.first, half.first + half.second)
+                              : std::make_pair(half.first + half.second, 2 * half.second);
+        }
+
+        static size_t subtreeNodes(size_t n)
+        {
+            return 2 * leafCounts(n).first - 1;
+        }
+
+        // Centroid bounds come from the parent's split rather than a pass over
+        // the spheres, which is enough to pick an axis and keeps every level
+        // down to the nth_element. Node bounds are merged on the way back up.
+        void buildNode(size_t index, size_t first, size_t count, std::array<float, 6> centers)
+        {
+            node& n = nodes[index];
+            if (count <= leafSize)
+            {
+                std::fill(n.lo, n.lo + 3, infinityF);
+                std::fill(n.hi, n.hi + 3, -infinityF);
+                for (size_t i = first; i < first + count; i++)
+                {
+                    const compactSphere& s = spheres[i];
+                    for (int a = 0; a < 3; a++)
+                    {
+                        // Rounded outwards, the float sum may land inside the sphere.
+                        n.lo[a] = std::fmin(n.lo[a], std::nextafter(s.center[a] - s.radius, -infinityF));
+                        n.hi[a] = std::fmax(n.hi[a], std::nextafter(s.center[a] + s.radius, infinityF));
+                    }
+                }
+                n.index = uint32_t(first);
+                n.count = uint16_t(count);
+                n.axis = 0;
+                return;
+            }
+
+            int axis = 0;
+            for (int a = 1; a < 3; a++)
+            {
+                if (centers[3 + a] - centers[a] > centers[3 + axis] - centers[axis])
+                {
+                    axis = a;
+                }
+            }
+            size_t leftCount = count / 2;
+            auto begin = spheres.begin() + first;
+            std::nth_element(begin, begin + leftCount, begin + count, [axis](const compactSphere& x, const compactSphere& y){
+                return x.center[axis] < y.center[axis];
+            });
+            float split = spheres[first + leftCount].center[axis];
+            auto leftCenters = centers;
+            auto rightCenters = centers;
+            leftCenters[3 + axis] = split;
+            rightCenters[axis] = split;
+
+            size_t left = index + 1;
+            size_t right = index + 1 + subtreeNodes(leftCount);
+            n.index = uint32_t(right);
+            n.count = 0;
+            n.axis = uint16_t(axis);
+
+            auto buildLeft = [&]{ buildNode(left, first, leftCount, leftCenters); };
+            auto buildRight = [&]{ buildNode(right, first + leftCount, count - leftCount, rightCenters); };
+            if (count >= parallelBuildSize)
+            {
+                tbb::parallel_invoke(buildLeft, buildRight);
+            } else {
+                buildLeft();
+                buildRight();
+            }
+
+            for (int a = 0; a < 3; a++)
+            {
+                n.lo[a] = std::fmin(nodes[left].lo[a], nodes[right].lo[a]);
+                n.hi[a] = std::fmax(nodes[left].hi[a], nodes[right].hi[a]);
+            }
+        }
+
+        static constexpr size_t parallelBuildSize = 1 << 16;
+        static constexpr float infinityF = std::numeric_limits<float>::infinity();
+};
+
+#endif
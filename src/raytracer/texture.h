@@ -0,0 +1,51 @@
+#ifndef TEXTURE_H
+#define TEXTURE_H
+
+#include "rtweekend.h"
+#include "hash.h"
+#include "hittable.h"
+#include "texture_cache.h"
+
+#include <string>
+
+class texture
+{
+    public:
+        virtual ~texture() = default;
+
+        virtual color value(const hitRecord& rec) const = 0;
+
+        virtual void fingerprint(hasher& h) const = 0;
+};
+
+// Reads through a textureCache, so the image itself is never held here and
+// the texture can live in a scene arena. The cache must outlive the scene.
+class imageTexture final : public texture
+{
+    public:
+        imageTexture(textureCache& cache, const std::string& path) : cache(cache), id(cache.open(path)) {}
+
+        color value(const hitRecord& rec) const override
+        {
+            if (id < 0)
+            {
+                return color(1, 0, 1);
+            }
+            double u, v;
+            rec.uv(u, v);
+            return cache.lookup(id, u, v, rec.uvFootprint());
+        }
+
+        // The path only, editing the file in place won't invalidate a render cache entry.
+        void fingerprint(hasher& h) const override
+        {
+            h.add("imageTexture");
+            h.add(id < 0 ? std::string() : cache.path(id));
+        }
+
+    private:
+        textureCache& cache;
+        int id;
+};
+
+#endif
@@ -0,0 +1,318 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "rtweekend.h"
+#include "epoch_reclaimer.h"
+
+// openEXR
+#include <ImfTiledRgbaFile.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Tiled, mip-mapped EXR textures read a tile at a time on demand, shared by
+// every texture in a scene and kept under budgetBytes.
+//
+// Lookups don't lock: each tile slot is an atomic pointer, a hit is a load
+// and a timestamp update. A miss loads the tile under its file's mutex. When
+// resident tiles go over budget the least recently used are unhooked and
+// handed to the reclaimer, which frees them once no lookup can still hold them.
+//
+// Textures are opened while the scene is built; open() must not race lookups.
+class textureCache
+{
+    public:
+        explicit textureCache(size_t budgetBytes = size_t(256) << 20) : budgetBytes(budgetBytes) {}
+        textureCache(const textureCache&) = delete;
+        textureCache& operator=(const textureCache&) = delete;
+
+        ~textureCache()
+        {
+            for (auto& file : files)
+            {
+                for (auto& level : file->levels)
+                {
+                    for (size_t i = 0; i < level.tileCount(); i++)
+                    {
+                        delete level.tiles[i].load(std::memory_order_relaxed);
+                    }
+                }
+            }
+        }
+
+        // Id for path, or -1 if it can't be read as a tiled EXR. Opening the
+        // same path twice returns the same id.
+        int open(const std::string& path)
+        {
+            for (size_t i = 0; i < files.size(); i++)
+            {
+                if (files[i]->path == path)
+                {
+                    return int(i);
+                }
+            }
+
+            auto file = std::make_unique<textureFile>();
+            file->path = path;
+            try
+            {
+                file->input = std::make_unique<Imf::TiledRgbaInputFile>(path.c_str());
+            } catch (const std::exception& e) {
+                std::cerr << "Fails to Open Texture: " << e.what() << std::endl;
+                return -1;
+            }
+
+            auto& input = *file->input;
+            file->tileWidth = int(input.tileXSize());
+            file->tileHeight = int(input.tileYSize());
+            // Mip-mapped files have as many x as y levels; one level files have 1.
+            int levelCount = std::min(input.numXLevels(), input.numYLevels());
+            file->levels = std::vector<level>(levelCount);
+            for (int l = 0; l < levelCount; l++)
+            {
+                auto& lv = file->levels[l];
+                lv.width = input.levelWidth(l);
+                lv.height = input.levelHeight(l);
+                lv.tilesX = input.numXTiles(l);
+                lv.tilesY = input.numYTiles(l);
+                lv.tiles = std::make_unique<std::atomic<tile*>[]>(lv.tileCount());
+                for (size_t i = 0; i < lv.tileCount(); i++)
+                {
+                    lv.tiles[i].store(nullptr, std::memory_order_relaxed);
+                }
+            }
+            files.push_back(std::move(file));
+            return int(files.size() - 1);
+        }
+
+        int width(int id) const {return files[id]->levels[0].width;}
+        int height(int id) const {return files[id]->levels[0].height;}
+        int levels(int id) const {return int(files[id]->levels.size());}
+        const std::string& path(int id) const {return files[id]->path;}
+
+        // Bilinear lookup at the mip level whose texels best match footprint,
+        // the width of the lookup in uv units. u repeats, v clamps, v = 0 is
+        // the bottom row.
+        color lookup(int id, double u, double v, double footprint)
+        {
+            textureFile& file = *files[id];
+            int l = levelFor(file, footprint);
+            const level& lv = file.levels[l];
+
+            double x = (u - std::floor(u)) * lv.width - 0.5;
+            double y = (1.0 - std::clamp(v, 0.0, 1.0)) * lv.height - 0.5;
+            int x0 = int(std::floor(x));
+            int y0 = int(std::floor(y));
+            double fx = x - x0;
+            double fy = y - y0;
+
+            auto wrapX = [&](int px){ return ((px % lv.width) + lv.width) % lv.width; };
+            auto clampY = [&](int py){ return std::clamp(py, 0, lv.height - 1); };
+
+            typename epochReclaimer<tile>::guard reading(reclaimer);
+            color c00 = texel(file, l, wrapX(x0), clampY(y0));
+            color c10 = texel(file, l, wrapX(x0 + 1), clampY(y0));
+            color c01 = texel(file, l, wrapX(x0), clampY(y0 + 1));
+            color c11 = texel(file, l, wrapX(x0 + 1), clampY(y0 + 1));
+            return (1 - fy) * ((1 - fx) * c00 + fx * c10) + fy * ((1 - fx) * c01 + fx * c11);
+        }
+
+        size_t bytesResident() const {return residentBytes.load(std::memory_order_relaxed);}
+
+        std::string describe() const
+        {
+            std::ostringstream out;
+            out << "textures=" << files.size() << " resident=" << bytesResident() << "/" << budgetBytes
+                << " loads=" << loads.load() << " evictions=" << evictions.load()
+                << " pendingFree=" << reclaimer.pending();
+            return out.str();
+        }
+
+    private:
+        struct tile
+        {
+            std::atomic<uint32_t> lastUse{0};
+            int width, height;
+            std::vector<float> rgb;
+
+            size_t bytes() const {return sizeof(tile) + rgb.capacity() * sizeof(float);}
+        };
+
+        struct level
+        {
+            int width = 0, height = 0, tilesX = 0, tilesY = 0;
+            std::unique_ptr<std::atomic<tile*>[]> tiles;
+
+            size_t tileCount() const {return size_t(tilesX) * tilesY;}
+        };
+
+        struct textureFile
+        {
+            std::string path;
+            // TiledRgbaInputFile keeps a frame buffer between calls, so reads are serialised.
+            std::mutex io;
+            std::unique_ptr<Imf::TiledRgbaInputFile> input;
+            int tileWidth = 0, tileHeight = 0;
+            std::vector<level> levels;
+        };
+
+        struct residentTile
+        {
+            std::atomic<tile*>* slot;
+            tile* item;
+            uint32_t lastUse;
+        };
+
+        size_t budgetBytes;
+        std::vector<std::unique_ptr<textureFile>> files;
+
+        std::atomic<size_t> residentBytes{0};
+        // Ticks once per tile load, which is all the resolution LRU needs.
+        std::atomic<uint32_t> useClock{1};
+        std::atomic<uint64_t> loads{0};
+        std::atomic<uint64_t> evictions{0};
+
+        std::mutex residentMutex;
+        std::vector<residentTile> resident;
+        epochReclaimer<tile> reclaimer;
+
+        int levelFor(const textureFile& file, double footprint) const
+        {
+            const level& base = file.levels[0];
+            double texels = footprint * std::max(base.width, base.height);
+            if (!(texels > 1.0))
+            {
+                return 0;
+            }
+            int l = int(std::log2(texels) + 0.5);
+            return std::min(l, int(file.levels.size()) - 1);
+        }
+
+        color texel(textureFile& file, int l, int x, int y)
+        {
+            const level& lv = file.levels[l];
+            int tx = x / file.tileWidth;
+            int ty = y / file.tileHeight;
+            std::atomic<tile*>& slot = lv.tiles[size_t(ty) * lv.tilesX + tx];
+
+            tile* t = slot.load(std::memory_order_acquire);
+            if (!t)
+            {
+                t = load(file, l, tx, ty, slot);
+                if (!t)
+                {
+                    return color(1, 0, 1);
+                }
+            }
+
+            uint32_t now = useClock.load(std::memory_order_relaxed);
+            if (t->lastUse.load(std::memory_order_relaxed) != now)
+            {
+                t->lastUse.store(now, std::memory_order_relaxed);
+            }
+            size_t i = 3 * (size_t(y - ty * file.tileHeight) * t->width + (x - tx * file.tileWidth));
+            return color(t->rgb[i], t->rgb[i + 1], t->rgb[i + 2]);
+        }
+
+        // Still inside the caller's guard, so evicting here can't free a tile
+        // this thread is about to read.
+        tile* load(textureFile& file, int l, int tx, int ty, std::atomic<tile*>& slot)
+        {
+            tile* t = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(file.io);
+                t = slot.load(std::memory_order_acquire);
+                if (t)
+                {
+                    return t;
+                }
+
+                auto& input = *file.input;
+                Imath::Box2i window = input.dataWindowForTile(tx, ty, l);
+                int w = window.max.x - window.min.x + 1;
+                int h = window.max.y - window.min.y + 1;
+                std::vector<Imf::Rgba> pixels(size_t(w) * h);
+                try
+                {
+                    input.setFrameBuffer(pixels.data() - window.min.x - size_t(window.min.y) * w, 1, size_t(w));
+                    input.readTile(tx, ty, l);
+                } catch (const std::exception& e) {
+                    std::cerr << "Fails to Read Texture Tile: " << e.what() << std::endl;
+                    return nullptr;
+                }
+
+                t = new tile();
+                t->width = w;
+                t->height = h;
+                t->rgb.resize(pixels.size() * 3);
+                for (size_t i = 0; i < pixels.size(); i++)
+                {
+                    t->rgb[3 * i + 0] = pixels[i].r;
+                    t->rgb[3 * i + 1] = pixels[i].g;
+                    t->rgb[3 * i + 2] = pixels[i].b;
+                }
+                t->lastUse.store(useClock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                slot.store(t, std::memory_order_release);
+            }
+
+            loads.fetch_add(1, std::memory_order_relaxed);
+            residentBytes.fetch_add(t->bytes(), std::memory_order_relaxed);
+            {
+                std::lock_guard<std::mutex> lock(residentMutex);
+                resident.push_back({&slot, t, 0});
+            }
+            if (residentBytes.load(std::memory_order_relaxed) > budgetBytes)
+            {
+                evict(t);
+            }
+            return t;
+        }
+
+        // Drops least recently used tiles down to 90% of the budget, never keep.
+        void evict(const tile* keep)
+        {
+            std::lock_guard<std::mutex> lock(residentMutex);
+            if (residentBytes.load(std::memory_order_relaxed) <= budgetBytes)
+            {
+                return;
+            }
+            // Lookups keep stamping tiles while we sort, so sort a snapshot.
+            for (auto& entry : resident)
+            {
+                entry.lastUse = entry.item->lastUse.load(std::memory_order_relaxed);
+            }
+            std::sort(resident.begin(), resident.end(), [](const residentTile& a, const residentTile& b){
+                return a.lastUse < b.lastUse;
+            });
+
+            size_t target = budgetBytes / 10 * 9;
+            for (auto& entry : resident)
+            {
+                if (residentBytes.load(std::memory_order_relaxed) <= target)
+                {
+                    break;
+                }
+                if (entry.item == keep)
+                {
+                    continue;
+                }
+                entry.slot->store(nullptr, std::memory_order_seq_cst);
+                residentBytes.fetch_sub(entry.item->bytes(), std::memory_order_relaxed);
+                reclaimer.retire(entry.item);
+                evictions.fetch_add(1, std::memory_order_relaxed);
+                entry.item = nullptr;
+            }
+            resident.erase(std::remove_if(resident.begin(), resident.end(), [](const residentTile& entry){
+                return entry.item == nullptr;
+            }), resident.end());
+        }
+};
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Timeline tracing. Build with -DRAYTRACING_ENABLE_TRACING=ON (which defines
+// RAYTRACING_TRACING) and put TRACE_ZONE("name") at the top of a scope; the
+// zone covers the rest of the scope. writeChromeTrace saves every zone so far
+// as Chrome trace JSON, open it in chrome://tracing or ui.perfetto.dev.
+//
+// Without the option the macros are empty and writeChromeTrace does nothing.
+//
+// Each thread appends to its own buffer without locking. The buffer is a
+// fixed table of chunks that are only ever added, so writing the trace while
+// threads are still recording sees a consistent prefix of every thread.
+
+#include <string>
+
+#ifdef RAYTRACING_TRACING
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace trace
+{
+    // name must be a string literal, or otherwise outlive the trace.
+    struct event
+    {
+        const char* name;
+        int64_t start;
+        int64_t duration;
+        int64_t value;
+    };
+
+    // Never a real argument, events recorded with it are written without one.
+    constexpr int64_t noValue = INT64_MIN;
+
+    inline int64_t now()
+    {
+        static const auto epoch = std::chrono::steady_clock::now();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+    }
+
+    class threadBuffer
+    {
+        public:
+            static constexpr size_t chunkSize = 4096;
+            static constexpr size_t maxChunks = 1024;
+
+            explicit threadBuffer(int id) : id(id)
+            {
+                for (auto& chunk : chunks)
+                {
+                    chunk.store(nullptr, std::memory_order_relaxed);
+                }
+            }
+
+            ~threadBuffer()
+            {
+                for (auto& chunk : chunks)
+                {
+                    delete[] chunk.load(std::memory_order_relaxed);
+                }
+            }
+
+            // Owner thread only. Drops events once the table is full.
+            void append(const event& e)
+            {
+                size_t n = count.load(std::memory_order_relaxed);
+                size_t c = n / chunkSize;
+                if (c >= maxChunks)
+                {
+                    return;
+                }
+                event* chunk = chunks[c].load(std::memory_order_relaxed);
+                if (!chunk)
+                {
+                    chunk = new event[chunkSize];
+                    chunks[c].store(chunk, std::memory_order_release);
+                }
+                chunk[n % chunkSize] = e;
+                count.store(n + 1, std::memory_order_release);
+            }
+
+            template <typename Use>
+            void forEach(Use&& use) const
+            {
+                size_t n = count.load(std::memory_order_acquire);
+                for (size_t i = 0; i < n; i++)
+                {
+                    use(chunks[i / chunkSize].load(std::memory_order_acquire)[i % chunkSize]);
+                }
+            }
+
+            const int id;
+
+        private:
+            std::atomic<size_t> count{0};
+            std::atomic<event*> chunks[maxChunks];
+    };
+
+    // Buffers live until exit, a thread may finish before the trace is written.
+    class registry
+    {
+        public:
+            static registry& instance()
+            {
+                static registry r;
+                return r;
+            }
+
+            threadBuffer& local()
+            {
+                thread_local threadBuffer* buffer = nullptr;
+                if (!buffer)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    buffers.push_back(std::make_unique<threadBuffer>(int(buffers.size()) + 1));
+                    buffer = buffers.back().get();
+                }
+                return *buffer;
+            }
+
+            bool write(const std::string& path)
+            {
+                FILE* file = std::fopen(path.c_str(), "w");
+                if (!file)
+                {
+                    std::cerr << "Fails to Write Trace: " << path << std::endl;
+                    return false;
+                }
+                std::fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+                std::fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"raytracing\"}}");
+
+                std::lock_guard<std::mutex> lock(mutex);
+                size_t written = 0;
+                for (auto& buffer : buffers)
+                {
+                    std::fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                        buffer->id, buffer->id);
+                    buffer->forEach([&](const event& e){
+                        // Timestamps are in microseconds, keep the nanoseconds as decimals.
+                        std::fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                            e.name, buffer->id, e.start / 1000.0, e.duration / 1000.0);
+                        if (e.value != noValue)
+                        {
+                            std::fprintf(file, ",\"args\":{\"value\":%lld}", (long long)e.value);
+                        }
+                        std::fprintf(file, "}");
+                        written++;
+                    });
+                }
+                std::fprintf(file, "\n]}\n");
+                bool ok = std::fclose(file) == 0;
+                std::clog << "Trace: " << written << " zones from " << buffers.size() << " threads written to " << path << std::endl;
+                return ok;
+            }
+
+        private:
+            std::mutex mutex;
+            std::vector<std::unique_ptr<threadBuffer>> buffers;
+    };
+
+    class zone
+    {
+        public:
+            explicit zone(const char* name, int64_t value = noValue) : name(name), value(value), start(now()) {}
+            ~zone()
+            {
+                registry::instance().local().append({name, start, now() - start, value});
+            }
+            zone(const zone&) = delete;
+            zone& operator=(const zone&) = delete;
+
+        private:
+            const char* name;
+            int64_t value;
+            int64_t start;
+    };
+
+    inline bool writeChromeTrace(const std::string& path)
+    {
+        return registry::instance().write(path);
+    }
+}
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_ZONE(name) trace::zone TRACE_CONCAT(traceZone, __LINE__)(name)
+#define TRACE_ZONE_VALUE(name, value) trace::zone TRACE_CONCAT(traceZone, __LINE__)(name, int64_t(value))
+
+#else
+
+namespace trace
+{
+    inline bool writeChromeTrace(const std::string&)
+    {
+        return false;
+    }
+}
+
+#define TRACE_ZONE(name) ((void)0)
+#define TRACE_ZONE_VALUE(name, value) ((void)0)
+
+#endif
+
+#endif
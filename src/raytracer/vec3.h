@@ -122,6 +122,45 @@ inline vec3 unitVector(const vec3& v)
     return v / v.length();
 }
 
+// Closed form sphere sampling. No rejection loop, so the number of random
+// numbers and the work per sample is fixed, and the selects compile to blends.
+
+// sin and cos for |a| <= pi/4 from their Taylor series, accurate to ~1e-11.
+// Cheaper than std::sin/cos, which have to handle any argument.
+inline void sinCosQuarterPi(double a, double& s, double& c)
+{
+    double a2 = a*a;
+    s = a * (1 + a2*(-1.0/6 + a2*(1.0/120 + a2*(-1.0/5040 + a2*(1.0/362880 + a2*(-1.0/39916800))))));
+    c = 1 + a2*(-0.5 + a2*(1.0/24 + a2*(-1.0/720 + a2*(1.0/40320 + a2*(-1.0/3628800 + a2*(1.0/479001600))))));
+}
+
+// sin and cos of 2 pi t for t in [0, 1]: split into the nearest quarter turn
+// and a remainder within pi/4, then rotate by the quarter turns with selects.
+inline void sinCosTurns(double t, double& s, double& c)
+{
+    // t is never negative, so truncation rounds without a call to floor.
+    int q = int(t*4 + 0.5);
+    double sa, ca;
+    sinCosQuarterPi(2*pi*(t - q*0.25), sa, ca);
+
+    double odd = q & 1;
+    double sign = 1 - (q & 2);
+    s = sign * (odd * ca + (1 - odd) * sa);
+    c = sign * ((1 - odd) * ca - odd * sa);
+}
+
+// Archimedes: z is uniform on [-1, 1] for points uniform on the sphere.
+inline vec3 sphericalDirection(double u, double v)
+{
+    double z = 1 - 2*u;
+    double r = std::sqrt(std::fmax(0.0, 1 - z*z));
+    double s, c;
+    sinCosTurns(v, s, c);
+    return vec3(r * c, r * s, z);
+}
+
+// Kept as rejection: with only two coordinates, 79% of tries land in the
+// disk, and the loop beats sqrt plus sin and cos unless those get FMA.
 inline vec3 randomInUnitDisk()
 {
     while (true)
@@ -136,13 +175,9 @@ inline vec3 randomInUnitDisk()
 
 inline vec3 randomUnitVector()
 {
-    while(true)
-    {
-        auto p = vec3::random(-1, 1);
-        auto lensq = p.lengthSquared();
-        if (1e-160 < lensq && lensq <= 1)
-            return p / sqrt(lensq);
-    }
+    double u = randomDouble();
+    double v = randomDouble();
+    return sphericalDirection(u, v);
 }
 
 inline vec3 randomOnHemisphere(const vec3& normal)
@@ -0,0 +1,283 @@
+// Accelerator benchmark: build time and traversal speed of the linear list,
+// BVH and grid on sphere sets of different sizes and distributions.
+//
+//  accel_bench [counts=n,n,...] [rays=N] [only=field|uniform|clustered|radii] [seed=N]
+//
+// For every distribution and count, each accelerator is built from the same
+// spheres and shot with the same rays: closest hit rays from outside the
+// bounds towards a point inside, like camera rays, and shadow rays between
+// two points inside, like occlusion tests. Prints build ms, ns per closest
+// hit and per shadow ray, and which one automatic mode picks. The list is
+// skipped above listLimit spheres, it would take all day. Hits are checked
+// against the BVH's, any other closest hit distance is reported.
+
+#include "raytracer/accelerator.h"
+#include "raytracer/scene.h"
+#include "raytracer/scenes.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+static constexpr size_t listLimit = 20000;
+
+struct benchSettings
+{
+    std::vector<size_t> counts = {1000, 10000, 100000, 1000000};
+    size_t rays = 200000;
+    std::string only;
+    uint64_t seed = 1;
+};
+
+static double uniform(uint64_t seed, uint64_t i)
+{
+    return (mixBits(seed ^ mixBits(i)) >> 11) * 0x1.0p-53;
+}
+
+// The jittered grid buildSphereField lays out, which is what startRayTracer
+// renders for a sphere count.
+static void field(std::vector<compactSphere>& spheres, size_t count, uint64_t seed)
+{
+    sphereFieldLayout layout(count, seed);
+    spheres.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        spheres[i] = layout.at(i);
+        spheres[i].material = 0;
+    }
+}
+
+// Evenly in a cube, about one sphere per unit volume.
+static void uniformCube(std::vector<compactSphere>& spheres, size_t count, uint64_t seed)
+{
+    float side = float(std::cbrt(double(count)));
+    spheres.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        spheres[i] = {{float(uniform(seed, 3 * i) * side), float(uniform(seed, 3 * i + 1) * side), float(uniform(seed, 3 * i + 2) * side)}, 0.2f, 0};
+    }
+}
+
+// Sixteen tight clusters spread through the same cube: mostly empty space.
+static void clustered(std::vector<compactSphere>& spheres, size_t count, uint64_t seed)
+{
+    float side = float(std::cbrt(double(count)));
+    float spread = side / 50;
+    spheres.resize(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t cluster = i % 16;
+        float c[3];
+        for (int a = 0; a < 3; a++)
+        {
+            // Sum of three uniforms, roughly normal around the cluster center.
+            double offset = uniform(seed, 8 * i + a) + uniform(seed, 8 * i + 3 + a) + uniform(seed ^ 1, 8 * i + a) - 1.5;
+            c[a] = float(uniform(seed ^ 2, 3 * cluster + a) * side + offset * spread);
+        }
+        spheres[i] = {{c[0], c[1], c[2]}, 0.02f, 0};
+    }
+}
+
+// Evenly spread, but radii from 0.05 to 5, many small and few large.
+static void mixedRadii(std::vector<compactSphere>& spheres, size_t count, uint64_t seed)
+{
+    uniformCube(spheres, count, seed);
+    for (size_t i = 0; i < count; i++)
+    {
+        spheres[i].radius = float(0.05 * std::pow(100.0, std::pow(uniform(seed ^ 3, i), 4)));
+    }
+}
+
+struct distribution
+{
+    const char* name;
+    void (*make)(std::vector<compactSphere>& spheres, size_t count, uint64_t seed);
+};
+
+static const distribution distributions[] = {
+    {"field", field},
+    {"uniform", uniformCube},
+    {"clustered", clustered},
+    {"radii", mixedRadii},
+};
+
+struct rayBatch
+{
+    std::vector<ray> closest;
+    std::vector<ray> shadow;
+};
+
+static rayBatch makeRays(const std::vector<compactSphere>& spheres, size_t count, uint64_t seed)
+{
+    double lo[3];
+    double hi[3];
+    sphere_grid::bounds(spheres, lo, hi);
+    point3 low(lo[0], lo[1], lo[2]);
+    point3 size = point3(hi[0], hi[1], hi[2]) - low;
+    point3 middle = low + 0.5 * size;
+    double reach = size.length();
+    auto inside = [&](uint64_t i){
+        return low + vec3(uniform(seed, i) * size.x(), uniform(seed, i + 1) * size.y(), uniform(seed, i + 2) * size.z());
+    };
+
+    rayBatch batch;
+    batch.closest.reserve(count);
+    batch.shadow.reserve(count);
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t k = 16 * i;
+        double z = 2 * uniform(seed ^ 5, k) - 1;
+        double phi = 2 * pi * uniform(seed ^ 5, k + 1);
+        double s = std::sqrt(1 - z * z);
+        point3 from = middle + reach * vec3(s * std::cos(phi), z, s * std::sin(phi));
+        batch.closest.push_back(ray(from, inside(k + 2) - from));
+
+        point3 a = inside(k + 5);
+        batch.shadow.push_back(ray(a, inside(k + 8) - a));
+    }
+    return batch;
+}
+
+struct timing
+{
+    double buildMs = -1;
+    double closestNs = -1;
+    double shadowNs = -1;
+    size_t hits = 0;
+    size_t mismatches = 0;
+};
+
+static timing measure(acceleratorKind kind, const std::vector<compactSphere>& spheres, const std::vector<const material*>& materials,
+    const rayBatch& rays, std::vector<double>& distances, bool reference)
+{
+    using clock = std::chrono::steady_clock;
+    timing result;
+    scene world;
+    auto start = clock::now();
+    const hittable* accelerator = buildAccelerator(world, kind, spheres, materials);
+    result.buildMs = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+
+    if (reference)
+    {
+        distances.assign(rays.closest.size(), -1);
+    }
+    start = clock::now();
+    for (size_t i = 0; i < rays.closest.size(); i++)
+    {
+        hitCandidate candidate;
+        double t = accelerator->intersect(rays.closest[i], interval(0.001, infinity), candidate) ? candidate.t : -1;
+        result.hits += t >= 0;
+        if (reference)
+        {
+            distances[i] = t;
+        } else if (t != distances[i]) {
+            result.mismatches++;
+        }
+    }
+    result.closestNs = std::chrono::duration<double, std::nano>(clock::now() - start).count() / rays.closest.size();
+
+    start = clock::now();
+    size_t blocked = 0;
+    for (const auto& r : rays.shadow)
+    {
+        blocked += accelerator->occluded(r, interval(0.001, 1));
+    }
+    result.shadowNs = std::chrono::duration<double, std::nano>(clock::now() - start).count() / rays.shadow.size();
+    // Keeps the loop from being optimised away.
+    if (blocked > rays.shadow.size())
+    {
+        std::printf("?\n");
+    }
+    return result;
+}
+
+static void run(const benchSettings& settings)
+{
+    diffuse grey(color(0.5, 0.5, 0.5));
+    std::vector<const material*> materials = {&grey};
+    const acceleratorKind kinds[] = {acceleratorKind::bvh, acceleratorKind::grid, acceleratorKind::list};
+
+    std::printf("%-10s %9s  %-5s %10s %12s %12s %8s  %s\n", "scene", "spheres", "accel", "build ms", "closest ns", "shadow ns", "hits", "notes");
+    for (const auto& d : distributions)
+    {
+        if (!settings.only.empty() && settings.only != d.name)
+        {
+            continue;
+        }
+        for (size_t count : settings.counts)
+        {
+            std::vector<compactSphere> spheres;
+            d.make(spheres, count, settings.seed);
+            rayBatch rays = makeRays(spheres, settings.rays, settings.seed);
+            sphereDistribution stats = sphereDistribution::measure(spheres);
+            acceleratorKind picked = chooseAccelerator(stats);
+
+            std::vector<double> distances;
+            for (acceleratorKind kind : kinds)
+            {
+                if (kind == acceleratorKind::list && count > listLimit)
+                {
+                    continue;
+                }
+                timing t = measure(kind, spheres, materials, rays, distances, kind == acceleratorKind::bvh);
+                std::string notes = kind == picked ? "auto" : "";
+                if (t.mismatches > 0)
+                {
+                    notes += (notes.empty() ? "" : ", ") + std::to_string(t.mismatches) + " hits differ from bvh";
+                }
+                std::printf("%-10s %9zu  %-5s %10.2f %12.1f %12.1f %8zu  %s\n", d.name, count, acceleratorName(kind),
+                    t.buildMs, t.closestNs, t.shadowNs, t.hits, notes.c_str());
+            }
+            std::printf("%-10s %9zu  empty cells %.2f of %.0f across, cells per sphere %.2f\n", d.name, count,
+                stats.emptyCells, stats.cellsAcross, stats.cellsPerSphere);
+        }
+    }
+}
+
+static bool parseCounts(const std::string& list, std::vector<size_t>& counts)
+{
+    counts.clear();
+    std::istringstream in(list);
+    std::string item;
+    while (std::getline(in, item, ','))
+    {
+        char* end = nullptr;
+        double count = std::strtod(item.c_str(), &end);
+        if (end == item.c_str() || *end != '\0' || count < 1)
+        {
+            return false;
+        }
+        counts.push_back(size_t(count));
+    }
+    return !counts.empty();
+}
+
+int main(int argc, char** argv)
+{
+    benchSettings settings;
+    bool valid = true;
+    for (int i = 1; i < argc && valid; i++)
+    {
+        std::string argument = argv[i];
+        auto equals = argument.find('=');
+        std::string key = argument.substr(0, equals);
+        std::string value = equals == std::string::npos ? "" : argument.substr(equals + 1);
+        if (key == "counts") valid = parseCounts(value, settings.counts);
+        else if (key == "rays") settings.rays = size_t(std::atoll(value.c_str()));
+        else if (key == "only") settings.only = value;
+        else if (key == "seed") settings.seed = uint64_t(std::atoll(value.c_str()));
+        else valid = false;
+    }
+    if (!valid || settings.rays == 0)
+    {
+        std::cerr << "usage: accel_bench [counts=n,n,...] [rays=N] [only=field|uniform|clustered|radii] [seed=N]" << std::endl;
+        return 1;
+    }
+    run(settings);
+    return 0;
+}
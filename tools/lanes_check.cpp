@@ -0,0 +1,225 @@
+// Checks that the SIMD paths match the scalar code they stand in for.
+//
+//  lanes_check [samples=N] [seed=N]
+//
+// First every double_lanes operation against the same operation on plain
+// doubles, lane by lane, to the bit. Then sphere_list's intersect, occluded
+// and hit against sphere::intersect run over the same spheres one at a time:
+// the same hit, t, primitive and normal. Sphere counts that don't fill the
+// last block are included, since that is where the padding lanes are. Exits
+// non-zero on any mismatch, so it can run after a change to double_lanes.h or
+// sphere_list.h, or on a new compiler or target.
+
+#include "raytracer/rtweekend.h"
+#include "raytracer/material.h"
+#include "raytracer/sphere_list.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+struct checkSettings
+{
+    size_t samples = 200000;
+    uint64_t seed = 1;
+};
+
+static size_t mismatches = 0;
+
+static bool sameBits(double a, double b)
+{
+    // Any NaN matches any NaN, the payload is not something the code relies on.
+    if (std::isnan(a) || std::isnan(b))
+    {
+        return std::isnan(a) && std::isnan(b);
+    }
+    uint64_t x, y;
+    std::memcpy(&x, &a, sizeof(x));
+    std::memcpy(&y, &b, sizeof(y));
+    return x == y;
+}
+
+static void report(const char* name, size_t failures, size_t total)
+{
+    mismatches += failures;
+    std::printf("  %-28s %zu of %zu differ  %s\n", name, failures, total, failures == 0 ? "ok" : "FAIL");
+}
+
+// Mostly ordinary values, with signed zeros, infinities, NaN and tiny
+// numbers mixed in.
+static double operand()
+{
+    switch (int(randomDouble() * 32))
+    {
+        case 0: return 0.0;
+        case 1: return -0.0;
+        case 2: return infinity;
+        case 3: return -infinity;
+        case 4: return std::nan("");
+        case 5: return randomDouble(-1, 1) * 1e-310;
+        case 6: return randomDouble(-1, 1) * 1e300;
+        default: return randomDouble(-100, 100);
+    }
+}
+
+static void checkLanes(const checkSettings& settings)
+{
+    constexpr int width = double_lanes::width;
+    alignas(double_lanes) double a[width];
+    alignas(double_lanes) double b[width];
+    alignas(double_lanes) double out[width];
+
+    size_t add = 0, subtract = 0, multiply = 0, divide = 0, root = 0, broadcast = 0, sign = 0;
+    seedRandom(settings.seed);
+    for (size_t i = 0; i < settings.samples; i++)
+    {
+        for (int lane = 0; lane < width; lane++)
+        {
+            a[lane] = operand();
+            b[lane] = operand();
+        }
+        double_lanes x = double_lanes::load(a);
+        double_lanes y = double_lanes::load(b);
+
+        auto compare = [&](const double_lanes& result, size_t& failures, auto scalar)
+        {
+            result.store(out);
+            for (int lane = 0; lane < width; lane++)
+            {
+                if (!sameBits(out[lane], scalar(a[lane], b[lane])))
+                {
+                    failures++;
+                    return;
+                }
+            }
+        };
+        compare(x + y, add, [](double p, double q){ return p + q; });
+        compare(x - y, subtract, [](double p, double q){ return p - q; });
+        compare(x * y, multiply, [](double p, double q){ return p * q; });
+        compare(x / y, divide, [](double p, double q){ return p / q; });
+        compare(sqrt(x), root, [](double p, double){ return std::sqrt(p); });
+        compare(double_lanes(b[0]), broadcast, [&](double, double){ return b[0]; });
+
+        bool anyNonNegative = false;
+        for (int lane = 0; lane < width; lane++)
+        {
+            anyNonNegative = anyNonNegative || !(a[lane] < 0);
+        }
+        sign += x.anyNonNegative() != anyNonNegative;
+    }
+
+    std::printf("double_lanes, %s backend, %d lanes\n", double_lanes::backend, width);
+    report("+", add, settings.samples);
+    report("-", subtract, settings.samples);
+    report("*", multiply, settings.samples);
+    report("/", divide, settings.samples);
+    report("sqrt", root, settings.samples);
+    report("broadcast", broadcast, settings.samples);
+    report("anyNonNegative", sign, settings.samples);
+}
+
+// What sphere_list stands in for: each sphere tested in turn, closest wins.
+static bool scalarIntersect(const std::vector<sphere>& spheres, const ray& r, interval rayT, hitCandidate& candidate)
+{
+    bool hitAnything = false;
+    auto closestSoFar = rayT.max;
+    for (size_t i = 0; i < spheres.size(); i++)
+    {
+        hitCandidate c;
+        if (spheres[i].intersect(r, interval(rayT.min, closestSoFar), c))
+        {
+            hitAnything = true;
+            closestSoFar = c.t;
+            candidate.t = c.t;
+            candidate.primitive = uint32_t(i);
+        }
+    }
+    return hitAnything;
+}
+
+static void checkSphereList(const checkSettings& settings)
+{
+    std::printf("sphere_list against sphere\n");
+    seedRandom(settings.seed);
+    // 1 to 2 * width + 1 spheres leave the last block part filled.
+    for (size_t count : {size_t(1), size_t(2), size_t(3), size_t(5), size_t(8), size_t(9), size_t(100), size_t(487)})
+    {
+        sphere_list list;
+        std::vector<point3> centers;
+        for (size_t i = 0; i < count; i++)
+        {
+            centers.emplace_back(randomDouble(-10, 10), randomDouble(-2, 2), randomDouble(-10, 10));
+            list.spheres.emplace_back(centers.back(), randomDouble(0.05, 2), nullptr);
+        }
+        list.pack();
+
+        size_t rays = settings.samples / 8;
+        size_t hits = 0, intersectFailures = 0, occludedFailures = 0, hitFailures = 0;
+        for (size_t i = 0; i < rays; i++)
+        {
+            // Some rays start inside a sphere, where the far root wins.
+            point3 origin = randomDouble() < 0.25
+                ? centers[size_t(randomDouble() * count)]
+                : point3(randomDouble(-15, 15), randomDouble(-5, 5), randomDouble(-15, 15));
+            vec3 direction = randomDouble(0.1, 3) * randomUnitVector();
+            ray r(origin, direction);
+            interval rayT(randomDouble() < 0.5 ? 0.001 : 0, randomDouble() < 0.8 ? infinity : randomDouble(0, 20));
+
+            hitCandidate expected, actual;
+            bool expectedHit = scalarIntersect(list.spheres, r, rayT, expected);
+            bool actualHit = list.intersect(r, rayT, actual);
+            hits += expectedHit;
+            if (expectedHit != actualHit || (expectedHit && (!sameBits(expected.t, actual.t) || expected.primitive != actual.primitive || actual.object != &list)))
+            {
+                intersectFailures++;
+            }
+            occludedFailures += list.occluded(r, rayT) != expectedHit;
+
+            hitRecord expectedRecord, actualRecord;
+            if (expectedHit && list.hit(r, rayT, actualRecord))
+            {
+                list.spheres[expected.primitive].finalize(r, expected, expectedRecord);
+                bool same = sameBits(expectedRecord.t, actualRecord.t);
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    same = same && sameBits(expectedRecord.normal[axis], actualRecord.normal[axis]);
+                }
+                hitFailures += !same;
+            }
+        }
+
+        std::printf(" %zu spheres, %zu of %zu rays hit\n", count, hits, rays);
+        report("intersect", intersectFailures, rays);
+        report("occluded", occludedFailures, rays);
+        report("hit", hitFailures, hits);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    checkSettings settings;
+    bool valid = true;
+    for (int i = 1; i < argc && valid; i++)
+    {
+        std::string argument = argv[i];
+        auto equals = argument.find('=');
+        std::string key = argument.substr(0, equals);
+        std::string value = equals == std::string::npos ? "" : argument.substr(equals + 1);
+        if (key == "samples") settings.samples = size_t(std::atoll(value.c_str()));
+        else if (key == "seed") settings.seed = uint64_t(std::atoll(value.c_str()));
+        else valid = false;
+    }
+    if (!valid || settings.samples < 1000)
+    {
+        std::cerr << "usage: lanes_check [samples=N] [seed=N]" << std::endl;
+        return 1;
+    }
+
+    checkLanes(settings);
+    checkSphereList(settings);
+    std::printf(mismatches == 0 ? "all checks passed\n" : "some checks FAILED\n");
+    return mismatches == 0 ? 0 : 1;
+}
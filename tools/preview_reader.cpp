@@ -0,0 +1,112 @@
+// Headless viewer for the renderer's shared memory preview.
+//
+//  preview_reader [segment] [--ppm file.ppm]
+//
+// Polls the segment, prints a line per frame it sees (frame number, tiles
+// refreshed, sample range and mean luminance) and optionally writes the last
+// frame as an 8 bit PPM once the render reports it is finished.
+
+#include "raytracer/preview_stream.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+int main(int argc, char** argv)
+{
+    std::string segment = "/raytracer-preview";
+    const char* ppmPath = nullptr;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!std::strcmp(argv[i], "--ppm") && i + 1 < argc)
+        {
+            ppmPath = argv[++i];
+        } else {
+            segment = argv[i];
+        }
+    }
+
+    previewReader reader;
+    std::printf("Waiting for %s\n", segment.c_str());
+    while (!reader.open(segment))
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    uint64_t lastFrame = 0;
+    std::vector<uint8_t> rgb;
+    int width = 0, height = 0;
+    for (;;)
+    {
+        // Read finished before the frame, so the frame read after it is the last one.
+        bool done = reader.finished();
+        uint64_t frame = 0;
+        int refreshed = 0, tiles = 0;
+        uint32_t minSamples = 0, maxSamples = 0;
+        double luminance = 0;
+        bool consistent = reader.read([&](const previewView& view){
+            frame = view.frame;
+            if (frame == lastFrame)
+            {
+                return;
+            }
+            tiles = view.tilesX * view.tilesY;
+            for (int tile = 0; tile < tiles; tile++)
+            {
+                refreshed += view.tileDirty(tile);
+            }
+            size_t count = size_t(view.width) * view.height;
+            for (size_t i = 0; i < count; i++)
+            {
+                luminance += 0.2126 * view.r[i] + 0.7152 * view.g[i] + 0.0722 * view.b[i];
+            }
+            luminance /= count;
+            minSamples = view.minSamples;
+            maxSamples = view.maxSamples;
+
+            if (ppmPath)
+            {
+                width = view.width;
+                height = view.height;
+                rgb.resize(count * 3);
+                floatToSrgb8(view.r, view.g, view.b, rgb.data(), count);
+            }
+        });
+
+        // Nothing published yet, or the publisher lapped us mid read.
+        if (!consistent)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+        if (frame != lastFrame)
+        {
+            std::printf("frame %llu: %d/%d tiles refreshed, %u-%u spp, mean luminance %.4f\n",
+                (unsigned long long)frame, refreshed, tiles, minSamples, maxSamples, luminance);
+            lastFrame = frame;
+        }
+        if (done)
+        {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+
+    if (ppmPath && !rgb.empty())
+    {
+        FILE* file = std::fopen(ppmPath, "wb");
+        if (!file)
+        {
+            std::fprintf(stderr, "Fails to Write Image: %s\n", ppmPath);
+            return 1;
+        }
+        std::fprintf(file, "P6\n%d %d\n255\n", width, height);
+        std::fwrite(rgb.data(), 1, rgb.size(), file);
+        std::fclose(file);
+        std::printf("Wrote %s\n", ppmPath);
+    }
+    return 0;
+}
@@ -0,0 +1,238 @@
+// Render service on a Unix domain socket.
+//
+//  render_daemon serve [socket] [threads=N] [runners=N] [budgetMB=N]
+//  render_daemon send [socket] <command...>
+//
+// One request per connection, one line each way (list and scenes answer with
+// several lines). Commands:
+//
+//  submit key=value ...   queue a job, answers "job=<id>". Keys: priority,
+//                         scene, sceneSeed, aspect, width, spp, budget
+//                         (seconds, instead of spp), depth, fov,
+//                         from=x,y,z, at=x,y,z, up=x,y,z, defocus, focus,
+//                         seed, denoise, guiding, output
+//  status job=<id>        state, progress and timings of one job
+//  wait job=<id>          same, once the job has finished
+//  list                   every job the service remembers
+//  scenes                 resident scenes and their memory
+//  shutdown               finish running jobs and exit
+
+#include "raytracer/render_service.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+
+static const char* defaultSocket = "/tmp/raytracer.sock";
+
+static bool makeAddress(const std::string& path, sockaddr_un& address)
+{
+    if (path.size() >= sizeof(address.sun_path))
+    {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return false;
+    }
+    std::memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+    return true;
+}
+
+static std::string readLine(int fd)
+{
+    std::string line;
+    char c;
+    while (read(fd, &c, 1) == 1 && c != '\n')
+    {
+        line += c;
+    }
+    return line;
+}
+
+static void writeAll(int fd, const std::string& text)
+{
+    size_t sent = 0;
+    while (sent < text.size())
+    {
+        ssize_t n = write(fd, text.data() + sent, text.size() - sent);
+        if (n <= 0)
+        {
+            return;
+        }
+        sent += size_t(n);
+    }
+}
+
+static uint64_t jobArgument(const std::string& arguments)
+{
+    unsigned long long id = 0;
+    return std::sscanf(arguments.c_str(), " job=%llu", &id) == 1 ? id : 0;
+}
+
+// Answer to one request line. Sets quit on shutdown.
+static std::string handle(renderService& service, const std::string& line, bool& quit)
+{
+    auto space = line.find(' ');
+    std::string command = line.substr(0, space);
+    std::string arguments = space == std::string::npos ? std::string() : line.substr(space + 1);
+
+    if (command == "submit")
+    {
+        renderJob job;
+        std::string error;
+        if (!job.parse(arguments, error))
+        {
+            return "error " + error + "\n";
+        }
+        return "job=" + std::to_string(service.submit(job)) + "\n";
+    }
+    if (command == "status" || command == "wait")
+    {
+        uint64_t id = jobArgument(arguments);
+        std::string status = command == "wait" ? service.wait(id) : service.status(id);
+        return status.empty() ? "error unknown job\n" : status + "\n";
+    }
+    if (command == "list")
+    {
+        return service.list() + "end\n";
+    }
+    if (command == "scenes")
+    {
+        return service.scenes().describe() + "end\n";
+    }
+    if (command == "shutdown")
+    {
+        quit = true;
+        return "ok\n";
+    }
+    return "error unknown command " + command + "\n";
+}
+
+static int serve(const std::string& path, int threads, int runners, size_t budgetMB)
+{
+    sockaddr_un address;
+    if (!makeAddress(path, address))
+    {
+        return 1;
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path.c_str());
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 16) != 0)
+    {
+        std::perror("render_daemon");
+        return 1;
+    }
+    // Only this user may submit jobs, they write files wherever they say.
+    chmod(path.c_str(), 0600);
+
+    renderService service(threads, runners);
+    service.scenes().budgetBytes = budgetMB << 20;
+    std::clog << "Listening on " << path << std::endl;
+
+    std::atomic<bool> quit(false);
+    std::atomic<int> connections(0);
+    while (!quit)
+    {
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0)
+        {
+            continue;
+        }
+        // wait can block for a whole render, so every connection gets a thread.
+        connections++;
+        std::thread([&service, &quit, &connections, client, listener]{
+            bool stop = false;
+            writeAll(client, handle(service, readLine(client), stop));
+            close(client);
+            if (stop)
+            {
+                quit = true;
+                shutdown(listener, SHUT_RDWR);
+            }
+            connections--;
+        }).detach();
+    }
+
+    close(listener);
+    unlink(path.c_str());
+    // Queued jobs fail here, which also releases anyone still in wait.
+    service.shutdown();
+    while (connections > 0)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    trace::writeChromeTrace("render_daemon_trace.json");
+    return 0;
+}
+
+static int sendRequest(const std::string& path, const std::string& request)
+{
+    sockaddr_un address;
+    if (!makeAddress(path, address))
+    {
+        return 1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        std::perror("render_daemon");
+        return 1;
+    }
+    writeAll(fd, request + "\n");
+    char buffer[4096];
+    ssize_t n;
+    std::string reply;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        reply.append(buffer, size_t(n));
+    }
+    close(fd);
+    std::cout << reply;
+    return reply.compare(0, 5, "error") == 0 ? 1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+    std::string mode = argc > 1 ? argv[1] : "";
+    int next = 2;
+    std::string path = defaultSocket;
+    if (argc > next && argv[next][0] == '/')
+    {
+        path = argv[next++];
+    }
+
+    if (mode == "serve")
+    {
+        int threads = 0, runners = 1;
+        size_t budgetMB = 512;
+        for (int i = next; i < argc; i++)
+        {
+            std::sscanf(argv[i], "threads=%d", &threads);
+            std::sscanf(argv[i], "runners=%d", &runners);
+            std::sscanf(argv[i], "budgetMB=%zu", &budgetMB);
+        }
+        return serve(path, threads, runners, budgetMB);
+    }
+    if (mode == "send" && argc > next)
+    {
+        std::string request;
+        for (int i = next; i < argc; i++)
+        {
+            request += (request.empty() ? "" : " ") + std::string(argv[i]);
+        }
+        return sendRequest(path, request);
+    }
+
+    std::cerr << "usage: render_daemon serve [socket] [threads=N] [runners=N] [budgetMB=N]\n"
+              << "       render_daemon send [socket] <command...>" << std::endl;
+    return 1;
+}
@@ -0,0 +1,245 @@
+// Statistical check and timing of the samplers in vec3.h.
+//
+//  sampler_check [samples=N] [seed=N]
+//
+// Draws samples from randomUnitVector, randomInUnitDisk and the diffuse
+// bounce (normal + randomUnitVector) and checks each against the
+// distribution it should follow: moments within five standard errors, and a
+// chi-square test of 16 equal probability bins. Then times randomUnitVector
+// against the rejection sampler it replaced. Exits non-zero if any check
+// fails, so it can run after a change to the samplers.
+
+#include "raytracer/rtweekend.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+static constexpr int bins = 16;
+// 15 degrees of freedom, 0.1% significance.
+static constexpr double chiSquareLimit = 37.70;
+
+struct checkSettings
+{
+    size_t samples = 4000000;
+    uint64_t seed = 1;
+};
+
+struct histogram
+{
+    std::vector<size_t> counts = std::vector<size_t>(bins, 0);
+    size_t total = 0;
+
+    // x uniform on [0, 1) under the expected distribution.
+    void add(double x)
+    {
+        int bin = int(x * bins);
+        counts[bin < 0 ? 0 : (bin >= bins ? bins - 1 : bin)]++;
+        total++;
+    }
+
+    double chiSquare() const
+    {
+        double expected = double(total) / bins;
+        double sum = 0;
+        for (size_t count : counts)
+        {
+            sum += (count - expected) * (count - expected) / expected;
+        }
+        return sum;
+    }
+};
+
+// Mean and standard error of a sampled quantity.
+struct moment
+{
+    double sum = 0;
+    double sumSquares = 0;
+    size_t count = 0;
+
+    void add(double x)
+    {
+        sum += x;
+        sumSquares += x * x;
+        count++;
+    }
+
+    double mean() const {return sum / count;}
+    double standardError() const {return std::sqrt(std::fmax(0.0, sumSquares / count - mean() * mean()) / count);}
+};
+
+static bool passed = true;
+
+static void reportMoment(const char* name, const moment& m, double expected)
+{
+    double error = std::fabs(m.mean() - expected);
+    bool ok = error <= 5 * m.standardError() + 1e-12;
+    passed = passed && ok;
+    std::printf("  %-22s %10.6f  expected %10.6f  %s\n", name, m.mean(), expected, ok ? "ok" : "FAIL");
+}
+
+static void reportChiSquare(const char* name, const histogram& h)
+{
+    double chi = h.chiSquare();
+    bool ok = chi < chiSquareLimit;
+    passed = passed && ok;
+    std::printf("  %-22s %10.2f  limit    %10.2f  %s\n", name, chi, chiSquareLimit, ok ? "ok" : "FAIL");
+}
+
+// Angle about the z axis, as a fraction of a turn in [0, 1).
+static double turns(const vec3& v)
+{
+    double t = std::atan2(v.y(), v.x()) / (2 * pi);
+    return t < 0 ? t + 1 : t;
+}
+
+static void checkUnitVector(const checkSettings& settings)
+{
+    moment x, y, z, zSquared, length;
+    histogram height, angle;
+    seedRandom(settings.seed);
+    for (size_t i = 0; i < settings.samples; i++)
+    {
+        vec3 v = randomUnitVector();
+        x.add(v.x());
+        y.add(v.y());
+        z.add(v.z());
+        zSquared.add(v.z() * v.z());
+        length.add(v.length());
+        // Archimedes: z is uniform on [-1, 1], the angle uniform around it.
+        height.add(0.5 * (v.z() + 1));
+        angle.add(turns(v));
+    }
+    std::printf("randomUnitVector\n");
+    reportMoment("E[x]", x, 0);
+    reportMoment("E[y]", y, 0);
+    reportMoment("E[z]", z, 0);
+    reportMoment("E[z^2]", zSquared, 1.0 / 3);
+    reportMoment("E[|v|]", length, 1);
+    reportChiSquare("chi^2 z", height);
+    reportChiSquare("chi^2 angle", angle);
+}
+
+static void checkUnitDisk(const checkSettings& settings)
+{
+    moment x, y, radiusSquared;
+    histogram area, angle;
+    seedRandom(settings.seed);
+    for (size_t i = 0; i < settings.samples; i++)
+    {
+        vec3 p = randomInUnitDisk();
+        x.add(p.x());
+        y.add(p.y());
+        radiusSquared.add(p.lengthSquared());
+        // Uniform by area: r^2 is uniform on [0, 1).
+        area.add(p.lengthSquared());
+        angle.add(turns(p));
+    }
+    std::printf("randomInUnitDisk\n");
+    reportMoment("E[x]", x, 0);
+    reportMoment("E[y]", y, 0);
+    reportMoment("E[r^2]", radiusSquared, 0.5);
+    reportChiSquare("chi^2 r^2", area);
+    reportChiSquare("chi^2 angle", angle);
+}
+
+// What diffuse::scatter does: about the normal (0, 0, 1), so the result
+// should be cosine weighted.
+static void checkDiffuseBounce(const checkSettings& settings)
+{
+    const vec3 normal(0, 0, 1);
+    moment cosine;
+    histogram cosineSquared, angle;
+    seedRandom(settings.seed);
+    for (size_t i = 0; i < settings.samples; i++)
+    {
+        vec3 direction = normal + randomUnitVector();
+        if (direction.nearZero())
+        {
+            continue;
+        }
+        direction = unitVector(direction);
+        cosine.add(direction.z());
+        // Cosine weighted: cos^2 is uniform on [0, 1).
+        cosineSquared.add(direction.z() * direction.z());
+        angle.add(turns(direction));
+    }
+    std::printf("diffuse bounce\n");
+    reportMoment("E[cos]", cosine, 2.0 / 3);
+    reportChiSquare("chi^2 cos^2", cosineSquared);
+    reportChiSquare("chi^2 angle", angle);
+}
+
+// The sampler randomUnitVector replaced, for the timing.
+static vec3 rejectionUnitVector()
+{
+    while (true)
+    {
+        auto p = vec3::random(-1, 1);
+        auto lensq = p.lengthSquared();
+        if (1e-160 < lensq && lensq <= 1)
+            return p / sqrt(lensq);
+    }
+}
+
+template <typename Sampler>
+static double secondsFor(size_t samples, Sampler&& sample)
+{
+    using clock = std::chrono::steady_clock;
+    vec3 sum(0, 0, 0);
+    auto start = clock::now();
+    for (size_t i = 0; i < samples; i++)
+    {
+        sum += sample();
+    }
+    double seconds = std::chrono::duration<double>(clock::now() - start).count();
+    // Keeps the loop from being optimised away.
+    if (sum.x() == 12345.678)
+    {
+        std::printf("?\n");
+    }
+    return seconds;
+}
+
+static void timeSamplers(const checkSettings& settings)
+{
+    seedRandom(settings.seed);
+    double closed = secondsFor(settings.samples, []{ return randomUnitVector(); });
+    double rejection = secondsFor(settings.samples, []{ return rejectionUnitVector(); });
+    double disk = secondsFor(settings.samples, []{ return randomInUnitDisk(); });
+    std::printf("timing, %zu samples\n", settings.samples);
+    std::printf("  %-22s %8.3fs\n", "randomUnitVector", closed);
+    std::printf("  %-22s %8.3fs\n", "rejection unit vector", rejection);
+    std::printf("  %-22s %8.3fs\n", "randomInUnitDisk", disk);
+}
+
+int main(int argc, char** argv)
+{
+    checkSettings settings;
+    bool valid = true;
+    for (int i = 1; i < argc && valid; i++)
+    {
+        std::string argument = argv[i];
+        auto equals = argument.find('=');
+        std::string key = argument.substr(0, equals);
+        std::string value = equals == std::string::npos ? "" : argument.substr(equals + 1);
+        if (key == "samples") settings.samples = size_t(std::atoll(value.c_str()));
+        else if (key == "seed") settings.seed = uint64_t(std::atoll(value.c_str()));
+        else valid = false;
+    }
+    if (!valid || settings.samples < 1000)
+    {
+        std::cerr << "usage: sampler_check [samples=N] [seed=N]" << std::endl;
+        return 1;
+    }
+
+    checkUnitVector(settings);
+    checkUnitDisk(settings);
+    checkDiffuseBounce(settings);
+    timeSamplers(settings);
+    std::printf(passed ? "all checks passed\n" : "some checks FAILED\n");
+    return passed ? 0 : 1;
+}